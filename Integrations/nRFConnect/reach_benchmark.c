@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2023-2024 i3 Product Development
+ * 
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file      reach_benchmark.c
+ * @brief     BLE throughput and latency benchmark for the nRF Connect Reach integration
+ * 
+ * @copyright (c) Copyright 2024 i3 Product Development. All Rights Reserved.
+ */
+
+#include "reach_benchmark.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "reach_nrf_connect.h"
+#include "reach-server.h"
+#include "cr_stack.h"
+#include "i3_log.h"
+
+/*******************************************************************************
+ *******************************   DEFINES   ***********************************
+ ******************************************************************************/
+
+// Default define values, which can be overridden in the .h file as needed
+#ifndef BENCHMARK_STREAM_BATCH
+#define BENCHMARK_STREAM_BATCH 8
+#endif // BENCHMARK_STREAM_BATCH
+
+#ifndef BENCHMARK_MAX_RTT_SAMPLES
+#define BENCHMARK_MAX_RTT_SAMPLES 256
+#endif // BENCHMARK_MAX_RTT_SAMPLES
+
+#ifndef BENCHMARK_ECHO_TIMEOUT_MS
+#define BENCHMARK_ECHO_TIMEOUT_MS 1000
+#endif // BENCHMARK_ECHO_TIMEOUT_MS
+
+#ifndef BENCHMARK_DRAIN_TIMEOUT_MS
+#define BENCHMARK_DRAIN_TIMEOUT_MS 500
+#endif // BENCHMARK_DRAIN_TIMEOUT_MS
+
+/*******************************************************************************
+ ****************************   LOCAL  TYPES   *********************************
+ ******************************************************************************/
+
+typedef struct {
+    int session;
+    uint32_t count;
+    uint32_t size;
+    // Frames sent (stream and echo) or received (sink)
+    uint32_t sent;
+    uint32_t bytes;
+    uint32_t start_cycles;
+    uint32_t last_send_cycles;
+    int64_t last_send_ms;
+    // Echo state
+    bool waiting;
+    uint32_t rtt_count;
+    // Snapshots of the BLE statistics when the run started
+    atomic_val_t start_notify_failed;
+    atomic_val_t start_notify_completed;
+    uint32_t failures;
+} run_t;
+
+/*******************************************************************************
+ *********************   LOCAL FUNCTION PROTOTYPES   ***************************
+ ******************************************************************************/
+
+static void send_frame(rnrfc_benchmark_frame_t type, uint32_t size);
+static void finish(uint32_t end_cycles);
+static int compare_u32(const void *a, const void *b);
+
+/*******************************************************************************
+ ***************************  LOCAL VARIABLES   ********************************
+ ******************************************************************************/
+
+static run_t run = { .session = -1 };
+static rnrfc_benchmark_results_t results;
+static uint32_t rtt_samples_us[BENCHMARK_MAX_RTT_SAMPLES];
+static uint8_t frame[CR_CODED_BUFFER_SIZE];
+
+/*******************************************************************************
+ **************************   GLOBAL FUNCTIONS   *******************************
+ ******************************************************************************/
+
+int rnrfc_benchmark_start(rnrfc_benchmark_mode_t mode, uint32_t count, uint32_t size)
+{
+    if (results.mode != RNRFC_BENCHMARK_IDLE || mode == RNRFC_BENCHMARK_IDLE || count == 0)
+        return -1;
+    int session = rnrfc_get_active_session();
+    if (size == 0)
+        size = (uint32_t) rnrfc_get_max_response_size(session);
+    if (size < RNRFC_BENCHMARK_FRAME_HEADER_SIZE || size > CR_CODED_BUFFER_SIZE)
+        return -1;
+
+    memset(&run, 0, sizeof(run));
+    run.session = session;
+    run.count = count;
+    run.size = size;
+    run.start_cycles = k_cycle_get_32();
+    run.start_notify_failed = atomic_get(&rnrfc_get_stats()->notify_failed);
+    run.start_notify_completed = atomic_get(&rnrfc_get_stats()->notify_completed);
+    memset(&results, 0, sizeof(results));
+    results.mode = mode;
+    I3_LOG(LOG_MASK_ALWAYS, "Benchmark %d started on session %d, %u frames of %u bytes", mode, session, count, size);
+    rnrfc_request_processing();
+    return 0;
+}
+
+const rnrfc_benchmark_results_t *rnrfc_benchmark_get_results(void)
+{
+    return &results;
+}
+
+int rnrfc_benchmark_get_session(void)
+{
+    return (results.mode == RNRFC_BENCHMARK_IDLE) ? -1:run.session;
+}
+
+bool rnrfc_benchmark_handle_prompt(int session, const uint8_t *buf, size_t len)
+{
+    if (len < RNRFC_BENCHMARK_FRAME_HEADER_SIZE || buf[0] != RNRFC_BENCHMARK_FRAME_MAGIC)
+        return false;
+    // Anything from another client, or left over from an earlier run, is dropped
+    if (session != run.session)
+        return true;
+
+    uint32_t now = k_cycle_get_32();
+    uint32_t seq = sys_get_le32(&buf[2]);
+    if (results.mode == RNRFC_BENCHMARK_ECHO && buf[1] == RNRFC_BENCHMARK_FRAME_PONG && run.waiting && seq == run.sent - 1)
+    {
+        uint32_t rtt_us = k_cyc_to_us_floor32(now - sys_get_le32(&buf[6]));
+        rtt_samples_us[run.rtt_count % BENCHMARK_MAX_RTT_SAMPLES] = rtt_us;
+        run.rtt_count++;
+        run.waiting = false;
+        results.completed++;
+        // Send the next ping straight away
+        rnrfc_request_processing();
+    }
+    else if (results.mode == RNRFC_BENCHMARK_SINK && buf[1] == RNRFC_BENCHMARK_FRAME_SINK)
+    {
+        // Timing starts from the first write, so its own transfer time isn't known and its bytes aren't counted
+        if (run.sent == 0)
+            run.start_cycles = now;
+        else
+            run.bytes += (uint32_t) len;
+        run.sent++;
+        results.completed = run.sent;
+        if (run.sent >= run.count)
+            finish(now);
+    }
+    return true;
+}
+
+void rnrfc_benchmark_process(void)
+{
+    int64_t now_ms = k_uptime_get();
+    switch (results.mode)
+    {
+    case RNRFC_BENCHMARK_STREAM:
+        if (run.sent < run.count)
+        {
+            for (int i = 0; i < BENCHMARK_STREAM_BATCH && run.sent < run.count; i++)
+                send_frame(RNRFC_BENCHMARK_FRAME_STREAM, run.size);
+            results.completed = run.sent;
+            // Come straight back for the next batch, once everything else has had a turn
+            rnrfc_request_processing();
+        }
+        else
+        {
+            // The run ends once the last notification has been transmitted, not just queued
+            const rnrfc_stats_t *stats = rnrfc_get_stats();
+            uint32_t transmitted = (uint32_t) (atomic_get(&stats->notify_completed) - run.start_notify_completed);
+            if (atomic_get(&stats->notify_queue_depth) == 0 && transmitted >= run.sent - run.failures)
+                finish(k_cycle_get_32());
+            else if (now_ms - run.last_send_ms > BENCHMARK_DRAIN_TIMEOUT_MS)
+                // L2CAP doesn't report completions, so this measures up to when the last SDU was handed over
+                finish(run.last_send_cycles);
+        }
+        break;
+    case RNRFC_BENCHMARK_ECHO:
+        if (run.waiting && now_ms - run.last_send_ms > BENCHMARK_ECHO_TIMEOUT_MS)
+        {
+            I3_LOG(LOG_MASK_WARN, "Benchmark ping %u was not echoed", run.sent - 1);
+            run.failures++;
+            run.waiting = false;
+            results.completed++;
+        }
+        if (!run.waiting)
+        {
+            if (results.completed >= run.count)
+            {
+                finish(k_cycle_get_32());
+                break;
+            }
+            send_frame(RNRFC_BENCHMARK_FRAME_PING, RNRFC_BENCHMARK_FRAME_HEADER_SIZE);
+            run.waiting = true;
+        }
+        break;
+    default:
+        // Sink runs are driven entirely by incoming frames
+        break;
+    }
+}
+
+void rnrfc_benchmark_stop(void)
+{
+    if (results.mode == RNRFC_BENCHMARK_IDLE)
+        return;
+    I3_LOG(LOG_MASK_WARN, "Benchmark abandoned after %u frames", results.completed);
+    results.mode = RNRFC_BENCHMARK_IDLE;
+    run.session = -1;
+}
+
+/*******************************************************************************
+ ***************************   LOCAL FUNCTIONS    ******************************
+ ******************************************************************************/
+
+static void send_frame(rnrfc_benchmark_frame_t type, uint32_t size)
+{
+    frame[0] = RNRFC_BENCHMARK_FRAME_MAGIC;
+    frame[1] = (uint8_t) type;
+    sys_put_le32(run.sent, &frame[2]);
+    sys_put_le32(k_cycle_get_32(), &frame[6]);
+    for (uint32_t i = RNRFC_BENCHMARK_FRAME_HEADER_SIZE; i < size; i++)
+        frame[i] = (uint8_t) i;
+    // The same path as every Reach response, including the notification queue and its flow control
+    if (crcb_send_coded_response(frame, size))
+        run.failures++;
+    else
+        run.bytes += size;
+    run.sent++;
+    run.last_send_cycles = k_cycle_get_32();
+    run.last_send_ms = k_uptime_get();
+}
+
+static void finish(uint32_t end_cycles)
+{
+    uint32_t elapsed_us = k_cyc_to_us_floor32(end_cycles - run.start_cycles);
+    if (results.mode != RNRFC_BENCHMARK_ECHO && elapsed_us > 0)
+        results.bytes_per_second = (uint32_t) (((uint64_t) run.bytes * 1000000) / elapsed_us);
+
+    if (results.mode == RNRFC_BENCHMARK_ECHO && run.rtt_count > 0)
+    {
+        uint32_t samples = MIN(run.rtt_count, BENCHMARK_MAX_RTT_SAMPLES);
+        qsort(rtt_samples_us, samples, sizeof(rtt_samples_us[0]), compare_u32);
+        results.rtt_p50_us = rtt_samples_us[((samples - 1) * 50) / 100];
+        results.rtt_p99_us = rtt_samples_us[((samples - 1) * 99) / 100];
+    }
+
+    results.notify_failures = run.failures;
+    if (results.mode == RNRFC_BENCHMARK_STREAM)
+        // Includes notifications which were queued, but failed when they were handed to the Bluetooth stack
+        results.notify_failures = (uint32_t) (atomic_get(&rnrfc_get_stats()->notify_failed) - run.start_notify_failed);
+
+    I3_LOG(LOG_MASK_ALWAYS, "Benchmark %d finished: %u frames, %u bytes/s, RTT p50 %u us, p99 %u us, %u failures",
+           results.mode, results.completed, results.bytes_per_second, results.rtt_p50_us, results.rtt_p99_us, results.notify_failures);
+    results.mode = RNRFC_BENCHMARK_IDLE;
+    run.session = -1;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
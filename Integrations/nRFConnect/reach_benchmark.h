@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2023-2024 i3 Product Development
+ * 
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file      reach_benchmark.h
+ * @brief     BLE throughput and latency benchmark for the nRF Connect Reach integration
+ * 
+ * @copyright (c) Copyright 2024 i3 Product Development. All Rights Reserved.
+ */
+
+#ifndef _REACH_BENCHMARK_H_
+#define _REACH_BENCHMARK_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Benchmark frames travel over the same characteristics and L2CAP channel as Reach messages, but are handled by the
+ * BLE task instead of the Reach stack.  Every frame starts with this header, and the rest of the frame is filler.
+ *   byte 0:     RNRFC_BENCHMARK_FRAME_MAGIC, which can't start a Reach message as it would be an invalid protobuf wire type
+ *   byte 1:     The frame type, from rnrfc_benchmark_frame_t
+ *   bytes 2-5:  The sequence number within the run, little-endian
+ *   bytes 6-9:  For pings and pongs, the device's cycle counter when the ping was sent, little-endian
+ */
+
+#ifdef _DOXYGEN_
+    /** @brief The number of stream frames sent each time the BLE task runs, before it lets other work in. */
+    #define BENCHMARK_STREAM_BATCH 8
+
+    /** @brief The number of round trip times kept for the percentiles.  Longer echo runs use the most recent samples. */
+    #define BENCHMARK_MAX_RTT_SAMPLES 256
+
+    /** @brief How long to wait for a pong before counting the ping as lost and sending the next one. */
+    #define BENCHMARK_ECHO_TIMEOUT_MS 1000
+
+    /** @brief How long a stream waits for its last notifications to be transmitted before it is considered finished. */
+    #define BENCHMARK_DRAIN_TIMEOUT_MS 500
+#endif
+
+// To change any of the defines described above, define them here
+
+/** @brief The first byte of every benchmark frame */
+#define RNRFC_BENCHMARK_FRAME_MAGIC 0xFF
+
+/** @brief The size of the header at the start of every benchmark frame */
+#define RNRFC_BENCHMARK_FRAME_HEADER_SIZE 10
+
+/**
+* @brief The types of benchmark frame
+*/
+typedef enum {
+    /** @brief Sent by the device during a stream run */
+    RNRFC_BENCHMARK_FRAME_STREAM = 1,
+    /** @brief Sent by the device during an echo run, which the client writes straight back as a pong */
+    RNRFC_BENCHMARK_FRAME_PING = 2,
+    /** @brief A ping written back by the client, unchanged apart from the type */
+    RNRFC_BENCHMARK_FRAME_PONG = 3,
+    /** @brief Written by the client during a sink run */
+    RNRFC_BENCHMARK_FRAME_SINK = 4,
+} rnrfc_benchmark_frame_t;
+
+/**
+* @brief The kinds of benchmark run
+*/
+typedef enum {
+    /** @brief No run is in progress */
+    RNRFC_BENCHMARK_IDLE,
+    /** @brief The device notifies the client as fast as the TX path allows */
+    RNRFC_BENCHMARK_STREAM,
+    /** @brief The device times pings which the client writes back */
+    RNRFC_BENCHMARK_ECHO,
+    /** @brief The device counts writes from the client */
+    RNRFC_BENCHMARK_SINK,
+} rnrfc_benchmark_mode_t;
+
+/**
+* @brief The progress and results of the latest benchmark run
+*/
+typedef struct {
+    /** @brief The run in progress, or RNRFC_BENCHMARK_IDLE once it has finished */
+    rnrfc_benchmark_mode_t mode;
+    /** @brief The number of frames sent, echoed or received so far */
+    uint32_t completed;
+    /** @brief For stream and sink runs, the rate at which frame bytes were transferred */
+    uint32_t bytes_per_second;
+    /** @brief For echo runs, the median round trip time, in microseconds */
+    uint32_t rtt_p50_us;
+    /** @brief For echo runs, the 99th percentile round trip time, in microseconds */
+    uint32_t rtt_p99_us;
+    /** @brief The number of frames which could not be sent, or pings which were never echoed */
+    uint32_t notify_failures;
+} rnrfc_benchmark_results_t;
+
+/**
+* @brief Starts a benchmark run with the client which sent the current prompt
+* @note This must be called from the BLE task, such as from a Reach command handler
+* @param mode The kind of run
+* @param count The number of frames to send, echo or receive
+* @param size For stream runs, the size of each frame, or 0 for the largest which fits in a single response
+* @return 0 on success, or -1 if a run is already in progress or the arguments are invalid
+*/
+int rnrfc_benchmark_start(rnrfc_benchmark_mode_t mode, uint32_t count, uint32_t size);
+
+/**
+* @brief Gets the progress and results of the latest benchmark run
+* @return The results, which are only updated by the BLE task
+*/
+const rnrfc_benchmark_results_t *rnrfc_benchmark_get_results(void);
+
+/**
+* @brief Gets the session which the current run is using
+* @return The session index, or -1 if no run is in progress
+*/
+int rnrfc_benchmark_get_session(void);
+
+/**
+* @brief Checks whether an incoming message is a benchmark frame, and handles it if so
+* @note This is called by the BLE task for every incoming message, before it is given to the Reach stack
+* @param session The session which received the message
+* @param buf The message
+* @param len The length of the message
+* @return True if the message was a benchmark frame and should not be given to the Reach stack
+*/
+bool rnrfc_benchmark_handle_prompt(int session, const uint8_t *buf, size_t len);
+
+/**
+* @brief Sends the next frames of a run, and finishes it once it is complete
+* @note This is called by the BLE task while the run's session is the active session, so frames go out through crcb_send_coded_response()
+*/
+void rnrfc_benchmark_process(void);
+
+/**
+* @brief Abandons the current run, such as when its client disconnects
+*/
+void rnrfc_benchmark_stop(void);
+
+#endif // _REACH_BENCHMARK_H_
@@ -0,0 +1,1966 @@
+/*
+ * Copyright (c) 2023-2024 i3 Product Development
+ * 
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file      reach_ble.c
+ * @brief     BLE transport for the nRF Connect Reach integration: advertising, the Reach GATT service and the L2CAP channel
+ * 
+ * @copyright (c) Copyright 2024 i3 Product Development. All Rights Reserved.
+ */
+
+#include "reach_nrf_connect.h"
+#include "reach_transport.h"
+#include "reach_conn_policy.h"
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/hci.h>
+#include <zephyr/bluetooth/l2cap.h>
+#include <zephyr/random/random.h>
+#include <zephyr/sys/byteorder.h>
+#ifdef CONFIG_REACH_CONN_EVENT_SYNC
+#include <mpsl_radio_notification.h>
+#endif // CONFIG_REACH_CONN_EVENT_SYNC
+#ifdef CONFIG_REACH_BONDING
+#include <zephyr/settings/settings.h>
+#endif // CONFIG_REACH_BONDING
+
+#include "reach-server.h"
+#include "cr_stack.h"
+#include "i3_log.h"
+
+/*******************************************************************************
+ *******************************   DEFINES   ***********************************
+ ******************************************************************************/
+
+// Default define values, which can be overridden in the .h file as needed
+#ifndef BLE_ADV_INTERVAL_MS
+#define BLE_ADV_INTERVAL_MS 500
+#elif (BLE_ADV_INTERVAL_MS < 2)
+#error "BLE advertising interval must be at least 2ms"
+#endif // BLE_ADV_INTERVAL_MS
+
+// Need slightly more complicated logic for setting the advertising spacing
+#ifndef BLE_ADV_INTERVAL_SPACING_MS
+#if (BLE_ADV_INTERVAL_MS > 200)
+#define BLE_ADV_INTERVAL_SPACING_MS 100
+#elif (BLE_ADV_INTERVAL_MS > 20)
+#define BLE_ADV_INTERVAL_SPACING_MS 10
+#else
+#define BLE_ADV_INTERVAL_SPACING_MS 1
+#endif // (BLE_ADV_INTERVAL_MS > 10)
+#else
+#if (BLE_ADV_INTERVAL_MS < BLE_ADV_INTERVAL_SPACING_MS)
+#error "BLE Advertising interval spacing cannot result in negative advertising intervals"
+#endif // (BLE_ADV_INTERVAL_MS < BLE_ADV_INTERVAL_SPACING_MS)
+#endif // BLE_ADV_INTERVAL_SPACING_MS
+
+#ifndef BLE_ADV_FAST_INTERVAL_MIN_MS
+#define BLE_ADV_FAST_INTERVAL_MIN_MS 20
+#endif // BLE_ADV_FAST_INTERVAL_MIN_MS
+
+#ifndef BLE_ADV_FAST_INTERVAL_MAX_MS
+#define BLE_ADV_FAST_INTERVAL_MAX_MS 30
+#elif (BLE_ADV_FAST_INTERVAL_MAX_MS < BLE_ADV_FAST_INTERVAL_MIN_MS)
+#error "BLE fast advertising maximum interval cannot be less than the minimum"
+#endif // BLE_ADV_FAST_INTERVAL_MAX_MS
+
+#ifndef BLE_ADV_FAST_DURATION_MS
+#define BLE_ADV_FAST_DURATION_MS 30000
+#endif // BLE_ADV_FAST_DURATION_MS
+
+#ifndef BLE_WRITE_CIRCULAR_BUFFER_SIZE
+#define BLE_WRITE_CIRCULAR_BUFFER_SIZE 1
+#endif // BLE_WRITE_CIRCULAR_BUFFER_SIZE
+
+#ifndef BLE_WRITE_FULL_TIMEOUT_MS
+#define BLE_WRITE_FULL_TIMEOUT_MS 50
+#endif // BLE_WRITE_FULL_TIMEOUT_MS
+
+#ifndef BLE_WRITE_MAX_ACK_RATE
+#define BLE_WRITE_MAX_ACK_RATE (2 * BLE_WRITE_CIRCULAR_BUFFER_SIZE)
+#endif // BLE_WRITE_MAX_ACK_RATE
+
+#ifndef BLE_NOTIFY_QUEUE_SIZE
+#define BLE_NOTIFY_QUEUE_SIZE 8
+#endif // BLE_NOTIFY_QUEUE_SIZE
+
+#ifndef BLE_NOTIFY_MAX_IN_FLIGHT
+#define BLE_NOTIFY_MAX_IN_FLIGHT (CONFIG_BT_CONN_TX_MAX - 2)
+#endif // BLE_NOTIFY_MAX_IN_FLIGHT
+
+#ifndef BLE_NOTIFY_TIMEOUT_MS
+#define BLE_NOTIFY_TIMEOUT_MS 500
+#endif // BLE_NOTIFY_TIMEOUT_MS
+
+#ifndef BLE_SAR_ENABLED
+#define BLE_SAR_ENABLED 1
+#endif // BLE_SAR_ENABLED
+
+#ifndef BLE_BATCH_ENABLED
+#define BLE_BATCH_ENABLED 1
+#endif // BLE_BATCH_ENABLED
+
+#ifndef BLE_BATCH_HOLD_MS
+#define BLE_BATCH_HOLD_MS 20
+#endif // BLE_BATCH_HOLD_MS
+
+#ifndef BLE_RESUME_ENABLED
+#define BLE_RESUME_ENABLED 1
+#endif // BLE_RESUME_ENABLED
+
+#ifndef BLE_CONN_EVENT_DISTANCE
+#define BLE_CONN_EVENT_DISTANCE MPSL_RADIO_NOTIFICATION_DISTANCE_1740US
+#endif // BLE_CONN_EVENT_DISTANCE
+
+#ifndef BLE_CONN_EVENT_IRQ
+#define BLE_CONN_EVENT_IRQ SWI1_EGU1_IRQn
+#endif // BLE_CONN_EVENT_IRQ
+
+#ifndef BLE_CONN_EVENT_IRQ_PRIORITY
+#define BLE_CONN_EVENT_IRQ_PRIORITY 4
+#endif // BLE_CONN_EVENT_IRQ_PRIORITY
+
+#ifndef BLE_RESUME_CACHE_SIZE
+#define BLE_RESUME_CACHE_SIZE 4
+#endif // BLE_RESUME_CACHE_SIZE
+
+#ifndef BLE_L2CAP_ENABLED
+#ifdef CONFIG_BT_L2CAP_DYNAMIC_CHANNEL
+#define BLE_L2CAP_ENABLED 1
+#else
+#define BLE_L2CAP_ENABLED 0
+#endif // CONFIG_BT_L2CAP_DYNAMIC_CHANNEL
+#endif // BLE_L2CAP_ENABLED
+
+#ifndef BLE_L2CAP_PSM
+#define BLE_L2CAP_PSM 0x00C5
+#endif // BLE_L2CAP_PSM
+
+#ifndef BLE_L2CAP_RX_SDUS
+#define BLE_L2CAP_RX_SDUS 4
+#endif // BLE_L2CAP_RX_SDUS
+
+#ifndef BLE_L2CAP_TX_SDUS
+#define BLE_L2CAP_TX_SDUS 4
+#endif // BLE_L2CAP_TX_SDUS
+
+#ifndef BLE_BROADCAST_ENABLED
+#ifdef CONFIG_BT_EXT_ADV
+#define BLE_BROADCAST_ENABLED 1
+#else
+#define BLE_BROADCAST_ENABLED 0
+#endif // CONFIG_BT_EXT_ADV
+#elif (BLE_BROADCAST_ENABLED && !defined(CONFIG_BT_EXT_ADV))
+#error "The BLE parameter broadcast requires CONFIG_BT_EXT_ADV"
+#endif // BLE_BROADCAST_ENABLED
+
+#ifndef BLE_BROADCAST_PERIODIC
+#ifdef CONFIG_BT_PER_ADV
+#define BLE_BROADCAST_PERIODIC 1
+#else
+#define BLE_BROADCAST_PERIODIC 0
+#endif // CONFIG_BT_PER_ADV
+#elif (BLE_BROADCAST_PERIODIC && !defined(CONFIG_BT_PER_ADV))
+#error "Periodic advertising of the BLE parameter broadcast requires CONFIG_BT_PER_ADV"
+#endif // BLE_BROADCAST_PERIODIC
+
+#ifndef BLE_BROADCAST_INTERVAL_MS
+#define BLE_BROADCAST_INTERVAL_MS 1000
+#elif (BLE_BROADCAST_INTERVAL_MS < 100)
+#error "BLE broadcast interval must be at least 100ms"
+#endif // BLE_BROADCAST_INTERVAL_MS
+
+#ifndef BLE_BROADCAST_REFRESH_MS
+#define BLE_BROADCAST_REFRESH_MS 1000
+#endif // BLE_BROADCAST_REFRESH_MS
+
+#ifndef BLE_BROADCAST_MAX_DATA_SIZE
+#define BLE_BROADCAST_MAX_DATA_SIZE 200
+#elif (BLE_BROADCAST_MAX_DATA_SIZE > 227)
+#error "BLE broadcast data must fit in a single advertising PDU along with the service UUID"
+#endif // BLE_BROADCAST_MAX_DATA_SIZE
+
+#ifndef REACH_SERVICE_UUID
+#define REACH_SERVICE_UUID BT_UUID_128_ENCODE(0xedd59269, 0x79b3, 0x4ec2, 0xa6a2, 0x89bfb640f930)
+#endif // REACH_UUID
+
+#ifndef REACH_CHARACTERISTIC_UUID
+#define REACH_CHARACTERISTIC_UUID BT_UUID_128_ENCODE(0xd42d1039, 0x1d11, 0x4f10, 0xbae6, 0x5f3b44cf6439)
+#endif // REACH_CHARACTERISTIC_UUID
+
+#ifndef REACH_SAR_CHARACTERISTIC_UUID
+#define REACH_SAR_CHARACTERISTIC_UUID BT_UUID_128_ENCODE(0xd42d103a, 0x1d11, 0x4f10, 0xbae6, 0x5f3b44cf6439)
+#endif // REACH_SAR_CHARACTERISTIC_UUID
+
+#ifndef REACH_BATCH_CHARACTERISTIC_UUID
+#define REACH_BATCH_CHARACTERISTIC_UUID BT_UUID_128_ENCODE(0xd42d103c, 0x1d11, 0x4f10, 0xbae6, 0x5f3b44cf6439)
+#endif // REACH_BATCH_CHARACTERISTIC_UUID
+
+#ifndef REACH_RESUME_CHARACTERISTIC_UUID
+#define REACH_RESUME_CHARACTERISTIC_UUID BT_UUID_128_ENCODE(0xd42d103d, 0x1d11, 0x4f10, 0xbae6, 0x5f3b44cf6439)
+#endif // REACH_RESUME_CHARACTERISTIC_UUID
+
+#ifndef REACH_L2CAP_PSM_CHARACTERISTIC_UUID
+#define REACH_L2CAP_PSM_CHARACTERISTIC_UUID BT_UUID_128_ENCODE(0xd42d103b, 0x1d11, 0x4f10, 0xbae6, 0x5f3b44cf6439)
+#endif // REACH_L2CAP_PSM_CHARACTERISTIC_UUID
+
+// Defines only needed internally
+#define ADVERTISING_INTERVAL(ms) (((ms) * 8) / 5)
+#define BLE_ADV_INTERVAL_MIN ADVERTISING_INTERVAL(BLE_ADV_INTERVAL_MS - BLE_ADV_INTERVAL_SPACING_MS)
+#define BLE_ADV_INTERVAL_MAX ADVERTISING_INTERVAL(BLE_ADV_INTERVAL_MS + BLE_ADV_INTERVAL_SPACING_MS)
+
+#define BT_LE_AD_LOW_POWER BT_LE_ADV_PARAM(BT_LE_ADV_OPT_CONNECTABLE, BLE_ADV_INTERVAL_MIN, BLE_ADV_INTERVAL_MAX, NULL)
+#define BT_LE_AD_FAST BT_LE_ADV_PARAM(BT_LE_ADV_OPT_CONNECTABLE, ADVERTISING_INTERVAL(BLE_ADV_FAST_INTERVAL_MIN_MS), \
+                                      ADVERTISING_INTERVAL(BLE_ADV_FAST_INTERVAL_MAX_MS), NULL)
+
+// The broadcast uses the same interval for the extended advertising and, if enabled, the periodic advertising train
+#define BROADCAST_ADV_INTERVAL ADVERTISING_INTERVAL(BLE_BROADCAST_INTERVAL_MS)
+#define BROADCAST_PER_ADV_INTERVAL (((BLE_BROADCAST_INTERVAL_MS) * 4) / 5)
+#define BROADCAST_UUID_SIZE 16
+
+// How long to wait before trying to start advertising again, usually while a connection object is being freed
+#define ADV_RETRY_INTERVAL_MS 100
+#define ADV_MAX_RETRIES 10
+
+#if (APP_ADVERTISED_NAME_LENGTH > 30)
+#error "nRF Connect BLE advertised name length cannot be greater than 30 characters"
+#endif
+
+#define REACH_SERVICE_UUID_DECLARE BT_UUID_DECLARE_128(REACH_SERVICE_UUID)
+#define REACH_CHARACTERISTIC_UUID_DECLARE BT_UUID_DECLARE_128(REACH_CHARACTERISTIC_UUID)
+#define REACH_SAR_CHARACTERISTIC_UUID_DECLARE BT_UUID_DECLARE_128(REACH_SAR_CHARACTERISTIC_UUID)
+#define REACH_L2CAP_PSM_CHARACTERISTIC_UUID_DECLARE BT_UUID_DECLARE_128(REACH_L2CAP_PSM_CHARACTERISTIC_UUID)
+#define REACH_BATCH_CHARACTERISTIC_UUID_DECLARE BT_UUID_DECLARE_128(REACH_BATCH_CHARACTERISTIC_UUID)
+#define REACH_RESUME_CHARACTERISTIC_UUID_DECLARE BT_UUID_DECLARE_128(REACH_RESUME_CHARACTERISTIC_UUID)
+
+// Positions of the characteristic values in the service attribute table
+#define REACH_ATTR_INDEX 2
+#define REACH_SAR_ATTR_INDEX 5
+#define REACH_BATCH_ATTR_INDEX (BLE_SAR_ENABLED ? 8:5)
+
+// The largest notification payload with the largest ATT MTU the Bluetooth stack allows (3 bytes of ATT header, 4 of L2CAP)
+#define BLE_MAX_NOTIFY_SIZE (CONFIG_BT_L2CAP_TX_MTU - 7)
+
+// Segment header for the segmented characteristic, see reach_nrf_connect.h
+#define SAR_FLAG_FIRST 0x80
+#define SAR_FLAG_LAST 0x40
+#define SAR_SEQ_MASK 0x3F
+#define SAR_FIRST_HEADER_SIZE 3
+#define SAR_HEADER_SIZE 1
+
+// Each message in a batched notification is preceded by its length, see reach_nrf_connect.h
+#define BATCH_RECORD_HEADER_SIZE 1
+#define BATCH_RECORD_MAX_SIZE 0xFF
+
+// The resumption characteristic is read as the token followed by the parameter hash, and written with just the token
+#define RESUME_TOKEN_SIZE 4
+#define RESUME_INFO_SIZE 8
+
+#if (CR_CODED_BUFFER_SIZE > BLE_MAX_NOTIFY_SIZE) && !BLE_SAR_ENABLED
+#warning "Reach messages larger than one notification can only be sent with BLE_SAR_ENABLED"
+#endif
+#if BLE_L2CAP_ENABLED && !defined(CONFIG_BT_L2CAP_DYNAMIC_CHANNEL)
+#error "BLE_L2CAP_ENABLED requires CONFIG_BT_L2CAP_DYNAMIC_CHANNEL"
+#endif
+#if (BLE_L2CAP_PSM < 0x0080) || (BLE_L2CAP_PSM > 0x00FF)
+#error "BLE_L2CAP_PSM must be in the LE dynamic PSM range (0x0080-0x00FF)"
+#endif
+#if (CR_CODED_BUFFER_SIZE > 0xFFFF)
+#error "The segment header can only describe messages up to 65535 bytes"
+#endif
+
+/*******************************************************************************
+ ****************************   LOCAL  TYPES   *********************************
+ ******************************************************************************/
+
+// The ways a Reach message can get to or from a client
+typedef enum {
+    TRANSPORT_GATT,     // The standard Reach characteristic
+    TRANSPORT_GATT_SAR, // The segmented Reach characteristic
+    TRANSPORT_L2CAP,    // The L2CAP channel, one message per SDU
+} transport_t;
+
+// Messages waiting to be sent together in one notification on the batched characteristic
+typedef struct {
+    uint8_t buf[BLE_MAX_NOTIFY_SIZE];
+    uint16_t length;
+    uint16_t count;
+    // Replies are never held back for more messages, only unsolicited ones are
+    bool has_reply;
+    int64_t started; // Uptime when the first message was added
+} batch_t;
+
+// What is remembered about a client after it disconnects, so that it can pick up where it left off
+typedef struct {
+    bt_addr_le_t peer;
+    uint32_t token;          // 0 if the record is unused
+    uint32_t param_hash;     // The client's cached discovery is only valid while this matches
+    bool notifications_off;  // The client had cleared the default notifications
+    uint32_t last_used;      // Uptime in ms, so that the oldest record is replaced first
+} resume_record_t;
+
+// A coded Reach message waiting to be processed
+typedef struct {
+    uint8_t buf[CR_CODED_BUFFER_SIZE];
+    size_t length;
+    uint32_t timestamp; // Cycle count when the message was queued, used for latency statistics
+    transport_t transport;
+} coded_buffer_t;
+
+// A single notification waiting to be sent, which may be one segment of a larger message
+typedef struct {
+    uint8_t buf[BLE_MAX_NOTIFY_SIZE];
+    uint16_t length;
+    uint16_t attr_index; // The characteristic to notify, REACH_ATTR_INDEX or REACH_SAR_ATTR_INDEX
+    uint32_t timestamp; // Cycle count when the notification was queued, used for latency statistics
+} notify_entry_t;
+
+// Structure for the single-producer/single-consumer ring of incoming prompts
+typedef struct {
+    coded_buffer_t slots[BLE_WRITE_CIRCULAR_BUFFER_SIZE];
+    // Indices run from 0 to (2 * size - 1) so that a full ring can be told apart from an empty one.
+    // head is only written by the BT RX thread, tail is only written by the BLE task.
+    atomic_t head;
+    atomic_t tail;
+} ingress_ring_t;
+
+// Everything that belongs to a single connected client
+typedef struct {
+    // Set by the connected callback, released by the BLE task after the disconnection has been handled
+    struct bt_conn *conn;
+    // Set and cleared by the connection work handlers
+    volatile bool connected;
+    volatile bool release_pending;
+    struct k_work connect_work;
+    struct k_work disconnect_work;
+    // Uptime in ms when the link came up, used to time how long the client takes to send its first prompt
+    uint32_t connected_ms;
+    // Set when the client is bonded or has connected before, which means it may have skipped GATT discovery
+    bool returning;
+    bool first_prompt_seen;
+    // Incoming prompts
+    ingress_ring_t ring;
+    // Given by the BLE task whenever a slot is released, so a blocked writer can retry
+    struct k_sem write_space_sem;
+    // Outgoing notifications, only accessed from the BLE task
+    notify_entry_t notify_queue[BLE_NOTIFY_QUEUE_SIZE];
+    size_t notify_queue_head;
+    size_t notify_queue_count;
+    // Notifications handed to the Bluetooth stack which haven't completed, decremented by the completion callback
+    atomic_t notify_in_flight;
+    // This session's share of the flow control counters in rnrfc_stats, for the adaptive acknowledgement rate
+    atomic_t ingress_full_waits;
+    atomic_t ingress_drops;
+    atomic_t notify_queue_waits;
+    atomic_t notify_failed;
+    // Responses go back the way the prompt being handled arrived, anything unsolicited uses the characteristic last written to.
+    // Both are only accessed from the BLE task.
+    transport_t reply_transport;
+    transport_t gatt_transport;
+#if BLE_BATCH_ENABLED
+    // Only accessed from the BLE task
+    batch_t batch;
+#endif // BLE_BATCH_ENABLED
+#if BLE_RESUME_ENABLED
+    // The token the client can use to resume this session later, set when it connects or resumes
+    uint32_t resume_token;
+    volatile bool resumed;
+    // Set by the resumption write, applied by the BLE task, which owns the Reach stack
+    volatile bool resume_apply_pending;
+    bool notifications_off;
+#endif // BLE_RESUME_ENABLED
+#if BLE_SAR_ENABLED
+    // The prompt being reassembled, only accessed from the BT RX thread.  It is not published until it is complete.
+    // It is the write buffer's unpublished head slot, so an unsegmented write abandons it rather than reuse the slot.
+    coded_buffer_t *sar_rx_slot;
+    size_t sar_rx_expected;
+    uint8_t sar_rx_seq;
+#endif // BLE_SAR_ENABLED
+#if BLE_L2CAP_ENABLED
+    struct bt_l2cap_le_chan l2cap_chan;
+    volatile bool l2cap_connected;
+    // Received SDUs waiting for the BLE task.  The client only gets its credits back once each one has been processed.
+    struct k_fifo l2cap_rx_fifo;
+    // The SDU handed to the stack, which is completed once the stack is done with it
+    struct net_buf *l2cap_rx_sdu;
+#endif // BLE_L2CAP_ENABLED
+} session_t;
+
+/*******************************************************************************
+ *********************   LOCAL FUNCTION PROTOTYPES   ***************************
+ ******************************************************************************/
+
+// Transport functions for the Reach task
+static int ble_init(void);
+static void ble_poll(void);
+static bool ble_is_active(void);
+static bool ble_is_connected(int session);
+static bool ble_receive(int session, rnrfc_prompt_t *prompt);
+static void ble_release(int session);
+static int ble_send(int session, const uint8_t *buf, size_t len, bool reply);
+static void ble_flush(void);
+static size_t ble_get_max_response_size(int session);
+static uint32_t ble_get_ack_rate(int session, uint32_t requested_rate, bool is_write);
+static void ble_get_flow_counters(int session, bool is_write, rnrfc_flow_counters_t *counters);
+static void ble_release_session(session_t *session);
+#ifdef CONFIG_REACH_CONN_EVENT_SYNC
+static int conn_event_init(void);
+static void conn_event_isr(const void *arg);
+#endif // CONFIG_REACH_CONN_EVENT_SYNC
+
+// Advertising
+static int adv_start(bool fast);
+static void adv_work_handler(struct k_work *item);
+#if BLE_BROADCAST_ENABLED
+static int broadcast_start(void);
+static void broadcast_build(void);
+static void broadcast_work_handler(struct k_work *item);
+static void broadcast_timer_handler(struct k_timer *timer);
+#endif // BLE_BROADCAST_ENABLED
+
+// Callbacks for BLE events
+static void connected(struct bt_conn *conn, uint8_t err);
+static void connect_work_handler(struct k_work *item);
+static void disconnect_work_handler(struct k_work *item);
+static void disconnected(struct bt_conn *conn, uint8_t reason);
+static bool peer_is_known(const bt_addr_le_t *peer);
+#ifdef CONFIG_REACH_BONDING
+static void pairing_complete(struct bt_conn *conn, bool bonded);
+static void pairing_failed(struct bt_conn *conn, enum bt_security_err reason);
+#endif // CONFIG_REACH_BONDING
+static ssize_t read_reach(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset);
+static ssize_t write_reach(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf, uint16_t len, uint16_t offset, uint8_t flags);
+static void subscribe_reach(const struct bt_gatt_attr *attr, uint16_t value);
+#if BLE_SAR_ENABLED
+static ssize_t write_reach_sar(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf, uint16_t len, uint16_t offset, uint8_t flags);
+#endif // BLE_SAR_ENABLED
+static coded_buffer_t *ingress_claim(session_t *session, uint16_t len, uint8_t flags);
+#if BLE_L2CAP_ENABLED
+static ssize_t read_l2cap_psm(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset);
+static int l2cap_accept(struct bt_conn *conn, struct bt_l2cap_server *server, struct bt_l2cap_chan **chan);
+static void l2cap_connected(struct bt_l2cap_chan *chan);
+static void l2cap_disconnected(struct bt_l2cap_chan *chan);
+static struct net_buf *l2cap_alloc_buf(struct bt_l2cap_chan *chan);
+static int l2cap_recv(struct bt_l2cap_chan *chan, struct net_buf *buf);
+static void l2cap_flush(session_t *session);
+static int l2cap_send(session_t *session, const uint8_t *buf, size_t size);
+#endif // BLE_L2CAP_ENABLED
+static void ingress_publish(session_t *session);
+
+// Functions for the ingress ring
+static coded_buffer_t *ring_claim(ingress_ring_t *ring);
+static void ring_publish(ingress_ring_t *ring);
+static coded_buffer_t *ring_peek(ingress_ring_t *ring);
+static void ring_release(ingress_ring_t *ring);
+static uint32_t ring_get_size(ingress_ring_t *ring);
+
+// Functions for the outgoing notification queues
+static int session_send(session_t *session, const uint8_t *buf, size_t size, bool reply);
+static notify_entry_t *notify_queue_claim(session_t *session);
+static void notify_queue_commit(session_t *session);
+static void notify_queue_drain(session_t *session);
+static void notify_queue_reset(session_t *session);
+static atomic_val_t notify_get_in_flight(void);
+static void notify_complete(struct bt_conn *conn, void *user_data);
+#if BLE_BATCH_ENABLED
+static bool batch_is_subscribed(session_t *session);
+static int batch_add(session_t *session, const uint8_t *buf, size_t size, size_t payload, bool reply);
+static int batch_flush(session_t *session);
+static void batch_work_handler(struct k_work *item);
+#endif // BLE_BATCH_ENABLED
+#if BLE_RESUME_ENABLED
+static ssize_t read_resume(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset);
+static ssize_t write_resume(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf, uint16_t len, uint16_t offset, uint8_t flags);
+static void resume_save(session_t *session);
+static uint32_t new_resume_token(void);
+#endif // BLE_RESUME_ENABLED
+
+// strnlen is technically a Linux function and is often not found by the compiler.
+size_t strnlen( const char * s,size_t maxlen );
+
+/*******************************************************************************
+ ***************************  LOCAL VARIABLES   ********************************
+ ******************************************************************************/
+
+// Advertising data
+char advertised_name[APP_ADVERTISED_NAME_LENGTH];
+static const struct bt_data ad[] = {
+    BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
+    BT_DATA_BYTES(BT_DATA_UUID128_ALL, REACH_SERVICE_UUID),
+};
+
+// Scanning data
+static struct bt_data sd[] = {
+    BT_DATA(BT_DATA_NAME_COMPLETE, advertised_name, 0),
+};
+
+// Data for reading/writing the Reach characteristic
+static uint8_t reach_data[244];
+
+// Connection callback structure used by the stack
+static struct bt_conn_cb connection_callbacks = {
+    .connected = connected,
+    .disconnected = disconnected,
+};
+
+#ifdef CONFIG_REACH_BONDING
+static struct bt_conn_auth_info_cb auth_info_callbacks = {
+    .pairing_complete = pairing_complete,
+    .pairing_failed = pairing_failed,
+};
+#endif // CONFIG_REACH_BONDING
+
+// Service definition
+BT_GATT_SERVICE_DEFINE(reach_service,
+    BT_GATT_PRIMARY_SERVICE(REACH_SERVICE_UUID_DECLARE),
+    BT_GATT_CHARACTERISTIC(REACH_CHARACTERISTIC_UUID_DECLARE,
+                           BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE | BT_GATT_CHRC_WRITE_WITHOUT_RESP | BT_GATT_CHRC_NOTIFY,
+                           BT_GATT_PERM_READ | BT_GATT_PERM_WRITE | BT_GATT_PERM_PREPARE_WRITE,
+                           read_reach, write_reach, reach_data),
+    BT_GATT_CCC(subscribe_reach, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+#if BLE_SAR_ENABLED
+    // The same Reach messages, split into segments so that they can be larger than one ATT payload
+    BT_GATT_CHARACTERISTIC(REACH_SAR_CHARACTERISTIC_UUID_DECLARE,
+                           BT_GATT_CHRC_WRITE | BT_GATT_CHRC_WRITE_WITHOUT_RESP | BT_GATT_CHRC_NOTIFY,
+                           BT_GATT_PERM_WRITE | BT_GATT_PERM_PREPARE_WRITE,
+                           NULL, write_reach_sar, NULL),
+    BT_GATT_CCC(subscribe_reach, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+#endif // BLE_SAR_ENABLED
+#if BLE_BATCH_ENABLED
+    // Carries several small messages in each notification, for clients which subscribe to it
+    BT_GATT_CHARACTERISTIC(REACH_BATCH_CHARACTERISTIC_UUID_DECLARE,
+                           BT_GATT_CHRC_NOTIFY,
+                           BT_GATT_PERM_NONE,
+                           NULL, NULL, NULL),
+    BT_GATT_CCC(subscribe_reach, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+#endif // BLE_BATCH_ENABLED
+#if BLE_RESUME_ENABLED
+    // Lets a returning client skip discovery, see BLE_RESUME_ENABLED in reach_nrf_connect.h
+    BT_GATT_CHARACTERISTIC(REACH_RESUME_CHARACTERISTIC_UUID_DECLARE,
+                           BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+                           BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
+                           read_resume, write_resume, NULL),
+#endif // BLE_RESUME_ENABLED
+#if BLE_L2CAP_ENABLED
+    // Lets the client find the L2CAP channel, which carries the same Reach messages without the ATT overhead
+    BT_GATT_CHARACTERISTIC(REACH_L2CAP_PSM_CHARACTERISTIC_UUID_DECLARE,
+                           BT_GATT_CHRC_READ,
+                           BT_GATT_PERM_READ,
+                           read_l2cap_psm, NULL, NULL),
+#endif // BLE_L2CAP_ENABLED
+);
+
+#ifdef CONFIG_REACH_CONN_EVENT_SYNC
+// Set by the radio notification just before the radio starts an event, cleared by the BLE task
+static atomic_t conn_event_pending = ATOMIC_INIT(0);
+// Set for the processing pass which was started by a radio notification, only accessed from the BLE task
+static bool conn_event_pass = false;
+#endif // CONFIG_REACH_CONN_EVENT_SYNC
+
+// Sessions, indexed by bt_conn_index()
+static session_t sessions[RNRFC_MAX_BLE_SESSIONS];
+
+#if BLE_L2CAP_ENABLED
+static const struct bt_l2cap_chan_ops l2cap_ops = {
+    .connected = l2cap_connected,
+    .disconnected = l2cap_disconnected,
+    .alloc_buf = l2cap_alloc_buf,
+    .recv = l2cap_recv,
+};
+
+static struct bt_l2cap_server l2cap_server = {
+    .psm = BLE_L2CAP_PSM,
+    .accept = l2cap_accept,
+};
+
+// Each SDU holds a whole Reach message.  Credits are granted one SDU per RX buffer, so the client can never overrun them.
+NET_BUF_POOL_FIXED_DEFINE(l2cap_rx_pool, BLE_L2CAP_RX_SDUS * RNRFC_MAX_BLE_SESSIONS, BT_L2CAP_SDU_BUF_SIZE(CR_CODED_BUFFER_SIZE), 8, NULL);
+NET_BUF_POOL_FIXED_DEFINE(l2cap_tx_pool, BLE_L2CAP_TX_SDUS, BT_L2CAP_SDU_BUF_SIZE(CR_CODED_BUFFER_SIZE), CONFIG_BT_CONN_TX_USER_DATA_SIZE, NULL);
+#endif // BLE_L2CAP_ENABLED
+
+// State information
+static bool ble_advertising_started = false;
+// Switches between fast and slow advertising, only run from the system work queue after initialization
+static K_WORK_DELAYABLE_DEFINE(adv_work, adv_work_handler);
+static atomic_t adv_fast_requested = ATOMIC_INIT(0);
+static int adv_retries = 0;
+static atomic_t connection_count = ATOMIC_INIT(0);
+
+#if BLE_BROADCAST_ENABLED
+// The non-connectable advertising set carrying the broadcast, separate from the connectable advertising above
+static struct bt_le_ext_adv *broadcast_set = NULL;
+// Service data: the Reach service UUID followed by the application's payload
+static uint8_t broadcast_data[BROADCAST_UUID_SIZE + BLE_BROADCAST_MAX_DATA_SIZE] = { REACH_SERVICE_UUID };
+// The length of the payload last given to the controller, or -1 to force an update
+static int broadcast_length = -1;
+// The payload is built by the BLE task, which owns the parameters, and handed to the system work queue to give to the
+// controller, as that can block
+static uint8_t broadcast_next[BLE_BROADCAST_MAX_DATA_SIZE];
+static size_t broadcast_next_length;
+static struct k_spinlock broadcast_lock;
+static K_WORK_DEFINE(broadcast_work, broadcast_work_handler);
+// Set by rnrfc_broadcast_refresh() and the refresh timer, and turned into a rebuild by the BLE task at the start of its next pass
+static atomic_t broadcast_refresh_pending = ATOMIC_INIT(0);
+static K_TIMER_DEFINE(broadcast_timer, broadcast_timer_handler, NULL);
+#endif // BLE_BROADCAST_ENABLED
+
+// Each notification in flight uses one of the Bluetooth stack's TX buffers, which are shared by all connections, so
+// BLE_NOTIFY_MAX_IN_FLIGHT limits the total of every session's notify_in_flight.  This is given by the completion callback
+// whenever a TX buffer is freed.
+static K_SEM_DEFINE(notify_credit_sem, 0, 1);
+
+#if BLE_BATCH_ENABLED
+// Wakes the BLE task when a held batch is due to be sent
+static K_WORK_DELAYABLE_DEFINE(batch_work, batch_work_handler);
+#endif // BLE_BATCH_ENABLED
+
+#if BLE_RESUME_ENABLED
+// Written by the BLE task when a session is released, read by the BT RX thread when a client resumes
+static resume_record_t resume_cache[BLE_RESUME_CACHE_SIZE];
+static K_MUTEX_DEFINE(resume_lock);
+#endif // BLE_RESUME_ENABLED
+
+const rnrfc_transport_t rnrfc_ble_transport = {
+    .name = "BLE",
+    .session_count = RNRFC_MAX_BLE_SESSIONS,
+    .init = ble_init,
+    .poll = ble_poll,
+    .is_active = ble_is_active,
+    .is_connected = ble_is_connected,
+    .receive = ble_receive,
+    .release = ble_release,
+    .send = ble_send,
+    .flush = ble_flush,
+    .get_max_response_size = ble_get_max_response_size,
+    .get_ack_rate = ble_get_ack_rate,
+    .get_flow_counters = ble_get_flow_counters,
+};
+
+/*******************************************************************************
+ **************************   GLOBAL FUNCTIONS   *******************************
+ ******************************************************************************/
+
+int rnrfc_set_advertised_name(char *name)
+{
+    int rval = 0;
+    size_t name_length = strnlen(name, sizeof(advertised_name) + 1);
+    if (name_length > sizeof(advertised_name) || name_length == 0)
+        return -1;
+    memset(advertised_name, 0, sizeof(advertised_name));
+    strncpy(advertised_name, name, sizeof(advertised_name));
+    sd[0].data_len = (uint8_t) name_length;
+    if (ble_advertising_started)
+    {
+        // Updating the data in place means the device never stops being discoverable
+        rval = bt_le_adv_update_data(ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
+        if (rval == -EAGAIN)
+        {
+            // Not advertising while every connection is in use, the new name is picked up when it resumes
+            rval = 0;
+        }
+        else if (rval)
+        {
+            I3_LOG(LOG_MASK_ERROR, "Failed to update BLE advertising data, error %d", rval);
+            rval = -2;
+        }
+    }
+    cr_set_advertised_name(advertised_name, name_length);
+    return rval;
+}
+
+void rnrfc_advertise_fast(void)
+{
+#if (BLE_ADV_FAST_DURATION_MS > 0)
+    if (!ble_advertising_started)
+        return;
+    atomic_set(&adv_fast_requested, 1);
+    k_work_reschedule(&adv_work, K_NO_WAIT);
+#endif // (BLE_ADV_FAST_DURATION_MS > 0)
+}
+
+void rnrfc_broadcast_refresh(void)
+{
+#if BLE_BROADCAST_ENABLED
+    if (broadcast_set == NULL)
+        return;
+    // A parameter write calls this before the new value is stored, so the BLE task rebuilds the payload once it has
+    // finished the pass that is writing it
+    atomic_set(&broadcast_refresh_pending, 1);
+    rnrfc_request_processing();
+#endif // BLE_BROADCAST_ENABLED
+}
+
+bool rnrfc_session_is_resumed(int session)
+{
+#if BLE_RESUME_ENABLED
+    if (session >= 0 && session < RNRFC_MAX_BLE_SESSIONS)
+        return sessions[session].resumed;
+#endif // BLE_RESUME_ENABLED
+    return false;
+}
+
+void rnrfc_session_set_notifications_off(int session, bool off)
+{
+#if BLE_RESUME_ENABLED
+    if (session >= 0 && session < RNRFC_MAX_BLE_SESSIONS)
+        sessions[session].notifications_off = off;
+#endif // BLE_RESUME_ENABLED
+}
+
+int rnrfc_get_connection_count(void)
+{
+    return (int) atomic_get(&connection_count);
+}
+
+void __attribute__((weak)) rnrfc_app_handle_ble_connection(void)
+{
+    // Do nothing
+    return;
+}
+
+void __attribute__((weak)) rnrfc_app_handle_ble_disconnection(void)
+{
+    // Do nothing
+    return;
+}
+
+size_t __attribute__((weak)) rnrfc_app_get_broadcast_data(uint8_t *buf, size_t max_size)
+{
+    // Nothing to broadcast
+    (void) buf;
+    (void) max_size;
+    return 0;
+}
+
+/*******************************************************************************
+ ***************************   LOCAL FUNCTIONS    ******************************
+ ******************************************************************************/
+
+static int ble_init(void)
+{
+    // Initialize the advertised name if it hasn't been set already
+    if (advertised_name[0] == 0)
+    {
+        // Handling to make sure setting the advertised name is successful
+        char temp[APP_ADVERTISED_NAME_LENGTH];
+        strncpy(temp, CONFIG_BT_DEVICE_NAME, sizeof(temp));
+        rnrfc_set_advertised_name(temp);
+    }
+    for (int i = 0; i < RNRFC_MAX_BLE_SESSIONS; i++)
+    {
+        k_work_init(&sessions[i].connect_work, connect_work_handler);
+        k_work_init(&sessions[i].disconnect_work, disconnect_work_handler);
+        k_sem_init(&sessions[i].write_space_sem, 0, 1);
+#if BLE_L2CAP_ENABLED
+        k_fifo_init(&sessions[i].l2cap_rx_fifo);
+#endif // BLE_L2CAP_ENABLED
+    }
+
+    int rval = bt_enable(NULL);
+    if (rval)
+    {
+        I3_LOG(LOG_MASK_ERROR, "Bluetooth init failed (err %d)", rval);
+        return rval;
+    }
+
+#ifdef CONFIG_REACH_BONDING
+    // Bonds and CCC subscriptions are kept in the settings file, which has to be loaded before advertising starts
+    rval = settings_load();
+    if (rval)
+        I3_LOG(LOG_MASK_ERROR, "Loading bonds failed (err %d)", rval);
+    bt_conn_auth_info_cb_register(&auth_info_callbacks);
+#endif // CONFIG_REACH_BONDING
+
+    bt_conn_cb_register(&connection_callbacks);
+    rnrfc_conn_policy_init();
+#ifdef CONFIG_REACH_CONN_EVENT_SYNC
+    // Without it, the BLE task just runs on its own timer as usual
+    rval = conn_event_init();
+    if (rval)
+        I3_LOG(LOG_MASK_ERROR, "Radio notification setup failed (err %d)", rval);
+#endif // CONFIG_REACH_CONN_EVENT_SYNC
+#if BLE_L2CAP_ENABLED
+    rval = bt_l2cap_server_register(&l2cap_server);
+    if (rval)
+        I3_LOG(LOG_MASK_ERROR, "L2CAP server registration failed (err %d)", rval);
+#endif // BLE_L2CAP_ENABLED
+
+    // Connectable advertising resumes automatically after a connection, as long as there is room for another.
+    // Start with a burst of fast advertising so that a client can find the device quickly after it powers up.
+    rval = adv_start(BLE_ADV_FAST_DURATION_MS > 0);
+    if (rval)
+    {
+        I3_LOG(LOG_MASK_ERROR, "Bluetooth advertising failed to start (err %d)", rval);
+        return rval;
+    }
+#if (BLE_ADV_FAST_DURATION_MS > 0)
+    k_work_reschedule(&adv_work, K_MSEC(BLE_ADV_FAST_DURATION_MS));
+#endif // (BLE_ADV_FAST_DURATION_MS > 0)
+
+#if BLE_BROADCAST_ENABLED
+    // The broadcast is optional, so a failure here doesn't stop the connectable side from working
+    rval = broadcast_start();
+    if (rval)
+        I3_LOG(LOG_MASK_ERROR, "BLE parameter broadcast failed to start (err %d)", rval);
+#endif // BLE_BROADCAST_ENABLED
+    return 0;
+}
+
+static void ble_poll(void)
+{
+#if BLE_BROADCAST_ENABLED
+    if (atomic_cas(&broadcast_refresh_pending, 1, 0))
+        broadcast_build();
+#endif // BLE_BROADCAST_ENABLED
+#ifdef CONFIG_REACH_CONN_EVENT_SYNC
+    conn_event_pass = atomic_cas(&conn_event_pending, 1, 0);
+    if (conn_event_pass)
+        atomic_inc(&rnrfc_stats.conn_event_wakeups);
+#endif // CONFIG_REACH_CONN_EVENT_SYNC
+    for (int i = 0; i < RNRFC_MAX_BLE_SESSIONS; i++)
+    {
+        if (sessions[i].release_pending)
+            ble_release_session(&sessions[i]);
+#if BLE_RESUME_ENABLED
+        if (sessions[i].resume_apply_pending)
+        {
+            // The connection already enabled the default notifications, so only a client which had cleared them needs anything done
+            sessions[i].resume_apply_pending = false;
+            if (sessions[i].notifications_off)
+            {
+                // The notifications are shared by every client, so they are only cleared again if this one is alone
+                if (rnrfc_transport_count_connected() <= 1)
+                    cr_clear_param_notifications();
+                else
+                    I3_LOG(LOG_MASK_BLE, "Session %d resumed with notifications off, left on for the other clients", i);
+            }
+        }
+#endif // BLE_RESUME_ENABLED
+    }
+}
+
+static bool ble_is_active(void)
+{
+    return (atomic_get(&connection_count) > 0);
+}
+
+static bool ble_is_connected(int session)
+{
+    return sessions[session].connected;
+}
+
+static bool ble_receive(int session, rnrfc_prompt_t *prompt)
+{
+    session_t *s = &sessions[session];
+    if (!s->connected)
+        return false;
+    coded_buffer_t *temp = ring_peek(&s->ring);
+    if (temp != NULL)
+    {
+        I3_LOG(LOG_MASK_BLE, "Process buffer from session %d", session);
+        if (!s->first_prompt_seen)
+        {
+            // Everything before the first prompt is discovery, so this is how long a reconnection really takes
+            uint32_t latency_ms = k_uptime_get_32() - s->connected_ms;
+            s->first_prompt_seen = true;
+            if (s->returning)
+            {
+                atomic_inc(&rnrfc_stats.first_prompt_returning_count);
+                atomic_add(&rnrfc_stats.first_prompt_returning_total_ms, (atomic_val_t) latency_ms);
+            }
+            else
+            {
+                atomic_inc(&rnrfc_stats.first_prompt_new_count);
+                atomic_add(&rnrfc_stats.first_prompt_new_total_ms, (atomic_val_t) latency_ms);
+            }
+            I3_LOG(LOG_MASK_BLE, "Session %d first prompt %u ms after connecting (%s client)", session, latency_ms, s->returning ? "returning":"new");
+        }
+        s->reply_transport = temp->transport;
+        s->gatt_transport = temp->transport;
+        prompt->buf = temp->buf;
+        prompt->length = temp->length;
+        prompt->timestamp = temp->timestamp;
+        return true;
+    }
+#if BLE_L2CAP_ENABLED
+    struct net_buf *sdu = net_buf_get(&s->l2cap_rx_fifo, K_NO_WAIT);
+    if (sdu != NULL && !s->l2cap_connected)
+    {
+        // Left over from a channel which has since disconnected
+        net_buf_unref(sdu);
+        l2cap_flush(s);
+    }
+    else if (sdu != NULL)
+    {
+        I3_LOG(LOG_MASK_BLE, "Process L2CAP SDU from session %d", session);
+        s->reply_transport = TRANSPORT_L2CAP;
+        s->l2cap_rx_sdu = sdu;
+        prompt->buf = sdu->data;
+        prompt->length = sdu->len;
+        prompt->timestamp = k_cycle_get_32();
+        return true;
+    }
+#endif // BLE_L2CAP_ENABLED
+    return false;
+}
+
+static void ble_release(int session)
+{
+    session_t *s = &sessions[session];
+#if BLE_L2CAP_ENABLED
+    if (s->l2cap_rx_sdu != NULL)
+    {
+        // Completing the SDU returns its credits, which lets the client send another one
+        if (bt_l2cap_chan_recv_complete(&s->l2cap_chan.chan, s->l2cap_rx_sdu) < 0)
+            net_buf_unref(s->l2cap_rx_sdu);
+        s->l2cap_rx_sdu = NULL;
+        return;
+    }
+#endif // BLE_L2CAP_ENABLED
+    // The slot is only handed back once the stack is done with it, so the writer can never overwrite it
+    ring_release(&s->ring);
+    k_sem_give(&s->write_space_sem);
+}
+
+static int ble_send(int session, const uint8_t *buf, size_t len, bool reply)
+{
+    return session_send(&sessions[session], buf, len, reply);
+}
+
+static void ble_flush(void)
+{
+#if BLE_BATCH_ENABLED
+    // Called at the end of each processing pass, so batches holding a reply go out now.
+    // Unsolicited messages wait a little longer in case the next pass has more to add.
+    int64_t now = k_uptime_get();
+    int64_t next_deadline = INT64_MAX;
+    for (int i = 0; i < RNRFC_MAX_BLE_SESSIONS; i++)
+    {
+        batch_t *batch = &sessions[i].batch;
+        if (batch->length == 0)
+            continue;
+        int64_t deadline = batch->started + BLE_BATCH_HOLD_MS;
+#ifdef CONFIG_REACH_CONN_EVENT_SYNC
+        // The radio is about to start an event, which is the last chance to get anything into it
+        if (conn_event_pass)
+            deadline = now;
+#endif // CONFIG_REACH_CONN_EVENT_SYNC
+        if (batch->has_reply || now >= deadline)
+            batch_flush(&sessions[i]);
+        else if (deadline < next_deadline)
+            next_deadline = deadline;
+    }
+    if (next_deadline != INT64_MAX)
+        k_work_reschedule(&batch_work, K_MSEC(next_deadline - now));
+#endif // BLE_BATCH_ENABLED
+    // Send anything that was waiting for TX buffers
+    for (int i = 0; i < RNRFC_MAX_BLE_SESSIONS; i++)
+        notify_queue_drain(&sessions[i]);
+}
+
+static size_t ble_get_max_response_size(int session)
+{
+    if (sessions[session].conn == NULL)
+        return 0;
+    // Only the plain characteristic is limited to a single notification
+    if (sessions[session].reply_transport != TRANSPORT_GATT)
+        return CR_CODED_BUFFER_SIZE;
+    size_t payload = bt_gatt_get_mtu(sessions[session].conn) - 3;
+#if BLE_BATCH_ENABLED
+    if (batch_is_subscribed(&sessions[session]))
+        payload = MIN(payload - BATCH_RECORD_HEADER_SIZE, BATCH_RECORD_MAX_SIZE);
+#endif // BLE_BATCH_ENABLED
+    return MIN(payload, MIN(BLE_MAX_NOTIFY_SIZE, CR_CODED_BUFFER_SIZE));
+}
+
+static uint32_t ble_get_ack_rate(int session, uint32_t requested_rate, bool is_write)
+{
+#if BLE_L2CAP_ENABLED
+    // L2CAP credits already pace the client, so only acknowledge as often as it asks
+    if (sessions[session].reply_transport == TRANSPORT_L2CAP)
+        return requested_rate;
+#endif // BLE_L2CAP_ENABLED
+    if (is_write)
+#if ACK_RATE_ADAPTIVE
+        // The adaptive rate backs off from here if the writes start waiting for the buffer
+        return MIN(requested_rate, BLE_WRITE_MAX_ACK_RATE);
+#elif (BLE_WRITE_CIRCULAR_BUFFER_SIZE > 1)
+        return (requested_rate < (BLE_WRITE_CIRCULAR_BUFFER_SIZE - 1)) ? requested_rate:BLE_WRITE_CIRCULAR_BUFFER_SIZE - 1;
+#else
+        return 1;
+#endif
+    else
+        return requested_rate;
+}
+
+static void ble_get_flow_counters(int session, bool is_write, rnrfc_flow_counters_t *counters)
+{
+    // Incoming file data is lost or held up in the write buffer, outgoing data in the notification queue
+    session_t *s = &sessions[session];
+    counters->drops = atomic_get(is_write ? &s->ingress_drops:&s->notify_failed);
+    counters->waits = atomic_get(is_write ? &s->ingress_full_waits:&s->notify_queue_waits);
+}
+
+static void ble_release_session(session_t *session)
+{
+#if BLE_RESUME_ENABLED
+    resume_save(session);
+#endif // BLE_RESUME_ENABLED
+    // Nothing in this session's queues can be delivered any more
+    notify_queue_reset(session);
+    atomic_set(&session->ring.head, 0);
+    atomic_set(&session->ring.tail, 0);
+    session->reply_transport = TRANSPORT_GATT;
+    session->gatt_transport = TRANSPORT_GATT;
+#if BLE_BATCH_ENABLED
+    session->batch.length = 0;
+    session->batch.count = 0;
+    session->batch.has_reply = false;
+#endif // BLE_BATCH_ENABLED
+#if BLE_SAR_ENABLED
+    session->sar_rx_slot = NULL;
+#endif // BLE_SAR_ENABLED
+#if BLE_L2CAP_ENABLED
+    l2cap_flush(session);
+#endif // BLE_L2CAP_ENABLED
+    session->release_pending = false;
+    rnrfc_transport_session_closed(&rnrfc_ble_transport, (int) (session - sessions));
+    // Releasing the reference is what allows the connection slot to be reused
+    struct bt_conn *conn = session->conn;
+    session->conn = NULL;
+    if (conn != NULL)
+        bt_conn_unref(conn);
+    // Make it easy for the client to come straight back
+    rnrfc_advertise_fast();
+}
+
+#ifdef CONFIG_REACH_CONN_EVENT_SYNC
+static int conn_event_init(void)
+{
+    IRQ_CONNECT(BLE_CONN_EVENT_IRQ, BLE_CONN_EVENT_IRQ_PRIORITY, conn_event_isr, NULL, 0);
+    irq_enable(BLE_CONN_EVENT_IRQ);
+    return (int) mpsl_radio_notification_cfg_set(MPSL_RADIO_NOTIFICATION_TYPE_INT_ON_ACTIVE, BLE_CONN_EVENT_DISTANCE, BLE_CONN_EVENT_IRQ);
+}
+
+static void conn_event_isr(const void *arg)
+{
+    ARG_UNUSED(arg);
+    // This fires ahead of every radio event, including advertising, which only matters once someone is connected
+    if (atomic_get(&connection_count) == 0)
+        return;
+    atomic_set(&conn_event_pending, 1);
+    rnrfc_request_processing();
+}
+#endif // CONFIG_REACH_CONN_EVENT_SYNC
+
+static int adv_start(bool fast)
+{
+    // Stopping first is harmless if advertising was already stopped, and the interval can't be changed while it runs
+    bt_le_adv_stop();
+    int rval = bt_le_adv_start(fast ? BT_LE_AD_FAST:BT_LE_AD_LOW_POWER, ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
+    if (rval)
+        return rval;
+    ble_advertising_started = true;
+    I3_LOG(LOG_MASK_BLE, "Advertising every %u-%u ms",
+        fast ? BLE_ADV_FAST_INTERVAL_MIN_MS:(BLE_ADV_INTERVAL_MS - BLE_ADV_INTERVAL_SPACING_MS),
+        fast ? BLE_ADV_FAST_INTERVAL_MAX_MS:(BLE_ADV_INTERVAL_MS + BLE_ADV_INTERVAL_SPACING_MS));
+    return 0;
+}
+
+static void adv_work_handler(struct k_work *item)
+{
+    bool fast = atomic_cas(&adv_fast_requested, 1, 0);
+    // Advertising has already stopped if every connection is in use, and resumes by itself once one is freed
+    if (atomic_get(&connection_count) >= RNRFC_MAX_BLE_SESSIONS)
+        return;
+    int rval = adv_start(fast);
+    if (rval)
+    {
+        if (++adv_retries > ADV_MAX_RETRIES)
+        {
+            I3_LOG(LOG_MASK_ERROR, "Failed to restart BLE advertising, error %d", rval);
+            adv_retries = 0;
+            return;
+        }
+        // Most likely the connection object of a client which just left hasn't been freed yet
+        if (fast)
+            atomic_set(&adv_fast_requested, 1);
+        k_work_reschedule(&adv_work, K_MSEC(ADV_RETRY_INTERVAL_MS));
+        return;
+    }
+    adv_retries = 0;
+    if (fast)
+        k_work_reschedule(&adv_work, K_MSEC(BLE_ADV_FAST_DURATION_MS));
+}
+
+#if BLE_BROADCAST_ENABLED
+static int broadcast_start(void)
+{
+    // Observers can link the broadcast to the connectable advertising through the identity address
+    int rval = bt_le_ext_adv_create(BT_LE_ADV_PARAM(BT_LE_ADV_OPT_EXT_ADV | BT_LE_ADV_OPT_USE_IDENTITY,
+                                                    BROADCAST_ADV_INTERVAL, BROADCAST_ADV_INTERVAL, NULL),
+                                    NULL, &broadcast_set);
+    if (rval)
+    {
+        broadcast_set = NULL;
+        return rval;
+    }
+#if BLE_BROADCAST_PERIODIC
+    rval = bt_le_per_adv_set_param(broadcast_set, BT_LE_PER_ADV_PARAM(BROADCAST_PER_ADV_INTERVAL, BROADCAST_PER_ADV_INTERVAL,
+                                                                      BT_LE_PER_ADV_OPT_NONE));
+    if (rval)
+        return rval;
+    // The extended advertising only has to point scanners at the periodic train, which carries the parameters
+    rval = bt_le_ext_adv_set_data(broadcast_set, &ad[1], 1, NULL, 0);
+    if (rval)
+        return rval;
+    rval = bt_le_per_adv_start(broadcast_set);
+    if (rval)
+        return rval;
+#endif // BLE_BROADCAST_PERIODIC
+    // Fill in the data before the set starts, so that the first broadcast isn't empty.  The BLE task isn't running yet.
+    broadcast_build();
+    broadcast_work_handler(NULL);
+    k_timer_start(&broadcast_timer, K_MSEC(BLE_BROADCAST_REFRESH_MS), K_MSEC(BLE_BROADCAST_REFRESH_MS));
+    return bt_le_ext_adv_start(broadcast_set, BT_LE_EXT_ADV_START_DEFAULT);
+}
+
+// Only called from the BLE task, between processing passes, or before it starts
+static void broadcast_build(void)
+{
+    uint8_t new_payload[BLE_BROADCAST_MAX_DATA_SIZE];
+    size_t length = rnrfc_app_get_broadcast_data(new_payload, sizeof(new_payload));
+    if (length > sizeof(new_payload))
+        length = sizeof(new_payload);
+    k_spinlock_key_t key = k_spin_lock(&broadcast_lock);
+    memcpy(broadcast_next, new_payload, length);
+    broadcast_next_length = length;
+    k_spin_unlock(&broadcast_lock, key);
+    k_work_submit(&broadcast_work);
+}
+
+static void broadcast_work_handler(struct k_work *item)
+{
+    ARG_UNUSED(item);
+    uint8_t *payload = &broadcast_data[BROADCAST_UUID_SIZE];
+    uint8_t new_payload[BLE_BROADCAST_MAX_DATA_SIZE];
+    k_spinlock_key_t key = k_spin_lock(&broadcast_lock);
+    size_t length = broadcast_next_length;
+    memcpy(new_payload, broadcast_next, length);
+    k_spin_unlock(&broadcast_lock, key);
+
+    // The controller only needs to hear about it when something has changed
+    if (broadcast_length != (int) length || memcmp(payload, new_payload, length))
+    {
+        memcpy(payload, new_payload, length);
+        struct bt_data data = BT_DATA(BT_DATA_SVC_DATA128, broadcast_data, BROADCAST_UUID_SIZE + length);
+#if BLE_BROADCAST_PERIODIC
+        int rval = bt_le_per_adv_set_data(broadcast_set, &data, 1);
+#else
+        int rval = bt_le_ext_adv_set_data(broadcast_set, &data, 1, NULL, 0);
+#endif // BLE_BROADCAST_PERIODIC
+        if (rval)
+        {
+            I3_LOG(LOG_MASK_WARN, "Failed to update BLE broadcast data, error %d", rval);
+            broadcast_length = -1;
+        }
+        else
+        {
+            broadcast_length = (int) length;
+            atomic_inc(&rnrfc_stats.broadcast_updates);
+        }
+    }
+}
+
+static void broadcast_timer_handler(struct k_timer *timer)
+{
+    ARG_UNUSED(timer);
+    atomic_set(&broadcast_refresh_pending, 1);
+    rnrfc_request_processing();
+}
+#endif // BLE_BROADCAST_ENABLED
+
+static void connected(struct bt_conn *conn, uint8_t err)
+{
+    if (err)
+    {
+        I3_LOG(LOG_MASK_BLE, "BLE connection failed (err %u)", err);
+        return;
+    }
+    session_t *session = &sessions[bt_conn_index(conn)];
+    session->conn = bt_conn_ref(conn);
+    session->connected_ms = k_uptime_get_32();
+    k_work_submit(&session->connect_work);
+}
+
+static void connect_work_handler(struct k_work *item)
+{
+    session_t *session = CONTAINER_OF(item, session_t, connect_work);
+    I3_LOG(LOG_MASK_BLE, "BLE connected, session %d", (int) (session - sessions));
+#if BLE_RESUME_ENABLED
+    // A fresh token for every connection, which the client swaps for its old one if it is resuming
+    session->resume_token = new_resume_token();
+    session->resumed = false;
+    session->resume_apply_pending = false;
+    session->notifications_off = false;
+#endif // BLE_RESUME_ENABLED
+    session->returning = peer_is_known(bt_conn_get_dst(session->conn));
+    session->first_prompt_seen = false;
+#ifdef CONFIG_REACH_BONDING
+    // Bonded clients just re-encrypt with the stored key, anyone else is asked to pair
+    int rval = bt_conn_set_security(session->conn, BT_SECURITY_L2);
+    if (rval)
+        I3_LOG(LOG_MASK_WARN, "Session %d security request failed (err %d)", (int) (session - sessions), rval);
+#endif // CONFIG_REACH_BONDING
+    rnrfc_app_handle_ble_connection();
+    cr_set_comm_link_connected(true);
+    session->connected = true;
+    atomic_inc(&connection_count);
+    rnrfc_request_processing();
+}
+
+static void disconnected(struct bt_conn *conn, uint8_t reason)
+{
+    session_t *session = &sessions[bt_conn_index(conn)];
+    if (session->conn != conn)
+        return;
+    k_work_submit(&session->disconnect_work);
+}
+
+static bool peer_is_known(const bt_addr_le_t *peer)
+{
+#ifdef CONFIG_REACH_BONDING
+    if (bt_addr_le_is_bonded(BT_ID_DEFAULT, peer))
+        return true;
+#endif // CONFIG_REACH_BONDING
+    bool known = false;
+#if BLE_RESUME_ENABLED
+    // The resumption cache remembers the most recent clients since boot
+    k_mutex_lock(&resume_lock, K_FOREVER);
+    for (int i = 0; i < BLE_RESUME_CACHE_SIZE && !known; i++)
+        known = (resume_cache[i].token != 0 && bt_addr_le_cmp(&resume_cache[i].peer, peer) == 0);
+    k_mutex_unlock(&resume_lock);
+#else
+    ARG_UNUSED(peer);
+#endif // BLE_RESUME_ENABLED
+    return known;
+}
+
+#ifdef CONFIG_REACH_BONDING
+static void pairing_complete(struct bt_conn *conn, bool bonded)
+{
+    I3_LOG(LOG_MASK_BLE, "Session %d paired, %s", (int) bt_conn_index(conn), bonded ? "bonded":"not bonded");
+}
+
+static void pairing_failed(struct bt_conn *conn, enum bt_security_err reason)
+{
+    I3_LOG(LOG_MASK_WARN, "Session %d pairing failed (reason %d)", (int) bt_conn_index(conn), (int) reason);
+}
+#endif // CONFIG_REACH_BONDING
+
+static coded_buffer_t *ring_claim(ingress_ring_t *ring)
+{
+    // Only the producer writes head, so it can be read without any ordering concerns
+    if (ring_get_size(ring) >= BLE_WRITE_CIRCULAR_BUFFER_SIZE)
+        return NULL;
+    return &ring->slots[(uint32_t) atomic_get(&ring->head) % BLE_WRITE_CIRCULAR_BUFFER_SIZE];
+}
+
+static void ring_publish(ingress_ring_t *ring)
+{
+    // atomic_set() is a full barrier, so the slot contents are visible before the new head
+    uint32_t next = ((uint32_t) atomic_get(&ring->head) + 1) % (2 * BLE_WRITE_CIRCULAR_BUFFER_SIZE);
+    atomic_set(&ring->head, (atomic_val_t) next);
+}
+
+static coded_buffer_t *ring_peek(ingress_ring_t *ring)
+{
+    if (ring_get_size(ring) == 0)
+        return NULL;
+    return &ring->slots[(uint32_t) atomic_get(&ring->tail) % BLE_WRITE_CIRCULAR_BUFFER_SIZE];
+}
+
+static void ring_release(ingress_ring_t *ring)
+{
+    uint32_t next = ((uint32_t) atomic_get(&ring->tail) + 1) % (2 * BLE_WRITE_CIRCULAR_BUFFER_SIZE);
+    atomic_set(&ring->tail, (atomic_val_t) next);
+}
+
+static uint32_t ring_get_size(ingress_ring_t *ring)
+{
+    uint32_t head = (uint32_t) atomic_get(&ring->head);
+    uint32_t tail = (uint32_t) atomic_get(&ring->tail);
+    return (head + 2 * BLE_WRITE_CIRCULAR_BUFFER_SIZE - tail) % (2 * BLE_WRITE_CIRCULAR_BUFFER_SIZE);
+}
+
+static int session_send(session_t *session, const uint8_t *buf, size_t size, bool reply)
+{
+    if (session->conn == NULL || !session->connected)
+        return RNRFC_TRANSPORT_NOT_SENT;
+    transport_t transport = reply ? session->reply_transport:session->gatt_transport;
+    size_t payload = bt_gatt_get_mtu(session->conn) - 3;
+    if (payload > BLE_MAX_NOTIFY_SIZE)
+        payload = BLE_MAX_NOTIFY_SIZE;
+#if BLE_BATCH_ENABLED
+    // Subscribing to the batched characteristic is how a client asks for everything meant for the plain one to be batched
+    if (transport == TRANSPORT_GATT && batch_is_subscribed(session))
+        return batch_add(session, buf, size, payload, reply);
+    // Anything going another way must not overtake what is already batched
+    batch_flush(session);
+#endif // BLE_BATCH_ENABLED
+#if BLE_L2CAP_ENABLED
+    if (transport == TRANSPORT_L2CAP)
+    {
+        if (session->l2cap_connected)
+            return l2cap_send(session, buf, size);
+        // The channel has gone away, so fall back to the characteristic
+        transport = session->gatt_transport;
+    }
+#endif // BLE_L2CAP_ENABLED
+
+#if BLE_SAR_ENABLED
+    if (transport == TRANSPORT_GATT_SAR)
+    {
+        if (!bt_gatt_is_subscribed(session->conn, &reach_service.attrs[REACH_SAR_ATTR_INDEX], BT_GATT_CCC_NOTIFY))
+            return RNRFC_TRANSPORT_NOT_SENT;
+        // Split the message up, with the total length in the first segment so the client knows when it is done
+        size_t sent = 0;
+        uint8_t seq = 0;
+        do
+        {
+            notify_entry_t *entry = notify_queue_claim(session);
+            if (entry == NULL)
+            {
+                LOG_ERROR("Notify queue full, dropping %u byte response after %u bytes", size, sent);
+                return cr_ErrorCodes_WRITE_FAILED;
+            }
+            size_t header_size = (sent == 0) ? SAR_FIRST_HEADER_SIZE:SAR_HEADER_SIZE;
+            size_t chunk = MIN(size - sent, payload - header_size);
+            entry->buf[0] = (seq & SAR_SEQ_MASK) | ((sent == 0) ? SAR_FLAG_FIRST:0) | ((sent + chunk == size) ? SAR_FLAG_LAST:0);
+            if (sent == 0)
+                sys_put_le16((uint16_t) size, &entry->buf[1]);
+            memcpy(&entry->buf[header_size], &buf[sent], chunk);
+            entry->length = (uint16_t) (header_size + chunk);
+            entry->attr_index = REACH_SAR_ATTR_INDEX;
+            notify_queue_commit(session);
+            atomic_inc(&rnrfc_stats.sar_segments_sent);
+            sent += chunk;
+            seq++;
+        } while (sent < size);
+        return 0;
+    }
+#endif // BLE_SAR_ENABLED
+
+    if (!bt_gatt_is_subscribed(session->conn, &reach_service.attrs[REACH_ATTR_INDEX], BT_GATT_CCC_NOTIFY))
+        return RNRFC_TRANSPORT_NOT_SENT;
+    if (size > payload)
+    {
+        LOG_ERROR("%u byte response does not fit in a %u byte notification", size, payload);
+        atomic_inc(&rnrfc_stats.notify_failed);
+        atomic_inc(&session->notify_failed);
+        return cr_ErrorCodes_WRITE_FAILED;
+    }
+    notify_entry_t *entry = notify_queue_claim(session);
+    if (entry == NULL)
+    {
+        LOG_ERROR("Notify queue full, dropping %u byte response", size);
+        return cr_ErrorCodes_WRITE_FAILED;
+    }
+    memcpy(entry->buf, buf, size);
+    entry->length = (uint16_t) size;
+    entry->attr_index = REACH_ATTR_INDEX;
+    notify_queue_commit(session);
+    return 0;
+}
+
+static notify_entry_t *notify_queue_claim(session_t *session)
+{
+    if (session->notify_queue_count >= BLE_NOTIFY_QUEUE_SIZE)
+    {
+        // Hold the stack here until the link frees up a TX buffer, rather than losing the response
+        atomic_inc(&rnrfc_stats.notify_queue_waits);
+        atomic_inc(&session->notify_queue_waits);
+        int64_t deadline = k_uptime_get() + BLE_NOTIFY_TIMEOUT_MS;
+        notify_queue_drain(session);
+        while (session->notify_queue_count >= BLE_NOTIFY_QUEUE_SIZE)
+        {
+            int64_t remaining = deadline - k_uptime_get();
+            if (remaining <= 0 || k_sem_take(&notify_credit_sem, K_MSEC(remaining)) != 0)
+                break;
+            notify_queue_drain(session);
+        }
+        if (session->notify_queue_count >= BLE_NOTIFY_QUEUE_SIZE)
+        {
+            atomic_inc(&rnrfc_stats.notify_failed);
+            atomic_inc(&session->notify_failed);
+            return NULL;
+        }
+    }
+    return &session->notify_queue[(session->notify_queue_head + session->notify_queue_count) % BLE_NOTIFY_QUEUE_SIZE];
+}
+
+static void notify_queue_commit(session_t *session)
+{
+    session->notify_queue[(session->notify_queue_head + session->notify_queue_count) % BLE_NOTIFY_QUEUE_SIZE].timestamp = k_cycle_get_32();
+    session->notify_queue_count++;
+    if (session->notify_queue_count > (size_t) atomic_get(&rnrfc_stats.notify_queue_high_water))
+        atomic_set(&rnrfc_stats.notify_queue_high_water, (atomic_val_t) session->notify_queue_count);
+    notify_queue_drain(session);
+}
+
+static void notify_queue_drain(session_t *session)
+{
+    while (session->notify_queue_count > 0 && notify_get_in_flight() < BLE_NOTIFY_MAX_IN_FLIGHT)
+    {
+        notify_entry_t *entry = &session->notify_queue[session->notify_queue_head];
+        struct bt_gatt_notify_params params = {
+            .attr = &reach_service.attrs[entry->attr_index],
+            .data = entry->buf,
+            .len = entry->length,
+            .func = notify_complete,
+            .user_data = (void *) (uintptr_t) entry->timestamp,
+        };
+        atomic_inc(&session->notify_in_flight);
+        int rval = bt_gatt_notify_cb(session->conn, &params);
+        if (rval == -ENOMEM)
+        {
+            // Out of buffers despite the credit count, try again on the next completion or wakeup
+            atomic_dec(&session->notify_in_flight);
+            break;
+        }
+        else if (rval)
+        {
+            atomic_dec(&session->notify_in_flight);
+            LOG_ERROR("Notify failed, error %d", rval);
+            atomic_inc(&rnrfc_stats.notify_failed);
+            atomic_inc(&session->notify_failed);
+        }
+        else
+        {
+            atomic_inc(&rnrfc_stats.notify_sent);
+        }
+        session->notify_queue_head = (session->notify_queue_head + 1) % BLE_NOTIFY_QUEUE_SIZE;
+        session->notify_queue_count--;
+    }
+
+    atomic_val_t depth = 0;
+    for (int i = 0; i < RNRFC_MAX_BLE_SESSIONS; i++)
+        depth += (atomic_val_t) sessions[i].notify_queue_count;
+    atomic_set(&rnrfc_stats.notify_queue_depth, depth);
+}
+
+static void notify_queue_reset(session_t *session)
+{
+    // Nothing queued can be delivered after a disconnect
+    session->notify_queue_head = 0;
+    session->notify_queue_count = 0;
+    // Completions are not reported for everything that was in flight, so this session's credits are simply handed back
+    atomic_set(&session->notify_in_flight, 0);
+    k_sem_give(&notify_credit_sem);
+}
+
+static atomic_val_t notify_get_in_flight(void)
+{
+    atomic_val_t in_flight = 0;
+    for (int i = 0; i < RNRFC_MAX_BLE_SESSIONS; i++)
+        in_flight += atomic_get(&sessions[i].notify_in_flight);
+    return in_flight;
+}
+
+static void notify_complete(struct bt_conn *conn, void *user_data)
+{
+    uint32_t latency_us = k_cyc_to_us_floor32(k_cycle_get_32() - (uint32_t) (uintptr_t) user_data);
+    atomic_add(&rnrfc_stats.notify_latency_total_us, (atomic_val_t) latency_us);
+    if (latency_us > (uint32_t) atomic_get(&rnrfc_stats.notify_latency_max_us))
+        atomic_set(&rnrfc_stats.notify_latency_max_us, (atomic_val_t) latency_us);
+    atomic_inc(&rnrfc_stats.notify_completed);
+    // A completion which arrives after its session was reset has already been handed back
+    session_t *session = &sessions[bt_conn_index(conn)];
+    if (atomic_dec(&session->notify_in_flight) <= 0)
+        atomic_set(&session->notify_in_flight, 0);
+    k_sem_give(&notify_credit_sem);
+    rnrfc_request_processing();
+}
+
+#if BLE_BATCH_ENABLED
+static bool batch_is_subscribed(session_t *session)
+{
+    return bt_gatt_is_subscribed(session->conn, &reach_service.attrs[REACH_BATCH_ATTR_INDEX], BT_GATT_CCC_NOTIFY);
+}
+
+static int batch_add(session_t *session, const uint8_t *buf, size_t size, size_t payload, bool reply)
+{
+    batch_t *batch = &session->batch;
+    size_t record_size = BATCH_RECORD_HEADER_SIZE + size;
+    if (size == 0 || size > BATCH_RECORD_MAX_SIZE || record_size > payload)
+    {
+        LOG_ERROR("%u byte response does not fit in a %u byte batched notification", size, payload);
+        atomic_inc(&rnrfc_stats.notify_failed);
+        atomic_inc(&session->notify_failed);
+        return cr_ErrorCodes_WRITE_FAILED;
+    }
+    // The messages already in a batch which can't be queued were lost, and this is the only caller left to hear about it
+    int rval = 0;
+    if (batch->length + record_size > payload)
+        rval = batch_flush(session);
+    if (batch->length == 0)
+        batch->started = k_uptime_get();
+    batch->buf[batch->length] = (uint8_t) size;
+    memcpy(&batch->buf[batch->length + BATCH_RECORD_HEADER_SIZE], buf, size);
+    batch->length += (uint16_t) record_size;
+    batch->count++;
+    batch->has_reply |= reply;
+    // Don't wait for a message which can't fit anyway
+    if (batch->length + BATCH_RECORD_HEADER_SIZE >= payload && batch_flush(session))
+        rval = cr_ErrorCodes_WRITE_FAILED;
+    return rval;
+}
+
+static int batch_flush(session_t *session)
+{
+    batch_t *batch = &session->batch;
+    if (batch->length == 0)
+        return 0;
+    notify_entry_t *entry = notify_queue_claim(session);
+    if (entry == NULL)
+    {
+        LOG_ERROR("Notify queue full, dropping %u batched messages", batch->count);
+    }
+    else
+    {
+        memcpy(entry->buf, batch->buf, batch->length);
+        entry->length = batch->length;
+        entry->attr_index = REACH_BATCH_ATTR_INDEX;
+        atomic_inc(&rnrfc_stats.batch_notifications);
+        atomic_add(&rnrfc_stats.batch_messages, (atomic_val_t) batch->count);
+    }
+    batch->length = 0;
+    batch->count = 0;
+    batch->has_reply = false;
+    if (entry == NULL)
+        return cr_ErrorCodes_WRITE_FAILED;
+    notify_queue_commit(session);
+    return 0;
+}
+
+static void batch_work_handler(struct k_work *item)
+{
+    ARG_UNUSED(item);
+    rnrfc_request_processing();
+}
+#endif // BLE_BATCH_ENABLED
+
+#if BLE_RESUME_ENABLED
+static ssize_t read_resume(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset)
+{
+    session_t *session = &sessions[bt_conn_index(conn)];
+    uint8_t info[RESUME_INFO_SIZE];
+    sys_put_le32(session->resume_token, &info[0]);
+    sys_put_le32(crcb_compute_parameter_hash(), &info[RESUME_TOKEN_SIZE]);
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, info, sizeof(info));
+}
+
+static ssize_t write_resume(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
+{
+    if (offset != 0)
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    if (len != RESUME_TOKEN_SIZE)
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    session_t *session = &sessions[bt_conn_index(conn)];
+    uint32_t token = sys_get_le32((const uint8_t *) buf);
+    uint32_t hash = crcb_compute_parameter_hash();
+    const bt_addr_le_t *peer = bt_conn_get_dst(conn);
+
+    // A token is only good for the peer it was issued to, and another peer can't use up someone else's token
+    resume_record_t *record = NULL;
+    k_mutex_lock(&resume_lock, K_FOREVER);
+    for (int i = 0; i < BLE_RESUME_CACHE_SIZE && token != 0; i++)
+    {
+        if (resume_cache[i].token == token && bt_addr_le_cmp(&resume_cache[i].peer, peer) == 0)
+            record = &resume_cache[i];
+    }
+    bool valid = (record != NULL && record->param_hash == hash);
+    if (valid)
+    {
+        // The token the client read before resuming has now been seen, so it gets a new one for next time
+        session->resume_token = new_resume_token();
+        session->notifications_off = record->notifications_off;
+    }
+    // A token can only be used once, and a stale one is no use to anyone
+    if (record != NULL)
+        record->token = 0;
+    k_mutex_unlock(&resume_lock);
+
+    if (!valid)
+    {
+        atomic_inc(&rnrfc_stats.resume_misses);
+        I3_LOG(LOG_MASK_BLE, "Session %d can't resume, %s", (int) (session - sessions), record ? "parameters have changed":"unknown token");
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+    atomic_inc(&rnrfc_stats.resume_hits);
+    I3_LOG(LOG_MASK_BLE, "Session %d resumed", (int) (session - sessions));
+    session->resumed = true;
+    session->resume_apply_pending = true;
+    rnrfc_request_processing();
+    return len;
+}
+
+static uint32_t new_resume_token(void)
+{
+    // 0 means there is no token
+    uint32_t token;
+    do
+    {
+        token = sys_rand32_get();
+    } while (token == 0);
+    return token;
+}
+
+static void resume_save(session_t *session)
+{
+    if (session->conn == NULL || session->resume_token == 0)
+        return;
+    const bt_addr_le_t *peer = bt_conn_get_dst(session->conn);
+    k_mutex_lock(&resume_lock, K_FOREVER);
+    // Each peer only needs its latest record.  Otherwise use a free one, or replace whichever has gone unused longest.
+    resume_record_t *record = NULL;
+    for (int i = 0; i < BLE_RESUME_CACHE_SIZE && record == NULL; i++)
+    {
+        if (resume_cache[i].token != 0 && bt_addr_le_cmp(&resume_cache[i].peer, peer) == 0)
+            record = &resume_cache[i];
+    }
+    for (int i = 0; i < BLE_RESUME_CACHE_SIZE && record == NULL; i++)
+    {
+        if (resume_cache[i].token == 0)
+            record = &resume_cache[i];
+    }
+    if (record == NULL)
+    {
+        record = &resume_cache[0];
+        for (int i = 1; i < BLE_RESUME_CACHE_SIZE; i++)
+        {
+            if (resume_cache[i].last_used < record->last_used)
+                record = &resume_cache[i];
+        }
+    }
+    bt_addr_le_copy(&record->peer, peer);
+    record->token = session->resume_token;
+    record->param_hash = crcb_compute_parameter_hash();
+    record->notifications_off = session->notifications_off;
+    record->last_used = k_uptime_get_32();
+    k_mutex_unlock(&resume_lock);
+    session->resume_token = 0;
+}
+#endif // BLE_RESUME_ENABLED
+
+static void disconnect_work_handler(struct k_work *item)
+{
+    session_t *session = CONTAINER_OF(item, session_t, disconnect_work);
+    session->connected = false;
+    atomic_dec(&connection_count);
+    rnrfc_app_handle_ble_disconnection();
+    // The Reach task owns the queues, so let it clean them up
+    session->release_pending = true;
+    rnrfc_request_processing();
+    I3_LOG(LOG_MASK_BLE, "BLE disconnected, session %d", (int) (session - sessions));
+}
+
+static ssize_t read_reach(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset)
+{
+    uint8_t *resp_buf;
+    size_t resp_len;
+    cr_get_coded_response_buffer(&resp_buf, &resp_len);
+    I3_LOG(LOG_MASK_BLE, "Read request for reach. %d at offset %u.", resp_len, offset);
+    if (resp_len > CR_CODED_BUFFER_SIZE)
+        resp_len = CR_CODED_BUFFER_SIZE;
+    // Serves the slice starting at offset straight from the response buffer, so that a client can fetch a response
+    // longer than one ATT payload with read blob requests.  The response can change between them if another prompt
+    // is processed, so polling clients should only read after their own prompt has been handled.
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, resp_buf, (uint16_t) resp_len);
+}
+static ssize_t write_reach(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
+{
+    // I3_LOG(LOG_MASK_BLE, "Write to reach.  Len %u", len);
+    if (flags & BT_GATT_WRITE_FLAG_PREPARE)
+    {
+        // Long writes are only checked here, the Bluetooth stack delivers the whole value again once it is executed
+        return ((size_t) offset + len > CR_CODED_BUFFER_SIZE) ? BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN):0;
+    }
+    if (offset != 0)
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    if (len > CR_CODED_BUFFER_SIZE)
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    session_t *session = &sessions[bt_conn_index(conn)];
+    rnrfc_conn_policy_activity(bt_conn_index(conn));
+#if BLE_SAR_ENABLED
+    if (session->sar_rx_slot != NULL)
+    {
+        // A segmented prompt is being reassembled in the slot this write would claim, so it is abandoned
+        LOG_ERROR("Unsegmented write during a segmented prompt, discarding the segmented prompt");
+        session->sar_rx_slot = NULL;
+        atomic_inc(&rnrfc_stats.sar_errors);
+    }
+#endif // BLE_SAR_ENABLED
+
+    // Copy the data straight into the next free slot, there must always be a process between stores
+    coded_buffer_t *slot = ingress_claim(session, len, flags);
+    if (slot == NULL)
+        return BT_GATT_ERR(BT_ATT_ERR_INSUFFICIENT_RESOURCES);
+    memcpy(slot->buf, buf, (size_t) len);
+    slot->length = (size_t) len;
+    slot->timestamp = k_cycle_get_32();
+    slot->transport = TRANSPORT_GATT;
+    ingress_publish(session);
+    return len;
+}
+
+#if BLE_SAR_ENABLED
+static ssize_t write_reach_sar(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
+{
+    if (flags & BT_GATT_WRITE_FLAG_PREPARE)
+        return ((size_t) offset + len > SAR_FIRST_HEADER_SIZE + CR_CODED_BUFFER_SIZE) ? BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN):0;
+    if (offset != 0)
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    if (len < SAR_HEADER_SIZE)
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    session_t *session = &sessions[bt_conn_index(conn)];
+    rnrfc_conn_policy_activity(bt_conn_index(conn));
+    atomic_inc(&rnrfc_stats.sar_segments_received);
+
+    const uint8_t *data = (const uint8_t *) buf;
+    uint8_t header = data[0];
+    size_t data_len;
+    if (header & SAR_FLAG_FIRST)
+    {
+        // A new message always replaces one that was never finished
+        session->sar_rx_slot = NULL;
+        if (len < SAR_FIRST_HEADER_SIZE || (header & SAR_SEQ_MASK) != 0)
+        {
+            atomic_inc(&rnrfc_stats.sar_errors);
+            return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+        }
+        size_t total = sys_get_le16(&data[1]);
+        if (total == 0 || total > CR_CODED_BUFFER_SIZE)
+        {
+            LOG_ERROR("Segmented prompt of %u bytes is too large", total);
+            atomic_inc(&rnrfc_stats.sar_errors);
+            return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+        }
+        // Reassemble straight into a write buffer slot, which is only published once the last segment arrives
+        coded_buffer_t *slot = ingress_claim(session, len, flags);
+        if (slot == NULL)
+            return BT_GATT_ERR(BT_ATT_ERR_INSUFFICIENT_RESOURCES);
+        slot->length = 0;
+        slot->timestamp = k_cycle_get_32();
+        slot->transport = TRANSPORT_GATT_SAR;
+        session->sar_rx_slot = slot;
+        session->sar_rx_expected = total;
+        session->sar_rx_seq = 0;
+        data += SAR_FIRST_HEADER_SIZE;
+        data_len = len - SAR_FIRST_HEADER_SIZE;
+    }
+    else
+    {
+        if (session->sar_rx_slot == NULL || (header & SAR_SEQ_MASK) != ((session->sar_rx_seq + 1) & SAR_SEQ_MASK))
+        {
+            // A segment went missing, so the whole message has to be discarded
+            LOG_ERROR("Unexpected segment 0x%02x, discarding prompt", header);
+            session->sar_rx_slot = NULL;
+            atomic_inc(&rnrfc_stats.sar_errors);
+            return BT_GATT_ERR(BT_ATT_ERR_UNLIKELY);
+        }
+        session->sar_rx_seq++;
+        data += SAR_HEADER_SIZE;
+        data_len = len - SAR_HEADER_SIZE;
+    }
+
+    coded_buffer_t *slot = session->sar_rx_slot;
+    if (slot->length + data_len > session->sar_rx_expected
+        || ((header & SAR_FLAG_LAST) && slot->length + data_len != session->sar_rx_expected))
+    {
+        LOG_ERROR("Segmented prompt length mismatch, expected %u bytes", session->sar_rx_expected);
+        session->sar_rx_slot = NULL;
+        atomic_inc(&rnrfc_stats.sar_errors);
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+    memcpy(&slot->buf[slot->length], data, data_len);
+    slot->length += data_len;
+    if (header & SAR_FLAG_LAST)
+    {
+        session->sar_rx_slot = NULL;
+        ingress_publish(session);
+    }
+    return len;
+}
+#endif // BLE_SAR_ENABLED
+
+static coded_buffer_t *ingress_claim(session_t *session, uint16_t len, uint8_t flags)
+{
+    coded_buffer_t *slot = ring_claim(&session->ring);
+    if (slot == NULL)
+    {
+        // Stalling the BT RX thread briefly pushes back on the link, which is the only flow control available for write commands
+        atomic_inc(&rnrfc_stats.ingress_full_waits);
+        atomic_inc(&session->ingress_full_waits);
+        rnrfc_request_processing();
+        k_sem_reset(&session->write_space_sem);
+        int64_t deadline = k_uptime_get() + BLE_WRITE_FULL_TIMEOUT_MS;
+        while ((slot = ring_claim(&session->ring)) == NULL)
+        {
+            int64_t remaining = deadline - k_uptime_get();
+            if (remaining <= 0 || k_sem_take(&session->write_space_sem, K_MSEC(remaining)) != 0)
+                break;
+        }
+    }
+    if (slot == NULL)
+    {
+        // Never overwrite a queued prompt, report the failure instead (write commands have no way to receive this)
+        atomic_inc(&rnrfc_stats.ingress_drops);
+        atomic_inc(&session->ingress_drops);
+        LOG_ERROR("Reach write buffer full, dropping %u byte %s", len, (flags & BT_GATT_WRITE_FLAG_CMD) ? "command":"request");
+    }
+    return slot;
+}
+
+static void ingress_publish(session_t *session)
+{
+    ring_publish(&session->ring);
+    uint32_t size = ring_get_size(&session->ring);
+    if (size > (uint32_t) atomic_get(&rnrfc_stats.ingress_high_water))
+        atomic_set(&rnrfc_stats.ingress_high_water, (atomic_val_t) size);
+    rnrfc_request_processing();
+}
+
+static void subscribe_reach(const struct bt_gatt_attr *attr, uint16_t value)
+{
+    // Subscriptions are tracked per connection by the Bluetooth stack and checked with bt_gatt_is_subscribed()
+    const char *name = "segmented ";
+    if (attr == &reach_service.attrs[REACH_ATTR_INDEX + 1])
+        name = "";
+#if BLE_BATCH_ENABLED
+    else if (attr == &reach_service.attrs[REACH_BATCH_ATTR_INDEX + 1])
+        name = "batched ";
+#endif // BLE_BATCH_ENABLED
+    I3_LOG(LOG_MASK_BLE, "%s Reach %scharacteristic", value == BT_GATT_CCC_NOTIFY ? "Subscribe to":"Unsubscribe from", name);
+}
+
+#if BLE_L2CAP_ENABLED
+static ssize_t read_l2cap_psm(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset)
+{
+    uint16_t psm = sys_cpu_to_le16(l2cap_server.psm);
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &psm, sizeof(psm));
+}
+
+static int l2cap_accept(struct bt_conn *conn, struct bt_l2cap_server *server, struct bt_l2cap_chan **chan)
+{
+    session_t *session = &sessions[bt_conn_index(conn)];
+    if (session->l2cap_connected)
+    {
+        I3_LOG(LOG_MASK_WARN, "Session %d already has an L2CAP channel", bt_conn_index(conn));
+        return -ENOMEM;
+    }
+    memset(&session->l2cap_chan, 0, sizeof(session->l2cap_chan));
+    session->l2cap_chan.chan.ops = &l2cap_ops;
+    session->l2cap_chan.rx.mtu = CR_CODED_BUFFER_SIZE;
+    // Enough credits for every RX buffer this session can hold, with a whole SDU in each
+    session->l2cap_chan.rx.init_credits = BLE_L2CAP_RX_SDUS * DIV_ROUND_UP(CR_CODED_BUFFER_SIZE + 2, BT_L2CAP_RX_MTU);
+    *chan = &session->l2cap_chan.chan;
+    return 0;
+}
+
+static void l2cap_connected(struct bt_l2cap_chan *chan)
+{
+    session_t *session = CONTAINER_OF(chan, session_t, l2cap_chan.chan);
+    session->l2cap_connected = true;
+    I3_LOG(LOG_MASK_BLE, "L2CAP channel connected, session %d, TX MTU %u", (int) (session - sessions), session->l2cap_chan.tx.mtu);
+}
+
+static void l2cap_disconnected(struct bt_l2cap_chan *chan)
+{
+    session_t *session = CONTAINER_OF(chan, session_t, l2cap_chan.chan);
+    session->l2cap_connected = false;
+    // Anything still queued is thrown away by the BLE task
+    rnrfc_request_processing();
+    I3_LOG(LOG_MASK_BLE, "L2CAP channel disconnected, session %d", (int) (session - sessions));
+}
+
+static struct net_buf *l2cap_alloc_buf(struct bt_l2cap_chan *chan)
+{
+    return net_buf_alloc(&l2cap_rx_pool, K_NO_WAIT);
+}
+
+static int l2cap_recv(struct bt_l2cap_chan *chan, struct net_buf *buf)
+{
+    session_t *session = CONTAINER_OF(chan, session_t, l2cap_chan.chan);
+    rnrfc_conn_policy_activity((int) (session - sessions));
+    atomic_inc(&rnrfc_stats.l2cap_sdus_received);
+    // Keep the SDU (and its credits) until the BLE task has handed it to the stack, rather than copying it
+    net_buf_put(&session->l2cap_rx_fifo, buf);
+    rnrfc_request_processing();
+    return -EINPROGRESS;
+}
+
+static void l2cap_flush(session_t *session)
+{
+    struct net_buf *buf;
+    while ((buf = net_buf_get(&session->l2cap_rx_fifo, K_NO_WAIT)) != NULL)
+        net_buf_unref(buf);
+}
+
+static int l2cap_send(session_t *session, const uint8_t *buf, size_t size)
+{
+    if (size > session->l2cap_chan.tx.mtu)
+    {
+        LOG_ERROR("%u byte response does not fit in a %u byte SDU", size, session->l2cap_chan.tx.mtu);
+        atomic_inc(&rnrfc_stats.notify_failed);
+        atomic_inc(&session->notify_failed);
+        return cr_ErrorCodes_WRITE_FAILED;
+    }
+    // Waiting for a buffer holds the stack here until the client returns some credits
+    struct net_buf *sdu = net_buf_alloc(&l2cap_tx_pool, K_MSEC(BLE_NOTIFY_TIMEOUT_MS));
+    if (sdu == NULL)
+    {
+        LOG_ERROR("No L2CAP buffers, dropping %u byte response", size);
+        atomic_inc(&rnrfc_stats.notify_failed);
+        atomic_inc(&session->notify_failed);
+        return cr_ErrorCodes_WRITE_FAILED;
+    }
+    net_buf_reserve(sdu, BT_L2CAP_SDU_CHAN_SEND_RESERVE);
+    net_buf_add_mem(sdu, buf, size);
+    int rval = bt_l2cap_chan_send(&session->l2cap_chan.chan, sdu);
+    if (rval < 0)
+    {
+        net_buf_unref(sdu);
+        LOG_ERROR("L2CAP send failed, error %d", rval);
+        atomic_inc(&rnrfc_stats.notify_failed);
+        atomic_inc(&session->notify_failed);
+        return cr_ErrorCodes_WRITE_FAILED;
+    }
+    atomic_inc(&rnrfc_stats.l2cap_sdus_sent);
+    return 0;
+}
+#endif // BLE_L2CAP_ENABLED
@@ -0,0 +1,475 @@
+/*
+ * Copyright (c) 2023-2024 i3 Product Development
+ * 
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file      reach_conn_policy.c
+ * @brief     BLE connection parameter policy for the nRF Connect Reach integration
+ * 
+ * @copyright (c) Copyright 2024 i3 Product Development. All Rights Reserved.
+ */
+
+#include "reach_conn_policy.h"
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/hci.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "reach_nrf_connect.h"
+#include "i3_log.h"
+
+/*******************************************************************************
+ *******************************   DEFINES   ***********************************
+ ******************************************************************************/
+
+// Default define values, which can be overridden in the .h file as needed
+#ifndef CONN_POLICY_FAST_INTERVAL_MIN_MS
+#define CONN_POLICY_FAST_INTERVAL_MIN_MS 15
+#endif // CONN_POLICY_FAST_INTERVAL_MIN_MS
+
+#ifndef CONN_POLICY_FAST_INTERVAL_MAX_MS
+#define CONN_POLICY_FAST_INTERVAL_MAX_MS 30
+#endif // CONN_POLICY_FAST_INTERVAL_MAX_MS
+
+#ifndef CONN_POLICY_FAST_TIMEOUT_MS
+#define CONN_POLICY_FAST_TIMEOUT_MS 4000
+#endif // CONN_POLICY_FAST_TIMEOUT_MS
+
+#ifndef CONN_POLICY_IDLE_INTERVAL_MIN_MS
+#define CONN_POLICY_IDLE_INTERVAL_MIN_MS 100
+#endif // CONN_POLICY_IDLE_INTERVAL_MIN_MS
+
+#ifndef CONN_POLICY_IDLE_INTERVAL_MAX_MS
+#define CONN_POLICY_IDLE_INTERVAL_MAX_MS 200
+#endif // CONN_POLICY_IDLE_INTERVAL_MAX_MS
+
+#ifndef CONN_POLICY_IDLE_LATENCY
+#define CONN_POLICY_IDLE_LATENCY 4
+#endif // CONN_POLICY_IDLE_LATENCY
+
+#ifndef CONN_POLICY_IDLE_TIMEOUT_MS
+#define CONN_POLICY_IDLE_TIMEOUT_MS 6000
+#endif // CONN_POLICY_IDLE_TIMEOUT_MS
+
+#ifndef CONN_POLICY_IDLE_DELAY_MS
+#define CONN_POLICY_IDLE_DELAY_MS 5000
+#endif // CONN_POLICY_IDLE_DELAY_MS
+
+#ifndef CONN_POLICY_RSSI_SAMPLE_MS
+#define CONN_POLICY_RSSI_SAMPLE_MS 1000
+#endif // CONN_POLICY_RSSI_SAMPLE_MS
+
+#ifndef CONN_POLICY_REQUEST_2M_PHY
+#define CONN_POLICY_REQUEST_2M_PHY 1
+#endif // CONN_POLICY_REQUEST_2M_PHY
+
+#ifndef CONN_POLICY_REQUEST_MAX_DATA_LEN
+#define CONN_POLICY_REQUEST_MAX_DATA_LEN 1
+#endif // CONN_POLICY_REQUEST_MAX_DATA_LEN
+
+// The longest time needed for a 251 byte PDU on the 1M PHY, used if the controller rejects the coded PHY maximum
+#define DATA_TIME_1M_MAX 2120
+
+#if (CONN_POLICY_IDLE_TIMEOUT_MS <= ((1 + CONN_POLICY_IDLE_LATENCY) * CONN_POLICY_IDLE_INTERVAL_MAX_MS * 2))
+#error "Connection policy idle supervision timeout is too short for the idle interval and latency"
+#endif
+
+// Defines only needed internally
+// The value HCI uses when the RSSI can't be read, which is also kept until the first sample
+#define RSSI_NOT_AVAILABLE 127
+#define CONN_INTERVAL(ms) (((ms) * 4) / 5)
+#define CONN_TIMEOUT(ms) ((ms) / 10)
+
+/*******************************************************************************
+ ****************************   LOCAL  TYPES   *********************************
+ ******************************************************************************/
+
+typedef struct {
+    rnrfc_conn_params_t params;
+    // Uptime of the last Reach traffic, in milliseconds
+    atomic_t last_activity;
+    struct k_work_delayable idle_work;
+    // Negotiates the PHY and data length, which can't be done directly from the connected callback
+    struct k_work link_work;
+    // The RSSI is sampled on the system work queue, so that reads of it never wait for the controller
+    struct k_work_delayable rssi_work;
+    atomic_t rssi;
+} policy_session_t;
+
+// Used to look up the connection belonging to a session
+typedef struct {
+    int index;
+    struct bt_conn *conn;
+} find_conn_t;
+
+/*******************************************************************************
+ *********************   LOCAL FUNCTION PROTOTYPES   ***************************
+ ******************************************************************************/
+
+static void request_mode(int session, rnrfc_conn_mode_t mode);
+static void find_conn(struct bt_conn *conn, void *data);
+static void idle_work_handler(struct k_work *item);
+static void link_work_handler(struct k_work *item);
+static void rssi_work_handler(struct k_work *item);
+static int read_rssi(struct bt_conn *conn, int8_t *rssi);
+static const char *phy_to_string(uint8_t phy);
+
+// Callbacks for BLE events
+static void connected(struct bt_conn *conn, uint8_t err);
+static void disconnected(struct bt_conn *conn, uint8_t reason);
+static void le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency, uint16_t timeout);
+static void le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param);
+static void le_data_len_updated(struct bt_conn *conn, struct bt_conn_le_data_len_info *info);
+static void att_mtu_updated(struct bt_conn *conn, uint16_t tx, uint16_t rx);
+
+/*******************************************************************************
+ ***************************  LOCAL VARIABLES   ********************************
+ ******************************************************************************/
+
+static const struct bt_le_conn_param fast_params = {
+    .interval_min = CONN_INTERVAL(CONN_POLICY_FAST_INTERVAL_MIN_MS),
+    .interval_max = CONN_INTERVAL(CONN_POLICY_FAST_INTERVAL_MAX_MS),
+    .latency = 0,
+    .timeout = CONN_TIMEOUT(CONN_POLICY_FAST_TIMEOUT_MS),
+};
+
+static const struct bt_le_conn_param idle_params = {
+    .interval_min = CONN_INTERVAL(CONN_POLICY_IDLE_INTERVAL_MIN_MS),
+    .interval_max = CONN_INTERVAL(CONN_POLICY_IDLE_INTERVAL_MAX_MS),
+    .latency = CONN_POLICY_IDLE_LATENCY,
+    .timeout = CONN_TIMEOUT(CONN_POLICY_IDLE_TIMEOUT_MS),
+};
+
+static struct bt_conn_cb connection_callbacks = {
+    .connected = connected,
+    .disconnected = disconnected,
+    .le_param_updated = le_param_updated,
+    .le_phy_updated = le_phy_updated,
+    .le_data_len_updated = le_data_len_updated,
+};
+
+static struct bt_gatt_cb gatt_callbacks = {
+    .att_mtu_updated = att_mtu_updated,
+};
+
+static policy_session_t sessions[RNRFC_MAX_BLE_SESSIONS];
+static atomic_t switch_count = ATOMIC_INIT(0);
+
+/*******************************************************************************
+ **************************   GLOBAL FUNCTIONS   *******************************
+ ******************************************************************************/
+
+void rnrfc_conn_policy_init(void)
+{
+    for (int i = 0; i < RNRFC_MAX_BLE_SESSIONS; i++)
+    {
+        k_work_init_delayable(&sessions[i].idle_work, idle_work_handler);
+        k_work_init(&sessions[i].link_work, link_work_handler);
+        k_work_init_delayable(&sessions[i].rssi_work, rssi_work_handler);
+        atomic_set(&sessions[i].rssi, RSSI_NOT_AVAILABLE);
+    }
+    bt_conn_cb_register(&connection_callbacks);
+    bt_gatt_cb_register(&gatt_callbacks);
+}
+
+void rnrfc_conn_policy_request_throughput(int session)
+{
+    if (session < 0 || session >= RNRFC_MAX_BLE_SESSIONS)
+        return;
+    rnrfc_conn_policy_activity(session);
+    if (sessions[session].params.mode != RNRFC_CONN_MODE_FAST)
+    {
+        request_mode(session, RNRFC_CONN_MODE_FAST);
+        k_work_reschedule(&sessions[session].idle_work, K_MSEC(CONN_POLICY_IDLE_DELAY_MS));
+    }
+}
+
+void rnrfc_conn_policy_activity(int session)
+{
+    if (session < 0 || session >= RNRFC_MAX_BLE_SESSIONS)
+        return;
+    atomic_set(&sessions[session].last_activity, (atomic_val_t) k_uptime_get_32());
+}
+
+int rnrfc_conn_policy_get_params(int session, rnrfc_conn_params_t *params)
+{
+    if (session < 0 || session >= RNRFC_MAX_BLE_SESSIONS)
+        return -1;
+    *params = sessions[session].params;
+    return 0;
+}
+
+int rnrfc_conn_policy_read_rssi(int session, int8_t *rssi)
+{
+    if (session < 0 || session >= RNRFC_MAX_BLE_SESSIONS)
+        return -EINVAL;
+    atomic_val_t sample = atomic_get(&sessions[session].rssi);
+    if (sample == RSSI_NOT_AVAILABLE)
+        return -ENODATA;
+    *rssi = (int8_t) sample;
+    return 0;
+}
+
+void rnrfc_conn_policy_print(void)
+{
+    for (int i = 0; i < RNRFC_MAX_BLE_SESSIONS; i++)
+    {
+        const rnrfc_conn_params_t *params = &sessions[i].params;
+        if (params->interval == 0)
+        {
+            i3_log(LOG_MASK_ALWAYS, "Session %d: not connected", i);
+            continue;
+        }
+        i3_log(LOG_MASK_ALWAYS, "Session %d: interval %u.%02u ms, latency %u, timeout %u ms, %s parameters", i,
+            (params->interval * 125) / 100, (params->interval * 125) % 100, params->latency, params->timeout * 10,
+            (params->mode == RNRFC_CONN_MODE_FAST) ? "fast":((params->mode == RNRFC_CONN_MODE_IDLE) ? "idle":"default"));
+        i3_log(LOG_MASK_ALWAYS, "  PHY: TX %s, RX %s", phy_to_string(params->tx_phy), phy_to_string(params->rx_phy));
+        i3_log(LOG_MASK_ALWAYS, "  Data length: TX %u bytes / %u us, RX %u bytes / %u us, ATT MTU %u bytes",
+            params->tx_max_len, params->tx_max_time, params->rx_max_len, params->rx_max_time, params->mtu);
+    }
+    i3_log(LOG_MASK_ALWAYS, "Connection parameter switches: %u", rnrfc_conn_policy_get_switch_count());
+}
+
+uint32_t rnrfc_conn_policy_get_switch_count(void)
+{
+    return (uint32_t) atomic_get(&switch_count);
+}
+
+/*******************************************************************************
+ ***************************   LOCAL FUNCTIONS    ******************************
+ ******************************************************************************/
+
+static void find_conn(struct bt_conn *conn, void *data)
+{
+    find_conn_t *find = (find_conn_t *) data;
+    if (bt_conn_index(conn) == find->index)
+        find->conn = conn;
+}
+
+static void request_mode(int session, rnrfc_conn_mode_t mode)
+{
+    find_conn_t find = { .index = session, .conn = NULL };
+    bt_conn_foreach(BT_CONN_TYPE_LE, find_conn, &find);
+    if (find.conn == NULL)
+        return;
+    int rval = bt_conn_le_param_update(find.conn, (mode == RNRFC_CONN_MODE_FAST) ? &fast_params:&idle_params);
+    if (rval && rval != -EALREADY)
+    {
+        I3_LOG(LOG_MASK_WARN, "Connection parameter update failed, error %d", rval);
+        return;
+    }
+    if (sessions[session].params.mode != RNRFC_CONN_MODE_DEFAULT)
+        atomic_inc(&switch_count);
+    sessions[session].params.mode = mode;
+    I3_LOG(LOG_MASK_BLE, "Session %d requesting %s connection parameters", session, (mode == RNRFC_CONN_MODE_FAST) ? "fast":"idle");
+}
+
+static void idle_work_handler(struct k_work *item)
+{
+    struct k_work_delayable *dwork = k_work_delayable_from_work(item);
+    policy_session_t *policy = CONTAINER_OF(dwork, policy_session_t, idle_work);
+    int session = (int) (policy - sessions);
+    uint32_t idle_ms = k_uptime_get_32() - (uint32_t) atomic_get(&policy->last_activity);
+    if (idle_ms < CONN_POLICY_IDLE_DELAY_MS)
+    {
+        // There has been traffic since this was scheduled, so check again later
+        k_work_reschedule(dwork, K_MSEC(CONN_POLICY_IDLE_DELAY_MS - idle_ms));
+        return;
+    }
+    if (policy->params.mode != RNRFC_CONN_MODE_IDLE)
+        request_mode(session, RNRFC_CONN_MODE_IDLE);
+}
+
+static void link_work_handler(struct k_work *item)
+{
+    policy_session_t *policy = CONTAINER_OF(item, policy_session_t, link_work);
+    int session = (int) (policy - sessions);
+    find_conn_t find = { .index = session, .conn = NULL };
+    bt_conn_foreach(BT_CONN_TYPE_LE, find_conn, &find);
+    if (find.conn == NULL)
+        return;
+    int rval = 0;
+#if CONN_POLICY_REQUEST_2M_PHY
+    // If the client doesn't support 2M, the procedure completes on 1M and the link carries on as before
+    rval = bt_conn_le_phy_update(find.conn, BT_CONN_LE_PHY_PARAM_2M);
+    if (rval)
+        I3_LOG(LOG_MASK_WARN, "Session %d 2M PHY request failed, error %d, staying on 1M", session, rval);
+#endif // CONN_POLICY_REQUEST_2M_PHY
+#if CONN_POLICY_REQUEST_MAX_DATA_LEN
+    rval = bt_conn_le_data_len_update(find.conn, BT_LE_DATA_LEN_PARAM_MAX);
+    if (rval)
+    {
+        // Some controllers only accept times valid for the uncoded PHYs
+        I3_LOG(LOG_MASK_WARN, "Session %d maximum data length request failed, error %d, retrying", session, rval);
+        rval = bt_conn_le_data_len_update(find.conn, BT_LE_DATA_LEN_PARAM(BT_GAP_DATA_LEN_MAX, DATA_TIME_1M_MAX));
+        if (rval)
+            I3_LOG(LOG_MASK_WARN, "Session %d data length request failed, error %d, using default", session, rval);
+    }
+#endif // CONN_POLICY_REQUEST_MAX_DATA_LEN
+    (void) rval;
+}
+
+static void rssi_work_handler(struct k_work *item)
+{
+    struct k_work_delayable *dwork = k_work_delayable_from_work(item);
+    policy_session_t *policy = CONTAINER_OF(dwork, policy_session_t, rssi_work);
+    find_conn_t find = { .index = (int) (policy - sessions), .conn = NULL };
+    bt_conn_foreach(BT_CONN_TYPE_LE, find_conn, &find);
+    if (find.conn == NULL)
+    {
+        atomic_set(&policy->rssi, RSSI_NOT_AVAILABLE);
+        return;
+    }
+    int8_t rssi;
+    atomic_set(&policy->rssi, (read_rssi(find.conn, &rssi) == 0) ? rssi:RSSI_NOT_AVAILABLE);
+    k_work_reschedule(dwork, K_MSEC(CONN_POLICY_RSSI_SAMPLE_MS));
+}
+
+// Waits for the controller to answer, so this is only called from the system work queue
+static int read_rssi(struct bt_conn *conn, int8_t *rssi)
+{
+    uint16_t handle;
+    int rval = bt_hci_get_conn_handle(conn, &handle);
+    if (rval)
+        return rval;
+
+    struct net_buf *buf = bt_hci_cmd_create(BT_HCI_OP_READ_RSSI, sizeof(struct bt_hci_cp_read_rssi));
+    if (buf == NULL)
+        return -ENOBUFS;
+    struct bt_hci_cp_read_rssi *cp = net_buf_add(buf, sizeof(*cp));
+    cp->handle = sys_cpu_to_le16(handle);
+    struct net_buf *rsp = NULL;
+    rval = bt_hci_cmd_send_sync(BT_HCI_OP_READ_RSSI, buf, &rsp);
+    if (rval)
+        return rval;
+    const struct bt_hci_rp_read_rssi *rp = (const struct bt_hci_rp_read_rssi *) rsp->data;
+    // The controller can still refuse the command, in which case the RSSI is meaningless
+    if (rp->status != BT_HCI_ERR_SUCCESS)
+        rval = -EIO;
+    else
+        *rssi = rp->rssi;
+    net_buf_unref(rsp);
+    return rval;
+}
+
+static const char *phy_to_string(uint8_t phy)
+{
+    switch (phy)
+    {
+        case BT_GAP_LE_PHY_1M:
+            return "1M";
+        case BT_GAP_LE_PHY_2M:
+            return "2M";
+        case BT_GAP_LE_PHY_CODED:
+            return "Coded";
+        default:
+            return "unknown";
+    }
+}
+
+static void connected(struct bt_conn *conn, uint8_t err)
+{
+    if (err)
+        return;
+    int session = bt_conn_index(conn);
+    if (session >= RNRFC_MAX_BLE_SESSIONS)
+        return;
+    struct bt_conn_info info;
+    memset(&sessions[session].params, 0, sizeof(sessions[session].params));
+    if (bt_conn_get_info(conn, &info) == 0)
+    {
+        sessions[session].params.interval = info.le.interval;
+        sessions[session].params.latency = info.le.latency;
+        sessions[session].params.timeout = info.le.timeout;
+        sessions[session].params.tx_phy = info.le.phy->tx_phy;
+        sessions[session].params.rx_phy = info.le.phy->rx_phy;
+        sessions[session].params.tx_max_len = info.le.data_len->tx_max_len;
+        sessions[session].params.tx_max_time = info.le.data_len->tx_max_time;
+        sessions[session].params.rx_max_len = info.le.data_len->rx_max_len;
+        sessions[session].params.rx_max_time = info.le.data_len->rx_max_time;
+    }
+    sessions[session].params.mtu = bt_gatt_get_mtu(conn);
+    k_work_submit(&sessions[session].link_work);
+    atomic_set(&sessions[session].rssi, RSSI_NOT_AVAILABLE);
+    k_work_reschedule(&sessions[session].rssi_work, K_NO_WAIT);
+    // Start from the central's choice, and relax it once discovery is done and the link goes quiet
+    rnrfc_conn_policy_activity(session);
+    k_work_reschedule(&sessions[session].idle_work, K_MSEC(CONN_POLICY_IDLE_DELAY_MS));
+}
+
+static void disconnected(struct bt_conn *conn, uint8_t reason)
+{
+    int session = bt_conn_index(conn);
+    if (session >= RNRFC_MAX_BLE_SESSIONS)
+        return;
+    k_work_cancel_delayable(&sessions[session].idle_work);
+    k_work_cancel_delayable(&sessions[session].rssi_work);
+    atomic_set(&sessions[session].rssi, RSSI_NOT_AVAILABLE);
+    memset(&sessions[session].params, 0, sizeof(sessions[session].params));
+}
+
+static void le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency, uint16_t timeout)
+{
+    int session = bt_conn_index(conn);
+    if (session >= RNRFC_MAX_BLE_SESSIONS)
+        return;
+    sessions[session].params.interval = interval;
+    sessions[session].params.latency = latency;
+    sessions[session].params.timeout = timeout;
+    I3_LOG(LOG_MASK_BLE, "Session %d connection parameters: interval %u, latency %u, timeout %u", session, interval, latency, timeout);
+}
+
+static void le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param)
+{
+    int session = bt_conn_index(conn);
+    if (session >= RNRFC_MAX_BLE_SESSIONS)
+        return;
+    sessions[session].params.tx_phy = param->tx_phy;
+    sessions[session].params.rx_phy = param->rx_phy;
+    I3_LOG(LOG_MASK_BLE, "Session %d PHY: TX %s, RX %s", session, phy_to_string(param->tx_phy), phy_to_string(param->rx_phy));
+}
+
+static void le_data_len_updated(struct bt_conn *conn, struct bt_conn_le_data_len_info *info)
+{
+    int session = bt_conn_index(conn);
+    if (session >= RNRFC_MAX_BLE_SESSIONS)
+        return;
+    sessions[session].params.tx_max_len = info->tx_max_len;
+    sessions[session].params.tx_max_time = info->tx_max_time;
+    sessions[session].params.rx_max_len = info->rx_max_len;
+    sessions[session].params.rx_max_time = info->rx_max_time;
+    I3_LOG(LOG_MASK_BLE, "Session %d data length: TX %u bytes, RX %u bytes", session, info->tx_max_len, info->rx_max_len);
+}
+
+static void att_mtu_updated(struct bt_conn *conn, uint16_t tx, uint16_t rx)
+{
+    int session = bt_conn_index(conn);
+    if (session >= RNRFC_MAX_BLE_SESSIONS)
+        return;
+    sessions[session].params.mtu = bt_gatt_get_mtu(conn);
+    I3_LOG(LOG_MASK_BLE, "Session %d ATT MTU: TX %u bytes, RX %u bytes", session, tx, rx);
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2023-2024 i3 Product Development
+ * 
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file      reach_conn_policy.h
+ * @brief     BLE connection parameter policy for the nRF Connect Reach integration
+ * 
+ * @copyright (c) Copyright 2024 i3 Product Development. All Rights Reserved.
+ */
+
+#ifndef _REACH_CONN_POLICY_H_
+#define _REACH_CONN_POLICY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef _DOXYGEN_
+    /** @brief The minimum connection interval requested while a file transfer is in progress. */
+    #define CONN_POLICY_FAST_INTERVAL_MIN_MS 15
+
+    /** @brief The maximum connection interval requested while a file transfer is in progress. */
+    #define CONN_POLICY_FAST_INTERVAL_MAX_MS 30
+
+    /** @brief The supervision timeout requested while a file transfer is in progress. */
+    #define CONN_POLICY_FAST_TIMEOUT_MS 4000
+
+    /** @brief The minimum connection interval requested once the link is idle. */
+    #define CONN_POLICY_IDLE_INTERVAL_MIN_MS 100
+
+    /** @brief The maximum connection interval requested once the link is idle. */
+    #define CONN_POLICY_IDLE_INTERVAL_MAX_MS 200
+
+    /** @brief The peripheral latency requested once the link is idle, as a number of connection events which may be skipped. */
+    #define CONN_POLICY_IDLE_LATENCY 4
+
+    /** @brief The supervision timeout requested once the link is idle.
+     * @note This must be larger than (1 + CONN_POLICY_IDLE_LATENCY) * CONN_POLICY_IDLE_INTERVAL_MAX_MS * 2
+     */
+    #define CONN_POLICY_IDLE_TIMEOUT_MS 6000
+
+    /** @brief How long a link must go without any Reach traffic before the idle parameters are requested. */
+    #define CONN_POLICY_IDLE_DELAY_MS 5000
+
+    /** @brief How often the RSSI of each connection is read from the controller. */
+    #define CONN_POLICY_RSSI_SAMPLE_MS 1000
+
+    /** @brief If 1, the LE 2M PHY is requested when a client connects.  The link stays on 1M if the client does not support it. */
+    #define CONN_POLICY_REQUEST_2M_PHY 1
+
+    /** @brief If 1, the maximum data length (251 bytes) is requested when a client connects,
+     * so that a full Reach packet fits in a single link layer PDU.
+     */
+    #define CONN_POLICY_REQUEST_MAX_DATA_LEN 1
+#endif
+
+// To change any of the defines described above, define them here
+
+/**
+* @brief The parameter sets which the policy can request
+*/
+typedef enum {
+    /** @brief No request has been made, the central's choice is in use */
+    RNRFC_CONN_MODE_DEFAULT,
+    /** @brief A short interval with no latency, for file transfers */
+    RNRFC_CONN_MODE_FAST,
+    /** @brief A long interval with latency, for an idle link */
+    RNRFC_CONN_MODE_IDLE,
+} rnrfc_conn_mode_t;
+
+/**
+* @brief The state of a single connection, as seen by the policy
+*/
+typedef struct {
+    /** @brief The most recently requested parameter set */
+    rnrfc_conn_mode_t mode;
+    /** @brief The connection interval in use, in units of 1.25 ms */
+    uint16_t interval;
+    /** @brief The peripheral latency in use, in connection events */
+    uint16_t latency;
+    /** @brief The supervision timeout in use, in units of 10 ms */
+    uint16_t timeout;
+    /** @brief The transmit PHY in use, as a BT_GAP_LE_PHY_* value */
+    uint8_t tx_phy;
+    /** @brief The receive PHY in use, as a BT_GAP_LE_PHY_* value */
+    uint8_t rx_phy;
+    /** @brief The maximum link layer payload which can be sent, in bytes */
+    uint16_t tx_max_len;
+    /** @brief The maximum time taken to send a link layer PDU, in microseconds */
+    uint16_t tx_max_time;
+    /** @brief The maximum link layer payload which can be received, in bytes */
+    uint16_t rx_max_len;
+    /** @brief The maximum time taken to receive a link layer PDU, in microseconds */
+    uint16_t rx_max_time;
+    /** @brief The ATT MTU, in bytes */
+    uint16_t mtu;
+} rnrfc_conn_params_t;
+
+#ifdef CONFIG_BT
+
+/**
+* @brief Initializes the connection parameter policy
+* @note This must be called after bt_enable()
+*/
+void rnrfc_conn_policy_init(void);
+
+/**
+* @brief Requests the fast connection parameters for a session, such as when a file transfer starts
+* @note The fast parameters remain in use until the session has been idle for CONN_POLICY_IDLE_DELAY_MS
+* @param session The session index, from rnrfc_get_active_session()
+*/
+void rnrfc_conn_policy_request_throughput(int session);
+
+/**
+* @brief Records Reach traffic on a session, which postpones the switch to the idle parameters
+* @note This only updates a timestamp, so it is cheap enough to call for every packet
+* @param session The session index
+*/
+void rnrfc_conn_policy_activity(int session);
+
+/**
+* @brief Gets the connection parameters currently in use by a session
+* @param session The session index
+* @param params Where to store the parameters
+* @return 0 on success, or -1 if the session index is invalid
+*/
+int rnrfc_conn_policy_get_params(int session, rnrfc_conn_params_t *params);
+
+/**
+* @brief Gets the signal strength of a session's connection
+* @note This returns the last value sampled from the controller, every CONN_POLICY_RSSI_SAMPLE_MS, so it doesn't wait
+* @param session The session index
+* @param rssi Where to store the RSSI, in dBm
+* @return 0 on success, or a negative error code if the session isn't connected or the last read failed
+*/
+int rnrfc_conn_policy_read_rssi(int session, int8_t *rssi);
+
+/**
+* @brief Prints the state of every connection using i3_log
+*/
+void rnrfc_conn_policy_print(void);
+
+/**
+* @brief Gets the number of times the policy has switched between the fast and idle parameters, across all sessions
+* @return The number of switches
+*/
+uint32_t rnrfc_conn_policy_get_switch_count(void);
+
+#else
+
+#include "i3_log.h"
+
+// Without BLE, such as on native_sim, no session has connection parameters
+static inline void rnrfc_conn_policy_init(void) {}
+static inline void rnrfc_conn_policy_request_throughput(int session) { (void) session; }
+static inline void rnrfc_conn_policy_activity(int session) { (void) session; }
+static inline int rnrfc_conn_policy_get_params(int session, rnrfc_conn_params_t *params) { (void) session; (void) params; return -1; }
+static inline int rnrfc_conn_policy_read_rssi(int session, int8_t *rssi) { (void) session; (void) rssi; return -1; }
+static inline void rnrfc_conn_policy_print(void) { i3_log(LOG_MASK_ALWAYS, "No BLE connections, BLE is disabled"); }
+static inline uint32_t rnrfc_conn_policy_get_switch_count(void) { return 0; }
+
+#endif // CONFIG_BT
+
+#endif // _REACH_CONN_POLICY_H_
@@ -30,12 +30,14 @@
  */
 
 #include "reach_nrf_connect.h"
+#include "reach_transport.h"
+#ifdef CONFIG_REACH_BENCHMARK
+#include "reach_benchmark.h"
+#endif // CONFIG_REACH_BENCHMARK
 
 #include <string.h>
 
 #include <zephyr/kernel.h>
-#include <zephyr/bluetooth/gatt.h>
-#include <zephyr/bluetooth/hci.h>
 
 #include "reach-server.h"
 #include "cr_stack.h"
@@ -56,26 +58,17 @@
 #define BLE_TASK_PRIORITY 1
 #endif // BLE_TASK_PRIORITY
 
-#ifndef BLE_ADV_INTERVAL_MS
-#define BLE_ADV_INTERVAL_MS 500
-#elif (BLE_ADV_INTERVAL_MS < 2)
-#error "BLE advertising interval must be at least 2ms"
-#endif // BLE_ADV_INTERVAL_MS
-
-// Need slightly more complicated logic for setting the advertising spacing
-#ifndef BLE_ADV_INTERVAL_SPACING_MS
-#if (BLE_ADV_INTERVAL_MS > 200)
-#define BLE_ADV_INTERVAL_SPACING_MS 100
-#elif (BLE_ADV_INTERVAL_MS > 20)
-#define BLE_ADV_INTERVAL_SPACING_MS 10
-#else
-#define BLE_ADV_INTERVAL_SPACING_MS 1
-#endif // (BLE_ADV_INTERVAL_MS > 10)
-#else
-#if (BLE_ADV_INTERVAL_MS < BLE_ADV_INTERVAL_SPACING_MS)
-#error "BLE Advertising interval spacing cannot result in negative advertising intervals"
-#endif // (BLE_ADV_INTERVAL_MS < BLE_ADV_INTERVAL_SPACING_MS)
-#endif // BLE_ADV_INTERVAL_SPACING_MS
+#ifndef BLE_TASK_EVENT_DRIVEN
+#define BLE_TASK_EVENT_DRIVEN 1
+#endif // BLE_TASK_EVENT_DRIVEN
+
+#ifndef BLE_TASK_NOTIFICATION_INTERVAL_MS
+#define BLE_TASK_NOTIFICATION_INTERVAL_MS 20
+#endif // BLE_TASK_NOTIFICATION_INTERVAL_MS
+
+#ifndef BLE_TASK_MAX_PASSES_PER_WAKEUP
+#define BLE_TASK_MAX_PASSES_PER_WAKEUP 16
+#endif // BLE_TASK_MAX_PASSES_PER_WAKEUP
 
 #ifndef BLE_TASK_ADVERTISING_PROCESSING_INTERVAL_MS
 #define BLE_TASK_ADVERTISING_PROCESSING_INTERVAL_MS 100
@@ -85,72 +78,60 @@
 #define BLE_TASK_CONNECTED_PROCESSING_INTERVAL_MS 5
 #endif // BLE_TASK_CONNECTED_PROCESSING_INTERVAL_MS
 
-#ifndef BLE_WRITE_CIRCULAR_BUFFER_SIZE
-#define BLE_WRITE_CIRCULAR_BUFFER_SIZE 1
-#endif // BLE_WRITE_CIRCULAR_BUFFER_SIZE
-
-#ifndef REACH_SERVICE_UUID
-#define REACH_SERVICE_UUID BT_UUID_128_ENCODE(0xedd59269, 0x79b3, 0x4ec2, 0xa6a2, 0x89bfb640f930)
-#endif // REACH_UUID
+#ifndef BLE_CONN_EVENT_FALLBACK_MS
+#define BLE_CONN_EVENT_FALLBACK_MS 100
+#endif // BLE_CONN_EVENT_FALLBACK_MS
 
-#ifndef REACH_CHARACTERISTIC_UUID
-#define REACH_CHARACTERISTIC_UUID BT_UUID_128_ENCODE(0xd42d1039, 0x1d11, 0x4f10, 0xbae6, 0x5f3b44cf6439)
-#endif // REACH_CHARACTERISTIC_UUID
+#ifndef ACK_RATE_STORAGE_STALL_MS
+#define ACK_RATE_STORAGE_STALL_MS 20
+#endif // ACK_RATE_STORAGE_STALL_MS
 
-// Defines only needed internally
-#define ADVERTISING_INTERVAL(ms) (((ms) * 8) / 5)
-#define BLE_ADV_INTERVAL_MIN ADVERTISING_INTERVAL(BLE_ADV_INTERVAL_MS - BLE_ADV_INTERVAL_SPACING_MS)
-#define BLE_ADV_INTERVAL_MAX ADVERTISING_INTERVAL(BLE_ADV_INTERVAL_MS + BLE_ADV_INTERVAL_SPACING_MS)
+#ifndef FILE_TRANSFER_CLAIM_TIMEOUT_MS
+#define FILE_TRANSFER_CLAIM_TIMEOUT_MS 5000
+#endif // FILE_TRANSFER_CLAIM_TIMEOUT_MS
 
-#define BT_LE_AD_LOW_POWER BT_LE_ADV_PARAM(BT_LE_ADV_OPT_CONNECTABLE, BLE_ADV_INTERVAL_MIN, BLE_ADV_INTERVAL_MAX, NULL)
-
-#if (APP_ADVERTISED_NAME_LENGTH > 30)
-#error "nRF Connect BLE advertised name length cannot be greater than 30 characters"
-#endif
-
-#define REACH_SERVICE_UUID_DECLARE BT_UUID_DECLARE_128(REACH_SERVICE_UUID)
-#define REACH_CHARACTERISTIC_UUID_DECLARE BT_UUID_DECLARE_128(REACH_CHARACTERISTIC_UUID)
+#ifndef THROUGHPUT_WINDOW_MS
+#define THROUGHPUT_WINDOW_MS 1000
+#endif // THROUGHPUT_WINDOW_MS
 
 /*******************************************************************************
  ****************************   LOCAL  TYPES   *********************************
  ******************************************************************************/
 
-#if (BLE_WRITE_CIRCULAR_BUFFER_SIZE > 1)
-// Structures for basic circular buffers
+// The adaptive acknowledgement rate for one direction of file transfer
 typedef struct {
-    uint8_t buf[CR_CODED_BUFFER_SIZE];
-    size_t length;
-} coded_buffer_t;
-
+    uint32_t rate; // The rate offered for the last transfer, or 0 before the first one
+    // Counters when the last transfer started, which show how it went
+    atomic_val_t drops;
+    atomic_val_t waits;
+    atomic_val_t storage_stalls;
+} ack_rate_state_t;
+
+// The byte counters at the start of the current throughput window, and the rates measured over the last one
 typedef struct {
-    coded_buffer_t buffers[BLE_WRITE_CIRCULAR_BUFFER_SIZE];
-    size_t head;
-    size_t tail;
-} circ_buf_t;
-#endif
+    uint32_t start_ms;
+    atomic_val_t start_received;
+    atomic_val_t start_sent;
+    uint32_t received_per_second;
+    uint32_t sent_per_second;
+} throughput_state_t;
 
 /*******************************************************************************
  *********************   LOCAL FUNCTION PROTOTYPES   ***************************
  ******************************************************************************/
 
-// Main BLE task
+// Main BLE task, which runs the Reach stack for every transport
 static void ble_task(void *arg, void *param2, void *param3);
-
-// Callbacks for BLE events
-static void connected(struct bt_conn *conn, uint8_t err);
-static void connect_work_handler(struct k_work *item);
-static void disconnect_work_handler(struct k_work *item);
-static void disconnected(struct bt_conn *conn, uint8_t reason);
-static ssize_t read_reach(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset);
-static ssize_t write_reach(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf, uint16_t len, uint16_t offset, uint8_t flags);
-static void subscribe_reach(const struct bt_gatt_attr *attr, uint16_t value);
-
-#if (BLE_WRITE_CIRCULAR_BUFFER_SIZE > 1)
-// Functions for basic circular buffers
-static void cb_add(circ_buf_t *cb, coded_buffer_t *c);
-static bool cb_remove(circ_buf_t *cb, coded_buffer_t **c);
-static uint32_t cb_get_size(circ_buf_t *cb);
-#endif
+static void ble_task_wait(void);
+static bool ble_task_has_clients(void);
+static void ble_task_process(void);
+static void ble_task_run_stack(int session);
+#ifdef CONFIG_REACH_BENCHMARK
+static void ble_task_run_benchmark(void);
+#endif // CONFIG_REACH_BENCHMARK
+#if ACK_RATE_ADAPTIVE
+static uint32_t ack_rate_adapt(int session, bool is_write, uint32_t limit);
+#endif // ACK_RATE_ADAPTIVE
 
 // strnlen is technically a Linux function and is often not found by the compiler.
 size_t strnlen( const char * s,size_t maxlen );
@@ -159,55 +140,50 @@ size_t strnlen( const char * s,size_t maxlen );
  ***************************  LOCAL VARIABLES   ********************************
  ******************************************************************************/
 
-// Advertising data
-char advertised_name[APP_ADVERTISED_NAME_LENGTH];
-static const struct bt_data ad[] = {
-    BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
-    BT_DATA_BYTES(BT_DATA_UUID128_ALL, REACH_SERVICE_UUID),
+// Every transport which can carry Reach messages, in the order their sessions are numbered
+static const rnrfc_transport_t *const transports[] = {
+#ifdef CONFIG_BT
+    &rnrfc_ble_transport,
+#endif // CONFIG_BT
+#ifdef CONFIG_REACH_SERIAL_TRANSPORT
+    &rnrfc_serial_transport,
+#endif // CONFIG_REACH_SERIAL_TRANSPORT
+#ifdef CONFIG_REACH_SOCKET_TRANSPORT
+    &rnrfc_socket_transport,
+#endif // CONFIG_REACH_SOCKET_TRANSPORT
 };
 
-// Scanning data
-static struct bt_data sd[] = {
-    BT_DATA(BT_DATA_NAME_COMPLETE, advertised_name, 0),
-};
-
-// Data for reading/writing the Reach characteristic
-static uint8_t reach_data[244];
-#if (BLE_WRITE_CIRCULAR_BUFFER_SIZE > 1)
-static circ_buf_t ble_write_buffer;
-#else
-static volatile size_t reach_length = 1;
-#endif
-
-// Connection callback structure used by the stack
-static struct bt_conn_cb connection_callbacks = {
-    .connected = connected,
-    .disconnected = disconnected,
-};
-
-// Service definition
-BT_GATT_SERVICE_DEFINE(reach_service,
-    BT_GATT_PRIMARY_SERVICE(REACH_SERVICE_UUID_DECLARE),
-    BT_GATT_CHARACTERISTIC(REACH_CHARACTERISTIC_UUID_DECLARE,
-                           BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE | BT_GATT_CHRC_WRITE_WITHOUT_RESP | BT_GATT_CHRC_NOTIFY,
-                           BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
-                           read_reach, write_reach, reach_data),
-    BT_GATT_CCC(subscribe_reach, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE)
-);
+// The transport and transport session number behind each session, filled in by rnrfc_init()
+static const rnrfc_transport_t *session_transport[RNRFC_MAX_SESSIONS];
+static int session_local[RNRFC_MAX_SESSIONS];
 
 // BLE task data
 K_THREAD_STACK_DEFINE(ble_task_stack_area, BLE_TASK_STACK_SIZE);
 static struct k_thread ble_task_data;
 static k_tid_t ble_task_id;
 
-// Data for connection and disconnection work
-static struct k_work connect_work;
-static struct k_work disconnect_work;
+// The session whose prompt is being processed, or -1 for unsolicited messages such as parameter notifications
+static int active_session = -1;
+// A session which has not finished receiving its response keeps the stack until it has
+static int stack_owner = -1;
+// The session which is transferring a file, or -1, and when it last did
+static int file_transfer_owner = -1;
+static uint32_t file_transfer_used_ms;
 
-// State information
-static bool ble_advertising_started = false;
-static bool device_connected = false;
-static bool device_subscribed = false;
+// Signals the BLE task that there is work to do (new prompts, connection changes, or pending responses)
+static K_SEM_DEFINE(ble_task_sem, 0, 1);
+static volatile bool response_pending = false;
+
+rnrfc_stats_t rnrfc_stats;
+
+#if ACK_RATE_ADAPTIVE
+// Indexed by session and is_write, only accessed from the BLE task
+static ack_rate_state_t ack_rate_state[RNRFC_MAX_SESSIONS][2];
+#endif // ACK_RATE_ADAPTIVE
+
+// Sampled by whoever asks for the rates, which may be the BLE task or the CLI
+static throughput_state_t throughput;
+static struct k_spinlock throughput_lock;
 
 /*******************************************************************************
  **************************   GLOBAL FUNCTIONS   *******************************
@@ -215,18 +191,21 @@ static bool device_subscribed = false;
 
 void rnrfc_init(void)
 {
-    // Initialize the advertised name if it hasn't been set already
-    if (advertised_name[0] == 0)
-    {
-        // Handling to make sure setting the advertised name is successful
-        char temp[APP_ADVERTISED_NAME_LENGTH];
-        strncpy(temp, CONFIG_BT_DEVICE_NAME, sizeof(temp));
-        rnrfc_set_advertised_name(temp);
-    }
     cr_test_sizes();
 
     cr_init();
 
+    int session = 0;
+    for (size_t t = 0; t < ARRAY_SIZE(transports); t++)
+    {
+        for (int i = 0; i < transports[t]->session_count && session < RNRFC_MAX_SESSIONS; i++, session++)
+        {
+            session_transport[session] = transports[t];
+            session_local[session] = i;
+        }
+    }
+    __ASSERT(session == RNRFC_MAX_SESSIONS, "RNRFC_MAX_SESSIONS doesn't match the enabled transports");
+
     ble_task_id = k_thread_create(
         &ble_task_data, ble_task_stack_area,
         K_THREAD_STACK_SIZEOF(ble_task_stack_area),
@@ -236,53 +215,135 @@ void rnrfc_init(void)
         K_FP_REGS,
         K_NO_WAIT);
 
-    int rval = bt_enable(NULL);
-    if (rval)
+    // A transport which fails to start doesn't stop the others from working
+    for (size_t t = 0; t < ARRAY_SIZE(transports); t++)
     {
-        I3_LOG(LOG_MASK_ERROR, "Bluetooth init failed (err %d)", rval);
-        return;
+        int rval = transports[t]->init();
+        if (rval)
+            I3_LOG(LOG_MASK_ERROR, "Reach %s transport failed to start (err %d)", transports[t]->name, rval);
     }
+}
 
-    k_work_init(&connect_work, connect_work_handler);
-    k_work_init(&disconnect_work, disconnect_work_handler);
+void rnrfc_request_processing(void)
+{
+    k_sem_give(&ble_task_sem);
+}
 
-    bt_conn_cb_register(&connection_callbacks);
+const rnrfc_stats_t *rnrfc_get_stats(void)
+{
+    return &rnrfc_stats;
+}
 
-    rval = bt_le_adv_start(BT_LE_AD_LOW_POWER, ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
-    if (rval)
+void rnrfc_reset_stats(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&throughput_lock);
+    memset(&rnrfc_stats, 0, sizeof(rnrfc_stats));
+    memset(&throughput, 0, sizeof(throughput));
+    throughput.start_ms = k_uptime_get_32();
+    k_spin_unlock(&throughput_lock, key);
+}
+
+void rnrfc_get_throughput(uint32_t *received_per_second, uint32_t *sent_per_second)
+{
+    k_spinlock_key_t key = k_spin_lock(&throughput_lock);
+    uint32_t now = k_uptime_get_32();
+    uint32_t elapsed_ms = now - throughput.start_ms;
+    // The counters are only sampled here, so the hot path doesn't pay for the rates
+    if (elapsed_ms >= THROUGHPUT_WINDOW_MS)
     {
-        I3_LOG(LOG_MASK_ERROR, "Bluetooth advertising failed to start (err %d)", rval);
-        return;
+        atomic_val_t received = atomic_get(&rnrfc_stats.bytes_received);
+        atomic_val_t sent = atomic_get(&rnrfc_stats.bytes_sent);
+        throughput.received_per_second = (uint32_t) (((uint64_t) (uint32_t) (received - throughput.start_received) * 1000) / elapsed_ms);
+        throughput.sent_per_second = (uint32_t) (((uint64_t) (uint32_t) (sent - throughput.start_sent) * 1000) / elapsed_ms);
+        throughput.start_ms = now;
+        throughput.start_received = received;
+        throughput.start_sent = sent;
     }
-    ble_advertising_started = true;
+    *received_per_second = throughput.received_per_second;
+    *sent_per_second = throughput.sent_per_second;
+    k_spin_unlock(&throughput_lock, key);
 }
 
-int rnrfc_set_advertised_name(char *name)
+int rnrfc_get_active_session(void)
 {
-    int rval = 0;
-    size_t name_length = strnlen(name, sizeof(advertised_name) + 1);
-    if (name_length > sizeof(advertised_name) || name_length == 0)
-        return -1;
-    memset(advertised_name, 0, sizeof(advertised_name));
-    strncpy(advertised_name, name, sizeof(advertised_name));
-    sd[0].data_len = (uint8_t) name_length;
-    if (ble_advertising_started)
+    return (active_session < 0) ? 0:active_session;
+}
+
+int rnrfc_file_transfer_claim(void)
+{
+    int session = rnrfc_get_active_session();
+    uint32_t now = k_uptime_get_32();
+    if (file_transfer_owner >= 0 && file_transfer_owner != session && now - file_transfer_used_ms < FILE_TRANSFER_CLAIM_TIMEOUT_MS)
     {
-        rval = bt_le_adv_stop();
-        if (rval)
-        {
-            I3_LOG(LOG_MASK_ERROR, "Failed to stop BLE advertising, error %d", rval);
-            rval = -2;
-        }
-        rval = bt_le_adv_start(BT_LE_AD_LOW_POWER, ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
-        if (rval)
-        {
-            I3_LOG(LOG_MASK_ERROR, "Failed to restart BLE advertising, error %d", rval);
-            rval = -3;
-        }
+        I3_LOG(LOG_MASK_FILES, "Session %d can't transfer a file while session %d is", session, file_transfer_owner);
+        return -EBUSY;
     }
-    cr_set_advertised_name(advertised_name, name_length);
-    return rval;
+    file_transfer_owner = session;
+    file_transfer_used_ms = now;
+    return 0;
+}
+
+void rnrfc_file_transfer_release(void)
+{
+    if (file_transfer_owner == rnrfc_get_active_session())
+        file_transfer_owner = -1;
+}
+
+size_t rnrfc_get_max_response_size(int session)
+{
+    if (session < 0 || session >= RNRFC_MAX_SESSIONS)
+        return 0;
+    return session_transport[session]->get_max_response_size(session_local[session]);
+}
+
+void rnrfc_report_storage_busy(uint32_t busy_ms)
+{
+    if (busy_ms > ACK_RATE_STORAGE_STALL_MS)
+        atomic_inc(&rnrfc_stats.storage_stalls);
+}
+
+void __attribute__((weak)) rnrfc_app_handle_session_closed(int session)
+{
+    // Do nothing
+    (void) session;
+    return;
+}
+
+void rnrfc_transport_session_closed(const rnrfc_transport_t *transport, int session)
+{
+    int closed = -1;
+    for (int i = 0; i < RNRFC_MAX_SESSIONS; i++)
+    {
+        if (session_transport[i] == transport && session_local[i] == session)
+            closed = i;
+    }
+    if (closed < 0)
+        return;
+#ifdef CONFIG_REACH_BENCHMARK
+    if (rnrfc_benchmark_get_session() == closed)
+        rnrfc_benchmark_stop();
+#endif // CONFIG_REACH_BENCHMARK
+    if (stack_owner == closed)
+        stack_owner = -1;
+    if (file_transfer_owner == closed)
+        file_transfer_owner = -1;
+#if ACK_RATE_ADAPTIVE
+    // The next client starts again from half of what its link allows
+    memset(ack_rate_state[closed], 0, sizeof(ack_rate_state[closed]));
+#endif // ACK_RATE_ADAPTIVE
+    cr_set_comm_link_connected(ble_task_has_clients());
+    rnrfc_app_handle_session_closed(closed);
+}
+
+int rnrfc_transport_count_connected(void)
+{
+    int count = 0;
+    for (int i = 0; i < RNRFC_MAX_SESSIONS; i++)
+    {
+        if (session_transport[i]->is_connected(session_local[i]))
+            count++;
+    }
+    return count;
 }
 
 int crcb_send_coded_response(const uint8_t *respBuf, size_t respSize)
@@ -293,45 +354,96 @@ int crcb_send_coded_response(const uint8_t *respBuf, size_t respSize)
         return cr_ErrorCodes_NO_ERROR;
     }
     I3_LOG(LOG_MASK_REACH, TEXT_GREEN "%s: send %d bytes.", __FUNCTION__, respSize);
-    if (device_subscribed)
-    {   
-        int rval = bt_gatt_notify(NULL, &reach_service.attrs[2], respBuf, (uint16_t) respSize);
-        if (rval)
-        {
-            LOG_ERROR("Notify failed, error %d", rval);
-            return cr_ErrorCodes_WRITE_FAILED;
-        }
+    // The stack may have more to send (multi-part responses), so make sure it gets another pass
+    response_pending = true;
+    if (respSize > CR_CODED_BUFFER_SIZE)
+    {
+        LOG_ERROR("Response too large to notify, %u bytes", respSize);
+        atomic_inc(&rnrfc_stats.notify_failed);
+        return cr_ErrorCodes_WRITE_FAILED;
     }
-    return 0;
+
+    // Responses only go to the client that asked
+    if (active_session >= 0)
+    {
+        int rval = session_transport[active_session]->send(session_local[active_session], respBuf, respSize, true);
+        if (rval == 0)
+            atomic_add(&rnrfc_stats.bytes_sent, (atomic_val_t) respSize);
+        // The client has gone or isn't listening, which the stack doesn't need to hear about
+        return (rval == RNRFC_TRANSPORT_NOT_SENT) ? cr_ErrorCodes_NO_ERROR:rval;
+    }
+
+    // Anything unsolicited goes to every client
+    int rval = 0;
+    for (int i = 0; i < RNRFC_MAX_SESSIONS; i++)
+    {
+        const rnrfc_transport_t *transport = session_transport[i];
+        if (!transport->is_connected(session_local[i]))
+            continue;
+        int sent = transport->send(session_local[i], respBuf, respSize, false);
+        if (sent == 0)
+            atomic_add(&rnrfc_stats.bytes_sent, (atomic_val_t) respSize);
+        else if (sent != RNRFC_TRANSPORT_NOT_SENT)
+            rval = cr_ErrorCodes_WRITE_FAILED;
+    }
+    return rval;
 }
 
 #ifdef INCLUDE_FILE_SERVICE
 int crcb_file_get_preferred_ack_rate(uint32_t fid, uint32_t requested_rate, bool is_write)
 {
     I3_LOG(LOG_MASK_WARN, "Logging can interfere with file write.");
-    if (is_write)
-#if (BLE_WRITE_CIRCULAR_BUFFER_SIZE > 1)
-        return (requested_rate < (BLE_WRITE_CIRCULAR_BUFFER_SIZE - 1)) ? requested_rate:BLE_WRITE_CIRCULAR_BUFFER_SIZE - 1;
-#else
-        return 1;
-#endif
-    else
+    if (active_session < 0)
         return requested_rate;
+    uint32_t limit = session_transport[active_session]->get_ack_rate(session_local[active_session], requested_rate, is_write);
+#if ACK_RATE_ADAPTIVE
+    uint32_t rate = ack_rate_adapt(active_session, is_write, limit);
+#else
+    uint32_t rate = limit;
+#endif // ACK_RATE_ADAPTIVE
+    atomic_set(is_write ? &rnrfc_stats.ack_rate_write:&rnrfc_stats.ack_rate_read, (atomic_val_t) rate);
+    I3_LOG(LOG_MASK_FILES, "File %s ack rate %u (requested %u, limit %u)", is_write ? "write":"read", rate, requested_rate, limit);
+    return rate;
 }
 #endif // INCLUDE_FILE_SERVICE
 
-void __attribute__((weak)) rnrfc_app_handle_ble_connection(void)
+#ifndef CONFIG_BT
+// Without Bluetooth there is nothing to advertise, but the Reach stack still reports the device name
+int rnrfc_set_advertised_name(char *name)
 {
-    // Do nothing
-    return;
+    size_t name_length = strnlen(name, APP_ADVERTISED_NAME_LENGTH + 1);
+    if (name_length > APP_ADVERTISED_NAME_LENGTH || name_length == 0)
+        return -1;
+    cr_set_advertised_name(name, name_length);
+    return 0;
 }
 
-void __attribute__((weak)) rnrfc_app_handle_ble_disconnection(void)
+void rnrfc_advertise_fast(void)
 {
-    // Do nothing
-    return;
 }
 
+bool rnrfc_session_is_resumed(int session)
+{
+    ARG_UNUSED(session);
+    return false;
+}
+
+void rnrfc_session_set_notifications_off(int session, bool off)
+{
+    ARG_UNUSED(session);
+    ARG_UNUSED(off);
+}
+
+void rnrfc_broadcast_refresh(void)
+{
+}
+
+int rnrfc_get_connection_count(void)
+{
+    return 0;
+}
+#endif // CONFIG_BT
+
 /*******************************************************************************
  ***************************   LOCAL FUNCTIONS    ******************************
  ******************************************************************************/
@@ -341,117 +453,179 @@ static void ble_task(void *arg, void *param2, void *param3)
     I3_LOG(LOG_MASK_BLE, "Starting BLE task");
     while (1)
     {
-        if (!device_connected)
-        {
-            k_msleep(BLE_TASK_ADVERTISING_PROCESSING_INTERVAL_MS);
-        }
-        else
+        ble_task_wait();
+        atomic_inc(&rnrfc_stats.task_wakeups);
+        for (size_t t = 0; t < ARRAY_SIZE(transports); t++)
         {
-#if (BLE_WRITE_CIRCULAR_BUFFER_SIZE > 1)
-            // Handle any incoming data from the circular buffer
-            if (cb_get_size(&ble_write_buffer))
-            {
-                I3_LOG(LOG_MASK_BLE, "Process buffer");
-                coded_buffer_t *temp;
-                if (cb_remove(&ble_write_buffer, &temp))
-                    cr_store_coded_prompt(temp->buf, temp->length);
-                else
-                    break;
-            }
-#endif
-            // Handle any outgoing data
-            cr_process(k_uptime_get_32());
-            k_msleep(BLE_TASK_CONNECTED_PROCESSING_INTERVAL_MS);
+            if (transports[t]->poll != NULL)
+                transports[t]->poll();
         }
+        if (ble_task_has_clients())
+            ble_task_process();
     }
 }
 
-static void connected(struct bt_conn *conn, uint8_t err)
+static void ble_task_wait(void)
 {
-    k_work_submit(&connect_work);
+    bool any_connected = ble_task_has_clients();
+#if BLE_TASK_EVENT_DRIVEN
+    // Sleep until signalled.  The timeout only exists to service parameter notification deadlines while connected.
+    uint32_t interval_ms = BLE_TASK_NOTIFICATION_INTERVAL_MS;
+#ifdef CONFIG_REACH_CONN_EVENT_SYNC
+    // The radio wakes the task before each connection event, so the timer only has to cover events skipped with peripheral latency
+    if (rnrfc_get_connection_count() > 0)
+        interval_ms = BLE_CONN_EVENT_FALLBACK_MS;
+#endif // CONFIG_REACH_CONN_EVENT_SYNC
+    int rval = k_sem_take(&ble_task_sem, any_connected ? K_MSEC(interval_ms):K_FOREVER);
+    if (rval != 0)
+        atomic_inc(&rnrfc_stats.task_timer_wakeups);
+#else
+    k_msleep(any_connected ? BLE_TASK_CONNECTED_PROCESSING_INTERVAL_MS:BLE_TASK_ADVERTISING_PROCESSING_INTERVAL_MS);
+    atomic_inc(&rnrfc_stats.task_timer_wakeups);
+#endif // BLE_TASK_EVENT_DRIVEN
 }
 
-static void connect_work_handler(struct k_work *item)
+static bool ble_task_has_clients(void)
 {
-    I3_LOG(LOG_MASK_BLE, "BLE connected");
-    rnrfc_app_handle_ble_connection();
-    cr_set_comm_link_connected(true);
-    device_connected = true;
-
+    for (size_t t = 0; t < ARRAY_SIZE(transports); t++)
+    {
+        if (transports[t]->is_active())
+            return true;
+    }
+    return false;
 }
 
-static void disconnected(struct bt_conn *conn, uint8_t reason)
+static void ble_task_process(void)
 {
-    k_work_submit(&disconnect_work);
-}
+    // Let a session finish its response before anyone else gets a turn
+    if (stack_owner >= 0)
+        ble_task_run_stack(stack_owner);
 
-#if (BLE_WRITE_CIRCULAR_BUFFER_SIZE > 1)
-static void cb_add(circ_buf_t *cb, coded_buffer_t *c)
-{
-    size_t next_head = (cb->head + 1) % BLE_WRITE_CIRCULAR_BUFFER_SIZE;
-    cb->buffers[cb->head] = *c;
-    cb->head = next_head;
-    if (cb->head == cb->tail)
+    // Handle all incoming data, taking one prompt from each session in turn and letting each prompt finish before storing the next
+    bool prompt_found = true;
+    while (prompt_found && stack_owner < 0)
     {
-        cb->tail = (cb->tail + 1) % BLE_WRITE_CIRCULAR_BUFFER_SIZE;
+        prompt_found = false;
+        for (int i = 0; i < RNRFC_MAX_SESSIONS && stack_owner < 0; i++)
+        {
+            const rnrfc_transport_t *transport = session_transport[i];
+            rnrfc_prompt_t prompt;
+            if (!transport->receive(session_local[i], &prompt))
+                continue;
+            prompt_found = true;
+            uint32_t latency_us = k_cyc_to_us_floor32(k_cycle_get_32() - prompt.timestamp);
+            atomic_add(&rnrfc_stats.prompt_latency_total_us, (atomic_val_t) latency_us);
+            if (latency_us > (uint32_t) atomic_get(&rnrfc_stats.prompt_latency_max_us))
+                atomic_set(&rnrfc_stats.prompt_latency_max_us, (atomic_val_t) latency_us);
+            atomic_inc(&rnrfc_stats.prompts_processed);
+            atomic_add(&rnrfc_stats.bytes_received, (atomic_val_t) prompt.length);
+#ifdef CONFIG_REACH_BENCHMARK
+            // Benchmark frames take the same path as prompts up to here, but never reach the stack
+            if (rnrfc_benchmark_handle_prompt(i, prompt.buf, prompt.length))
+            {
+                if (transport->release != NULL)
+                    transport->release(session_local[i]);
+                continue;
+            }
+#endif // CONFIG_REACH_BENCHMARK
+            cr_store_coded_prompt((uint8_t *) prompt.buf, prompt.length);
+            // The stack has its own copy now, so the transport can have its buffer back
+            if (transport->release != NULL)
+                transport->release(session_local[i]);
+            ble_task_run_stack(i);
+        }
     }
-}
 
-static bool cb_remove(circ_buf_t *cb, coded_buffer_t **c)
-{
-    if (cb->head != cb->tail) {
-        *c = &cb->buffers[cb->tail];
-        cb->tail = (cb->tail + 1) % BLE_WRITE_CIRCULAR_BUFFER_SIZE;
-        return true;
-    } else {
-        return false;
+    // Handle any outgoing data, such as parameter notifications
+    if (stack_owner < 0)
+        ble_task_run_stack(-1);
+
+#ifdef CONFIG_REACH_BENCHMARK
+    if (stack_owner < 0)
+        ble_task_run_benchmark();
+#endif // CONFIG_REACH_BENCHMARK
+
+    for (size_t t = 0; t < ARRAY_SIZE(transports); t++)
+    {
+        if (transports[t]->flush != NULL)
+            transports[t]->flush();
     }
 }
 
-static uint32_t cb_get_size(circ_buf_t *cb)
+static void ble_task_run_stack(int session)
 {
-    int temp = (cb->head - cb->tail);
-    return temp < 0 ? temp + BLE_WRITE_CIRCULAR_BUFFER_SIZE:temp;
+    // Multi-part responses are sent one part per call, so keep going until the stack has nothing more to say
+    active_session = session;
+    int passes = 0;
+    do
+    {
+        response_pending = false;
+        cr_process(k_uptime_get_32());
+        atomic_inc(&rnrfc_stats.process_passes);
+    } while (response_pending && ++passes < BLE_TASK_MAX_PASSES_PER_WAKEUP);
+    active_session = -1;
+    if (response_pending)
+    {
+        // Don't hog the CPU, but come back to this as soon as possible
+        if (session >= 0)
+            stack_owner = session;
+        rnrfc_request_processing();
+    }
+    else
+    {
+        stack_owner = -1;
+    }
 }
-#endif
 
-static void disconnect_work_handler(struct k_work *item)
+#ifdef CONFIG_REACH_BENCHMARK
+static void ble_task_run_benchmark(void)
 {
-    cr_set_comm_link_connected(false);
-    device_connected = false;
-    device_subscribed = false;
-    rnrfc_app_handle_ble_disconnection();
-    I3_LOG(LOG_MASK_BLE, "BLE disconnected");
+    int session = rnrfc_benchmark_get_session();
+    if (session < 0)
+        return;
+    if (!session_transport[session]->is_connected(session_local[session]))
+    {
+        rnrfc_benchmark_stop();
+        return;
+    }
+    // Benchmark frames are sent as if they were responses to the client which started the run
+    active_session = session;
+    rnrfc_benchmark_process();
+    active_session = -1;
 }
+#endif // CONFIG_REACH_BENCHMARK
 
-static ssize_t read_reach(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset)
-{
-    uint8_t *resp_buf;
-    size_t resp_len;
-    cr_get_coded_response_buffer(&resp_buf, &resp_len);
-    I3_LOG(LOG_MASK_BLE, "Read request for reach. %d.", resp_len);
-    memcpy(buf, resp_buf, resp_len);
-    return resp_len;
-}
-static ssize_t write_reach(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
+#if ACK_RATE_ADAPTIVE
+static uint32_t ack_rate_adapt(int session, bool is_write, uint32_t limit)
 {
-    // I3_LOG(LOG_MASK_BLE, "Write to reach.  Len %u", len);
-#if (BLE_WRITE_CIRCULAR_BUFFER_SIZE > 1)
-    // Store the data in the circular buffer, there must always be a process between stores
-    coded_buffer_t temp;
-    memcpy(temp.buf, buf, (size_t) len);
-    temp.length = (size_t) len;
-    cb_add(&ble_write_buffer, &temp);
-#else
-    cr_store_coded_prompt((uint8_t *) buf, (size_t) len);
-    memcpy(reach_data, buf, len);
-    reach_length = (size_t) len;
-#endif
-    return len;
+    ack_rate_state_t *state = &ack_rate_state[session][is_write ? 1:0];
+    rnrfc_flow_counters_t counters = { 0 };
+    if (session_transport[session]->get_flow_counters != NULL)
+        session_transport[session]->get_flow_counters(session_local[session], is_write, &counters);
+    atomic_val_t drops = counters.drops;
+    atomic_val_t waits = counters.waits;
+    // The flash is shared, so a stall during another client's transfer still counts
+    atomic_val_t storage_stalls = is_write ? atomic_get(&rnrfc_stats.storage_stalls):0;
+
+    // The counters only say something about the session's transfer since the last call, which may include other traffic.
+    // Comparing rather than subtracting copes with rnrfc_reset_stats().
+    uint32_t rate;
+    if (state->rate == 0)
+        rate = limit / 2;
+    else if (drops != state->drops)
+        rate = state->rate / 2;
+    else if (waits != state->waits || storage_stalls != state->storage_stalls)
+        rate = state->rate - 1;
+    else
+        rate = state->rate + MAX(state->rate / 4, 1);
+    rate = CLAMP(rate, 1, MAX(limit, 1));
+    if (state->rate != 0 && rate < state->rate)
+        atomic_inc(&rnrfc_stats.ack_rate_backoffs);
+
+    state->rate = rate;
+    state->drops = drops;
+    state->waits = waits;
+    state->storage_stalls = storage_stalls;
+    return rate;
 }
-
-static void subscribe_reach(const struct bt_gatt_attr *attr, uint16_t value)
-{
-    device_subscribed = (value == BT_GATT_CCC_NOTIFY);
-    I3_LOG(LOG_MASK_BLE, "%s Reach characteristic", value == BT_GATT_CCC_NOTIFY ? "Subscribe to":"Unsubscribe from");
-}
\ No newline at end of file
+#endif // ACK_RATE_ADAPTIVE
@@ -34,6 +34,8 @@
 #define _REACH_H_
 
 #include <stddef.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/util.h>
 #include <zephyr/bluetooth/uuid.h>
 
 #include "reach-server.h"
@@ -46,7 +48,7 @@
     /** @brief The priority for the BLE task.  By default, this is the highest cooperative priority value */
     #define BLE_TASK_PRIORITY 1
 
-    /** @brief How often the device will advertise.  A shorter interval will consume more power */
+    /** @brief How often the device will advertise once a fast advertising burst is over.  A shorter interval will consume more power */
     #define BLE_ADV_INTERVAL_MS 500
 
     /** @brief BLE advertising includes a minimum and maximum interval to help with scheduling.
@@ -56,18 +58,178 @@
      */
     #define BLE_ADV_INTERVAL_SPACING_MS 100
 
-    /** @brief How often the device will check for new data when there is no BLE connection. */
+    /** @brief The shortest advertising interval used during a fast advertising burst */
+    #define BLE_ADV_FAST_INTERVAL_MIN_MS 20
+
+    /** @brief The longest advertising interval used during a fast advertising burst */
+    #define BLE_ADV_FAST_INTERVAL_MAX_MS 30
+
+    /** @brief How long the device advertises quickly after booting, after a client disconnects, or after rnrfc_advertise_fast() is called.
+     * Set to 0 to always advertise at BLE_ADV_INTERVAL_MS.
+     */
+    #define BLE_ADV_FAST_DURATION_MS 30000
+
+    /** @brief If 1, the BLE task sleeps until it is signalled by incoming data, connection changes, or pending responses.
+     * If 0, the BLE task polls at the fixed intervals below.
+     */
+    #define BLE_TASK_EVENT_DRIVEN 1
+
+    /** @brief In event-driven mode, how often the device will wake up while connected to service parameter notifications. */
+    #define BLE_TASK_NOTIFICATION_INTERVAL_MS 20
+
+    /** @brief With CONFIG_REACH_CONN_EVENT_SYNC, how long before each radio event the BLE task is woken, as an mpsl_radio_notification_distance_t.
+     * This must leave enough time to process prompts and queue the responses, or they will wait for the following event.
+     */
+    #define BLE_CONN_EVENT_DISTANCE MPSL_RADIO_NOTIFICATION_DISTANCE_1740US
+
+    /** @brief With CONFIG_REACH_CONN_EVENT_SYNC, the software interrupt used for the radio notification, which must not be used by anything else. */
+    #define BLE_CONN_EVENT_IRQ SWI1_EGU1_IRQn
+
+    /** @brief The priority of BLE_CONN_EVENT_IRQ.  The interrupt only wakes the BLE task. */
+    #define BLE_CONN_EVENT_IRQ_PRIORITY 4
+
+    /** @brief With CONFIG_REACH_CONN_EVENT_SYNC, how often the BLE task wakes up on its own while a BLE client is connected.
+     * Replaces BLE_TASK_NOTIFICATION_INTERVAL_MS, as the radio notification wakes the task before each connection event.
+     * The timer is still needed for links using peripheral latency, where the radio skips events unless there is something to send.
+     */
+    #define BLE_CONN_EVENT_FALLBACK_MS 100
+
+    /** @brief The maximum number of times cr_process() will be called back-to-back for multi-part responses before yielding. */
+    #define BLE_TASK_MAX_PASSES_PER_WAKEUP 16
+
+    /** @brief In polling mode, how often the device will check for new data when there is no BLE connection. */
     #define BLE_TASK_ADVERTISING_PROCESSING_INTERVAL_MS 100
 
-    /** @brief How often the device will check for new data when BLE is connected. */
+    /** @brief In polling mode, how often the device will check for new data when BLE is connected. */
     #define BLE_TASK_CONNECTED_PROCESSING_INTERVAL_MS 5
 
-    /** @brief The size of the circular buffer used to handle incoming writes.
+    /** @brief The size of the circular buffer used to handle incoming writes, for each connection.
      * @note This can generally be set to 1 unless file writes are being done,
      * in which case values > 2 will increase the write speed at the cost of RAM usage
      */
     #define BLE_WRITE_CIRCULAR_BUFFER_SIZE 1
 
+    /** @brief How long a write will wait for space in a full circular buffer before it is rejected.
+     * @note This blocks the Bluetooth RX thread, which slows down the sender.
+     * Rejected writes are reported to the client with an ATT error and counted in the statistics.
+     */
+    #define BLE_WRITE_FULL_TIMEOUT_MS 50
+
+    /** @brief If 1, the file transfer acknowledgement rate is adjusted from one transfer to the next, separately for each session.
+     * The rate drops sharply after a transfer which lost messages, drops a little after one which stalled waiting for buffer space
+     * or storage, and otherwise climbs towards the transport's limit.  The Reach protocol fixes the rate when each transfer starts.
+     * If 0, each transport's limit is always used, which for BLE writes is BLE_WRITE_CIRCULAR_BUFFER_SIZE - 1.
+     */
+    #define ACK_RATE_ADAPTIVE 1
+
+    /** @brief With ACK_RATE_ADAPTIVE, the most writes a BLE client may send between acknowledgements.
+     * Above BLE_WRITE_CIRCULAR_BUFFER_SIZE - 1, the writes which don't fit wait for up to BLE_WRITE_FULL_TIMEOUT_MS,
+     * which the adaptive rate treats as a stall.
+     */
+    #define BLE_WRITE_MAX_ACK_RATE (2 * BLE_WRITE_CIRCULAR_BUFFER_SIZE)
+
+    /** @brief A storage write reported with rnrfc_report_storage_busy() which takes longer than this counts as a stall. */
+    #define ACK_RATE_STORAGE_STALL_MS 20
+
+    /** @brief How long a session's claim on file transfers lasts after it last used it, see rnrfc_file_transfer_claim().
+     * This covers a client which abandons a transfer without disconnecting.
+     */
+    #define FILE_TRANSFER_CLAIM_TIMEOUT_MS 5000
+
+    /** @brief The shortest period over which rnrfc_get_throughput() measures the data rates.
+     * The rates are only recalculated when asked for, so they cover the time since the previous calculation if that was longer.
+     */
+    #define THROUGHPUT_WINDOW_MS 1000
+
+    /** @brief The number of outgoing notifications which can be queued for each connection while waiting for Bluetooth TX buffers. */
+    #define BLE_NOTIFY_QUEUE_SIZE 8
+
+    /** @brief The number of notifications which can be handed to the Bluetooth stack before their transmission completes.
+     * @note This should be less than CONFIG_BT_CONN_TX_MAX, leaving buffers for other ATT traffic
+     */
+    #define BLE_NOTIFY_MAX_IN_FLIGHT (CONFIG_BT_CONN_TX_MAX - 2)
+
+    /** @brief How long a response will wait for space in a full notification queue before it is dropped. */
+    #define BLE_NOTIFY_TIMEOUT_MS 500
+
+    /** @brief If 1, a second characteristic is added which carries Reach messages split into segments,
+     * so that messages up to CR_CODED_BUFFER_SIZE bytes can be sent regardless of the ATT MTU.
+     * @note Each segment starts with a 1 byte header: bit 7 is set on the first segment, bit 6 is set on the last segment,
+     * and bits 0-5 are a sequence number which starts at 0 for each message and wraps at 64.
+     * The first segment follows the header with the total message length as a 2 byte little-endian value.
+     * Responses are sent on whichever characteristic the client last wrote to.
+     */
+    #define BLE_SAR_ENABLED 1
+
+    /** @brief If 1, a notify-only characteristic is added which packs several Reach messages into each notification.
+     * A client asks for this by subscribing to it, after which everything that would have been notified on the plain Reach characteristic
+     * is sent on this one instead.  Each message is preceded by its length as a 1 byte value, and a notification holds as many
+     * whole messages as fit in the ATT payload.  Messages must be 255 bytes or less, and one byte smaller than the ATT payload.
+     * @note This saves a link layer packet for each small message that is combined, which adds up with frequent parameter notifications
+     */
+    #define BLE_BATCH_ENABLED 1
+
+    /** @brief How long unsolicited messages, such as parameter notifications, can wait for more messages to be batched with them.
+     * A batch is sent as soon as it is full or holds a response to a prompt, and otherwise at the end of the first processing pass after this.
+     * Set to 0 to send each batch at the end of the processing pass which filled it.
+     */
+    #define BLE_BATCH_HOLD_MS 20
+
+    /** @brief If 1, a characteristic is added which lets a client that reconnects skip discovery.
+     * Reading it gives a 4 byte token for the connection followed by the 4 byte parameter hash, both little-endian.
+     * After reconnecting, the client writes the token it read last time, and then reads a new token for next time.  If the
+     * device still has a record for the client's address with that token and the parameters haven't changed since, the write succeeds and the client can use what it discovered before.
+     * The default notifications are also left off if the client had cleared them.  Otherwise the write fails with
+     * BT_ATT_ERR_VALUE_NOT_ALLOWED and the client should discover the device as usual.
+     * @note Records only last until the device reboots, and each token can only be used once
+     */
+    #define BLE_RESUME_ENABLED 1
+
+    /** @brief The number of disconnected clients whose records are kept.  The record unused for longest is replaced first. */
+    #define BLE_RESUME_CACHE_SIZE 4
+
+    /** @brief If 1, an LE L2CAP connection-oriented channel is offered alongside the GATT service.
+     * Each SDU carries one whole Reach message, with flow control from L2CAP credits rather than file transfer acknowledgements.
+     * Responses go back on the channel the prompt arrived on, so a client can move file transfers onto L2CAP and keep everything else on GATT.
+     * @note This is enabled by default when CONFIG_BT_L2CAP_DYNAMIC_CHANNEL is set
+     */
+    #define BLE_L2CAP_ENABLED 1
+
+    /** @brief The PSM of the L2CAP channel, which clients can also read from the PSM characteristic.  Must be from 0x0080 to 0x00FF. */
+    #define BLE_L2CAP_PSM 0x00C5
+
+    /** @brief The number of L2CAP SDUs which can be waiting to be processed for each connection.  The client is given this many credits. */
+    #define BLE_L2CAP_RX_SDUS 4
+
+    /** @brief The number of L2CAP SDUs which can be waiting to be sent, shared by all connections. */
+    #define BLE_L2CAP_TX_SDUS 4
+
+    /** @brief If 1, a second, non-connectable advertising set broadcasts a payload provided by rnrfc_app_get_broadcast_data(),
+     * so that observers can read values without connecting.
+     * The payload follows the Reach service UUID in 128-bit service data.
+     * @note This is enabled by default when CONFIG_BT_EXT_ADV is set, and needs CONFIG_BT_EXT_ADV_MAX_ADV_SET of at least 2
+     */
+    #define BLE_BROADCAST_ENABLED 1
+
+    /** @brief If 1, the broadcast payload is sent in a periodic advertising train, which observers can synchronize to.
+     * If 0, it is sent in the extended advertising data, which any extended scanner will see.
+     * @note This is enabled by default when CONFIG_BT_PER_ADV is set
+     */
+    #define BLE_BROADCAST_PERIODIC 0
+
+    /** @brief The interval of the broadcast advertising */
+    #define BLE_BROADCAST_INTERVAL_MS 1000
+
+    /** @brief How often the broadcast payload is rebuilt.  The advertising data is only changed when the payload differs.
+     * @note rnrfc_broadcast_refresh() rebuilds it straight away
+     */
+    #define BLE_BROADCAST_REFRESH_MS 1000
+
+    /** @brief The largest broadcast payload, not including the 16 byte service UUID.
+     * @note The controller must support advertising data of at least this plus 18 bytes, see CONFIG_BT_CTLR_ADV_DATA_LEN_MAX
+     */
+    #define BLE_BROADCAST_MAX_DATA_SIZE 200
+
     /** @brief The UUID for the advertised Reach service.  Set to the standard Reach UUID by default.
      * @note Changing this from the default will prevent this device from working with the generic Reach app
      */
@@ -77,13 +239,123 @@
      * @note Changing this from the default will prevent this device from working with the generic Reach app
      */
     #define REACH_CHARACTERISTIC_UUID BT_UUID_128_ENCODE(0xd42d1039, 0x1d11, 0x4f10, 0xbae6, 0x5f3b44cf6439)
+
+    /** @brief The UUID for the segmented Reach characteristic, used when BLE_SAR_ENABLED is 1 */
+    #define REACH_SAR_CHARACTERISTIC_UUID BT_UUID_128_ENCODE(0xd42d103a, 0x1d11, 0x4f10, 0xbae6, 0x5f3b44cf6439)
+
+    /** @brief The UUID for the characteristic holding the L2CAP PSM as a 2 byte little-endian value, used when BLE_L2CAP_ENABLED is 1 */
+    #define REACH_L2CAP_PSM_CHARACTERISTIC_UUID BT_UUID_128_ENCODE(0xd42d103b, 0x1d11, 0x4f10, 0xbae6, 0x5f3b44cf6439)
+
+    /** @brief The UUID for the batched Reach characteristic, used when BLE_BATCH_ENABLED is 1 */
+    #define REACH_BATCH_CHARACTERISTIC_UUID BT_UUID_128_ENCODE(0xd42d103c, 0x1d11, 0x4f10, 0xbae6, 0x5f3b44cf6439)
+
+    /** @brief The UUID for the session resumption characteristic, used when BLE_RESUME_ENABLED is 1 */
+    #define REACH_RESUME_CHARACTERISTIC_UUID BT_UUID_128_ENCODE(0xd42d103d, 0x1d11, 0x4f10, 0xbae6, 0x5f3b44cf6439)
 #endif
 
 // To change any of the defines described above, define them here
 #define BLE_WRITE_CIRCULAR_BUFFER_SIZE 10
 
+#ifdef CONFIG_BT
+/** @brief The number of BLE clients which can be connected at once, each with its own session */
+#define RNRFC_MAX_BLE_SESSIONS CONFIG_BT_MAX_CONN
+/** @brief The device name used until the User Device Name parameter is set */
+#define RNRFC_DEFAULT_DEVICE_NAME CONFIG_BT_DEVICE_NAME
+#else
+#define RNRFC_MAX_BLE_SESSIONS 0
+#define RNRFC_DEFAULT_DEVICE_NAME "Reacher"
+#endif // CONFIG_BT
+
+/** @brief The number of sessions, which is the size needed for any per-client state.
+ * The BLE sessions come first, followed by one each for the serial and socket transports if they are enabled. */
+#define RNRFC_MAX_SESSIONS (RNRFC_MAX_BLE_SESSIONS + IS_ENABLED(CONFIG_REACH_SERIAL_TRANSPORT) + IS_ENABLED(CONFIG_REACH_SOCKET_TRANSPORT))
+
 /**
-* @brief Initializes the nRF Connect Reach BLE implementation
+* @brief Counters describing the behavior of the BLE task, which can be used to evaluate performance
+* @note All members are updated atomically, and may be read at any time
+*/
+typedef struct {
+    /** @brief The number of times the BLE task has woken up */
+    atomic_t task_wakeups;
+    /** @brief The number of wakeups caused by a timer rather than an event */
+    atomic_t task_timer_wakeups;
+    /** @brief The number of times cr_process() has been called */
+    atomic_t process_passes;
+    /** @brief The number of prompts passed to the Reach stack */
+    atomic_t prompts_processed;
+    /** @brief The number of bytes of coded prompts received, from all clients */
+    atomic_t bytes_received;
+    /** @brief The number of bytes of coded messages successfully handed to a transport, to all clients */
+    atomic_t bytes_sent;
+    /** @brief The sum of the time between receiving and processing each prompt, in microseconds */
+    atomic_t prompt_latency_total_us;
+    /** @brief The longest time between receiving and processing a prompt, in microseconds */
+    atomic_t prompt_latency_max_us;
+    /** @brief The largest number of prompts that have been waiting in the write buffer at once */
+    atomic_t ingress_high_water;
+    /** @brief The number of times a write had to wait for the write buffer to have space */
+    atomic_t ingress_full_waits;
+    /** @brief The number of writes rejected because the write buffer stayed full */
+    atomic_t ingress_drops;
+    /** @brief The number of notifications currently waiting for a TX buffer */
+    atomic_t notify_queue_depth;
+    /** @brief The largest number of notifications that have been waiting for a TX buffer at once */
+    atomic_t notify_queue_high_water;
+    /** @brief The number of times a response had to wait for the notification queue to have space */
+    atomic_t notify_queue_waits;
+    /** @brief The number of notifications handed to the Bluetooth stack */
+    atomic_t notify_sent;
+    /** @brief The number of notifications the Bluetooth stack reported as transmitted */
+    atomic_t notify_completed;
+    /** @brief The number of notifications which could not be sent */
+    atomic_t notify_failed;
+    /** @brief The sum of the time between queueing and transmitting each notification, in microseconds */
+    atomic_t notify_latency_total_us;
+    /** @brief The longest time between queueing and transmitting a notification, in microseconds */
+    atomic_t notify_latency_max_us;
+    /** @brief The number of segments received on the segmented characteristic */
+    atomic_t sar_segments_received;
+    /** @brief The number of segments queued for the segmented characteristic */
+    atomic_t sar_segments_sent;
+    /** @brief The number of segmented prompts discarded because of missing or malformed segments */
+    atomic_t sar_errors;
+    /** @brief The number of notifications sent on the batched characteristic */
+    atomic_t batch_notifications;
+    /** @brief The number of messages carried by those notifications */
+    atomic_t batch_messages;
+    /** @brief The number of SDUs received on the L2CAP channel */
+    atomic_t l2cap_sdus_received;
+    /** @brief The number of SDUs sent on the L2CAP channel */
+    atomic_t l2cap_sdus_sent;
+    /** @brief The number of times the broadcast advertising data has been changed */
+    atomic_t broadcast_updates;
+    /** @brief The number of wakeups caused by the radio notification ahead of a radio event, with CONFIG_REACH_CONN_EVENT_SYNC */
+    atomic_t conn_event_wakeups;
+    /** @brief The number of BLE clients seen for the first time since boot, and not bonded, which have sent a prompt */
+    atomic_t first_prompt_new_count;
+    /** @brief The sum of the time between connecting and the first prompt for those new clients, in milliseconds */
+    atomic_t first_prompt_new_total_ms;
+    /** @brief The number of returning BLE clients, bonded or seen since boot, which have sent a prompt */
+    atomic_t first_prompt_returning_count;
+    /** @brief The sum of the time between connecting and the first prompt for returning clients, in milliseconds */
+    atomic_t first_prompt_returning_total_ms;
+    /** @brief The number of clients which resumed their previous session */
+    atomic_t resume_hits;
+    /** @brief The number of resumption attempts refused because the token was unknown or the parameters had changed */
+    atomic_t resume_misses;
+    /** @brief The acknowledgement rate offered for the most recent file write */
+    atomic_t ack_rate_write;
+    /** @brief The acknowledgement rate offered for the most recent file read */
+    atomic_t ack_rate_read;
+    /** @brief The number of transfers offered a lower acknowledgement rate than the one before, because it stalled or lost messages */
+    atomic_t ack_rate_backoffs;
+    /** @brief The number of storage writes which took longer than ACK_RATE_STORAGE_STALL_MS */
+    atomic_t storage_stalls;
+} rnrfc_stats_t;
+
+/**
+* @brief Initializes the nRF Connect Reach implementation, and each enabled transport (BLE, serial and socket)
+* @note A transport which fails to start is logged and left out, while the others carry on
 */
 void rnrfc_init();
 
@@ -94,16 +366,131 @@ void rnrfc_init();
 */
 int rnrfc_set_advertised_name(char *name);
 
+/**
+* @brief Starts a burst of fast advertising, lasting BLE_ADV_FAST_DURATION_MS, so that a client can connect quickly
+* @note This is safe to call from any thread.  It has no effect while every connection is in use.
+*/
+void rnrfc_advertise_fast(void);
+
+/**
+* @brief Rebuilds the broadcast payload soon, such as when a broadcast value has been written
+* @note This is safe to call from any thread.  The payload is rebuilt after the BLE task's current processing pass,
+* so a parameter write can call this before the value is stored.  It has no effect if BLE_BROADCAST_ENABLED is 0.
+*/
+void rnrfc_broadcast_refresh(void);
+
+/**
+* @brief Wakes the BLE task so that the Reach stack is processed as soon as possible
+* @note This is safe to call from any context, including interrupts
+*/
+void rnrfc_request_processing(void);
+
+/**
+* @brief Gets the BLE task statistics
+* @return A pointer to the statistics, which are updated as the BLE task runs
+*/
+const rnrfc_stats_t *rnrfc_get_stats(void);
+
+/**
+* @brief Resets all BLE task statistics to 0
+*/
+void rnrfc_reset_stats(void);
+
+/**
+* @brief Gets the session whose prompt is currently being handled by the Reach stack
+* @note This can be used to keep per-client state, such as discovery progress, in the Reach callbacks
+* @return The session index, from 0 to RNRFC_MAX_SESSIONS - 1.  0 is returned if no prompt is being handled.
+*/
+int rnrfc_get_active_session(void);
+
+/**
+* @brief Claims file transfers for the session whose prompt is currently being handled
+* @note The Reach stack only tracks one file transfer, so the file callbacks use this to turn away a second client.
+* The claim is dropped by rnrfc_file_transfer_release(), when the session disconnects, or once it has gone unused for
+* FILE_TRANSFER_CLAIM_TIMEOUT_MS.
+* @return 0 if the session now holds the claim, or -EBUSY if another session holds it
+*/
+int rnrfc_file_transfer_claim(void);
+
+/**
+* @brief Drops the claim on file transfers, if the session whose prompt is currently being handled holds it
+*/
+void rnrfc_file_transfer_release(void);
+
+/**
+* @brief Gets the number of clients currently connected
+* @return The number of connections
+*/
+int rnrfc_get_connection_count(void);
+
+/**
+* @brief Checks whether a client resumed its previous session rather than connecting as a new client
+* @param session The session index
+* @return True if the session was resumed, in which case the client already has the device's descriptions
+*/
+bool rnrfc_session_is_resumed(int session);
+
+/**
+* @brief Records whether a client has turned the default notifications off, which is restored if it resumes the session later
+* @param session The session index
+* @param off True if the client cleared the notifications
+*/
+void rnrfc_session_set_notifications_off(int session, bool off);
+
+/**
+* @brief Gets the largest response which can currently be sent to a session in one go
+* @note This depends on the ATT MTU when responses go to the plain Reach characteristic
+* @param session The session index
+* @return The size in bytes, or 0 if the session is not connected
+*/
+size_t rnrfc_get_max_response_size(int session);
+
+/**
+* @brief Reports how long a storage write during a file transfer blocked the Reach task, such as flushing OTA data to flash
+* @note Writes longer than ACK_RATE_STORAGE_STALL_MS make the next transfer use a lower acknowledgement rate
+* @param busy_ms How long the write took, in milliseconds
+*/
+void rnrfc_report_storage_busy(uint32_t busy_ms);
+
+/**
+* @brief Gets the rate at which Reach messages have been received and sent, across all clients
+* @note The rates are averaged over at least THROUGHPUT_WINDOW_MS.  Only the byte counters in rnrfc_stats_t are updated as messages pass.
+* @param received_per_second Where to store the received rate, in bytes per second
+* @param sent_per_second Where to store the sent rate, in bytes per second
+*/
+void rnrfc_get_throughput(uint32_t *received_per_second, uint32_t *sent_per_second);
+
 /**
 * @brief A callback for when a device connects via BLE, which can be used for app-specific actions
-* @note This is implemented as a weak function which returns immediately in reach_nrf_connect.c
+* @note This is called for each connection, including when other devices are already connected
+* @note This is implemented as a weak function which returns immediately in reach_ble.c
 */
 void rnrfc_app_handle_ble_connection(void);
 
 /**
 * @brief A callback for when a device disconnects via BLE, which can be used for app-specific actions
-* @note This is implemented as a weak function which returns immediately in reach_nrf_connect.c
+* @note This is called for each connection, rnrfc_get_connection_count() shows whether any remain
+* @note This is implemented as a weak function which returns immediately in reach_ble.c
 */
 void rnrfc_app_handle_ble_disconnection(void);
 
+/**
+* @brief A callback for when a client's session ends on any transport, which can be used for app-specific actions
+* @note This is called from the BLE task after the session's state is cleared, including for BLE disconnections
+* @note This is implemented as a weak function which returns immediately in reach_nrf_connect.c
+* @param session The session which closed
+*/
+void rnrfc_app_handle_session_closed(int session);
+
+/**
+* @brief A callback which provides the payload of the connectionless broadcast, when BLE_BROADCAST_ENABLED is 1
+* @note This is called from the BLE task between processing passes, every BLE_BROADCAST_REFRESH_MS and after
+* rnrfc_broadcast_refresh(), so it can read the parameters safely
+* @note This is implemented as a weak function which returns 0 in reach_ble.c
+* @param buf Where to store the payload
+* @param max_size The size of buf, which is BLE_BROADCAST_MAX_DATA_SIZE
+* @return The length of the payload
+*/
+size_t rnrfc_app_get_broadcast_data(uint8_t *buf, size_t max_size);
+
 #endif // _REACH_H_
@@ -0,0 +1,448 @@
+/*
+ * Copyright (c) 2023-2024 i3 Product Development
+ * 
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file      reach_serial.c
+ * @brief     Framed serial transport for the nRF Connect Reach integration
+ * 
+ * @copyright (c) Copyright 2024 i3 Product Development. All Rights Reserved.
+ */
+
+#include "reach_serial.h"
+#include "reach_transport.h"
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/uart.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/ring_buffer.h>
+
+#include "reach_nrf_connect.h"
+#include "reach-server.h"
+#include "cr_stack.h"
+#include "i3_log.h"
+
+/*******************************************************************************
+ *******************************   DEFINES   ***********************************
+ ******************************************************************************/
+
+// Default define values, which can be overridden in the .h file as needed
+#ifndef SERIAL_RX_BUFFER_SIZE
+#define SERIAL_RX_BUFFER_SIZE 4096
+#endif // SERIAL_RX_BUFFER_SIZE
+
+#ifndef SERIAL_TX_BUFFER_SIZE
+// At least one of the largest frames, which grows with CONFIG_REACH_MAX_MESSAGE_SIZE
+#define SERIAL_TX_BUFFER_SIZE MAX(2048, FRAME_MAX_ENCODED)
+#endif // SERIAL_TX_BUFFER_SIZE
+
+#ifndef SERIAL_TX_TIMEOUT_MS
+#define SERIAL_TX_TIMEOUT_MS 500
+#endif // SERIAL_TX_TIMEOUT_MS
+
+#ifndef SERIAL_POLL_INTERVAL_MS
+#define SERIAL_POLL_INTERVAL_MS 5
+#endif // SERIAL_POLL_INTERVAL_MS
+
+// Defines only needed internally
+#define FRAME_DELIMITER 0x00
+#define FRAME_MAX_DECODED (CR_CODED_BUFFER_SIZE + RNRFC_SERIAL_CRC_SIZE)
+// COBS adds one byte for every 254, plus one, and the frame ends with a delimiter
+#define FRAME_MAX_ENCODED (FRAME_MAX_DECODED + (FRAME_MAX_DECODED / 254) + 2)
+// The largest number of bytes which can be copied from the UART FIFO at once
+#define UART_CHUNK_SIZE 64
+
+#if (SERIAL_TX_BUFFER_SIZE < FRAME_MAX_ENCODED)
+#error "The serial transmit buffer must be able to hold the largest frame"
+#endif
+
+/*******************************************************************************
+ *********************   LOCAL FUNCTION PROTOTYPES   ***************************
+ ******************************************************************************/
+
+// Transport functions for the Reach task
+static int serial_init(void);
+static bool serial_is_active(void);
+static bool serial_is_connected(int session);
+static bool serial_receive(int session, rnrfc_prompt_t *prompt);
+static int serial_send(int session, const uint8_t *buf, size_t len, bool reply);
+static size_t serial_get_max_response_size(int session);
+static uint32_t serial_get_ack_rate(int session, uint32_t requested_rate, bool is_write);
+
+static void uart_isr(const struct device *dev, void *user_data);
+static void poll_work_handler(struct k_work *item);
+static bool decode_byte(uint8_t byte);
+static void decoder_reset(void);
+static size_t cobs_encode(const uint8_t *src, size_t len, uint8_t *dst);
+static bool host_present(void);
+static void serial_disconnect(const char *reason);
+
+/*******************************************************************************
+ ***************************  LOCAL VARIABLES   ********************************
+ ******************************************************************************/
+
+static const struct device *uart_dev = DEVICE_DT_GET(DT_CHOSEN(reach_uart));
+static bool irq_driven = false;
+static bool connected = false;
+static rnrfc_serial_stats_t stats;
+
+// Raw bytes, filled by the UART interrupt (or the poll work item) and emptied by the BLE task
+RING_BUF_DECLARE(rx_ring, SERIAL_RX_BUFFER_SIZE);
+// Encoded frames, filled by the BLE task and emptied by the UART interrupt
+RING_BUF_DECLARE(tx_ring, SERIAL_TX_BUFFER_SIZE);
+// Given whenever the UART interrupt makes space in tx_ring
+static K_SEM_DEFINE(tx_space_sem, 0, 1);
+static K_WORK_DELAYABLE_DEFINE(poll_work, poll_work_handler);
+
+// Decoder state, only used by the BLE task
+static uint8_t frame[FRAME_MAX_DECODED];
+static size_t frame_length = 0;
+// The code byte of the current COBS block, or 0 before the first block of a frame
+static uint8_t block_code = 0;
+// The number of data bytes left in the current block
+static uint8_t block_remaining = 0;
+static bool frame_invalid = false;
+
+// Encoder output, only used by the BLE task
+static uint8_t tx_frame[FRAME_MAX_ENCODED];
+static uint8_t tx_message[FRAME_MAX_DECODED];
+
+const rnrfc_transport_t rnrfc_serial_transport = {
+    .name = "serial",
+    .session_count = 1,
+    .init = serial_init,
+    .is_active = serial_is_active,
+    .is_connected = serial_is_connected,
+    .receive = serial_receive,
+    .send = serial_send,
+    .get_max_response_size = serial_get_max_response_size,
+    .get_ack_rate = serial_get_ack_rate,
+};
+
+/*******************************************************************************
+ **************************   GLOBAL FUNCTIONS   *******************************
+ ******************************************************************************/
+
+bool rnrfc_serial_is_connected(void)
+{
+    return connected;
+}
+
+const rnrfc_serial_stats_t *rnrfc_serial_get_stats(void)
+{
+    return &stats;
+}
+
+/*******************************************************************************
+ ***************************   LOCAL FUNCTIONS    ******************************
+ ******************************************************************************/
+
+static int serial_init(void)
+{
+    if (!device_is_ready(uart_dev))
+        return -ENODEV;
+
+    int rval = uart_irq_callback_user_data_set(uart_dev, uart_isr, NULL);
+    if (rval == 0)
+    {
+        irq_driven = true;
+        uart_irq_rx_enable(uart_dev);
+    }
+    else
+    {
+        // Some drivers, such as the native_sim pty UART, can only be polled
+        I3_LOG(LOG_MASK_WARN, "Serial UART has no interrupt support (%d), polling instead", rval);
+        k_work_reschedule(&poll_work, K_MSEC(SERIAL_POLL_INTERVAL_MS));
+    }
+    return 0;
+}
+
+static bool serial_is_active(void)
+{
+    if (connected && !host_present())
+        serial_disconnect("port closed");
+    // A host counts from its first valid frame, and any bytes waiting may be that frame
+    return connected || !ring_buf_is_empty(&rx_ring);
+}
+
+static bool serial_is_connected(int session)
+{
+    ARG_UNUSED(session);
+    return connected;
+}
+
+static bool serial_receive(int session, rnrfc_prompt_t *prompt)
+{
+    ARG_UNUSED(session);
+    uint8_t *data;
+    uint32_t available;
+    while ((available = ring_buf_get_claim(&rx_ring, &data, UART_CHUNK_SIZE)) > 0)
+    {
+        for (uint32_t i = 0; i < available; i++)
+        {
+            if (decode_byte(data[i]))
+            {
+                // Leave the rest for the next call, as the frame buffer is about to be handed out
+                ring_buf_get_finish(&rx_ring, i + 1);
+                prompt->buf = frame;
+                prompt->length = frame_length;
+                prompt->timestamp = k_cycle_get_32();
+                if (!connected)
+                {
+                    // There is no connection event on a serial port, so the first valid frame stands in for one
+                    I3_LOG(LOG_MASK_BLE, "Serial host connected");
+                    connected = true;
+                    cr_set_comm_link_connected(true);
+                }
+                stats.frames_received++;
+                // Started again on the next call, which is after the stack is done with this frame
+                frame_length = 0;
+                return true;
+            }
+        }
+        ring_buf_get_finish(&rx_ring, available);
+    }
+    return false;
+}
+
+static int serial_send(int session, const uint8_t *buf, size_t len, bool reply)
+{
+    ARG_UNUSED(session);
+    ARG_UNUSED(reply);
+    if (len > CR_CODED_BUFFER_SIZE)
+        return cr_ErrorCodes_WRITE_FAILED;
+    if (!host_present())
+    {
+        serial_disconnect("port closed");
+        return cr_ErrorCodes_WRITE_FAILED;
+    }
+    memcpy(tx_message, buf, len);
+    sys_put_le32(crc32_ieee(buf, len), &tx_message[len]);
+    size_t encoded = cobs_encode(tx_message, len + RNRFC_SERIAL_CRC_SIZE, tx_frame);
+    tx_frame[encoded++] = FRAME_DELIMITER;
+
+    if (!irq_driven)
+    {
+        for (size_t i = 0; i < encoded; i++)
+            uart_poll_out(uart_dev, tx_frame[i]);
+        stats.frames_sent++;
+        return 0;
+    }
+
+    // Only whole frames go into the buffer, so that a timeout never leaves half of one behind
+    int64_t deadline = k_uptime_get() + SERIAL_TX_TIMEOUT_MS;
+    while (ring_buf_space_get(&tx_ring) < encoded)
+    {
+        int64_t remaining = deadline - k_uptime_get();
+        if (remaining <= 0 || k_sem_take(&tx_space_sem, K_MSEC(remaining)) != 0)
+        {
+            stats.tx_drops++;
+            // Nothing is reading the port, so stop sending to it rather than wait here for every message
+            serial_disconnect("transmit timeout");
+            return cr_ErrorCodes_WRITE_FAILED;
+        }
+    }
+    ring_buf_put(&tx_ring, tx_frame, encoded);
+    uart_irq_tx_enable(uart_dev);
+    stats.frames_sent++;
+    return 0;
+}
+
+static size_t serial_get_max_response_size(int session)
+{
+    ARG_UNUSED(session);
+    return connected ? CR_CODED_BUFFER_SIZE:0;
+}
+
+static uint32_t serial_get_ack_rate(int session, uint32_t requested_rate, bool is_write)
+{
+    ARG_UNUSED(session);
+    if (!is_write)
+        return requested_rate;
+    // The whole window has to fit in the receive buffer
+    uint32_t frames = SERIAL_RX_BUFFER_SIZE / FRAME_MAX_ENCODED;
+    return MIN(requested_rate, (frames > 1) ? frames - 1:1);
+}
+
+static void uart_isr(const struct device *dev, void *user_data)
+{
+    ARG_UNUSED(user_data);
+    bool received = false;
+    while (uart_irq_update(dev) && (uart_irq_rx_ready(dev) || uart_irq_tx_ready(dev)))
+    {
+        if (uart_irq_rx_ready(dev))
+        {
+            uint8_t chunk[UART_CHUNK_SIZE];
+            int count = uart_fifo_read(dev, chunk, sizeof(chunk));
+            if (count > 0)
+            {
+                uint32_t stored = ring_buf_put(&rx_ring, chunk, (uint32_t) count);
+                stats.rx_overruns += (uint32_t) count - stored;
+                received = true;
+            }
+        }
+        if (uart_irq_tx_ready(dev))
+        {
+            uint8_t *data;
+            uint32_t available = ring_buf_get_claim(&tx_ring, &data, UART_CHUNK_SIZE);
+            if (available == 0)
+            {
+                uart_irq_tx_disable(dev);
+            }
+            else
+            {
+                int sent = uart_fifo_fill(dev, data, (int) available);
+                ring_buf_get_finish(&tx_ring, (sent > 0) ? (uint32_t) sent:0);
+                k_sem_give(&tx_space_sem);
+            }
+        }
+    }
+    if (received)
+        rnrfc_request_processing();
+}
+
+static void poll_work_handler(struct k_work *item)
+{
+    ARG_UNUSED(item);
+    bool received = false;
+    unsigned char c;
+    while (uart_poll_in(uart_dev, &c) == 0)
+    {
+        if (ring_buf_put(&rx_ring, &c, 1) == 0)
+            stats.rx_overruns++;
+        received = true;
+    }
+    if (received)
+        rnrfc_request_processing();
+    k_work_reschedule(&poll_work, K_MSEC(SERIAL_POLL_INTERVAL_MS));
+}
+
+// Returns true when a valid frame has been completed
+static bool decode_byte(uint8_t byte)
+{
+    if (byte == FRAME_DELIMITER)
+    {
+        bool valid = !frame_invalid && block_remaining == 0 && frame_length > RNRFC_SERIAL_CRC_SIZE;
+        if (valid)
+        {
+            frame_length -= RNRFC_SERIAL_CRC_SIZE;
+            valid = (crc32_ieee(frame, frame_length) == sys_get_le32(&frame[frame_length]));
+        }
+        // Back to back delimiters are just padding
+        if (!valid && (frame_length > 0 || frame_invalid))
+        {
+            stats.frame_errors++;
+            I3_LOG(LOG_MASK_WARN, "Dropped a bad serial frame");
+        }
+        if (!valid)
+            frame_length = 0;
+        decoder_reset();
+        return valid;
+    }
+    if (frame_invalid)
+        return false;
+
+    if (block_remaining == 0)
+    {
+        // A code byte.  Every block except a full one is followed by a zero, unless it was the last block.
+        if (block_code != 0 && block_code != 0xFF)
+        {
+            if (frame_length >= sizeof(frame))
+            {
+                frame_invalid = true;
+                return false;
+            }
+            frame[frame_length++] = 0;
+        }
+        block_code = byte;
+        block_remaining = byte - 1;
+        return false;
+    }
+
+    if (frame_length >= sizeof(frame))
+    {
+        frame_invalid = true;
+        return false;
+    }
+    frame[frame_length++] = byte;
+    block_remaining--;
+    return false;
+}
+
+static void decoder_reset(void)
+{
+    block_code = 0;
+    block_remaining = 0;
+    frame_invalid = false;
+}
+
+static size_t cobs_encode(const uint8_t *src, size_t len, uint8_t *dst)
+{
+    size_t code_index = 0;
+    size_t out = 1;
+    uint8_t code = 1;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (src[i] != 0)
+        {
+            dst[out++] = src[i];
+            code++;
+        }
+        if (src[i] == 0 || code == 0xFF)
+        {
+            dst[code_index] = code;
+            code = 1;
+            code_index = out++;
+        }
+    }
+    dst[code_index] = code;
+    return out;
+}
+
+// Whether the host has the port open, where the UART can tell (CDC ACM reports the host's DTR)
+static bool host_present(void)
+{
+    uint32_t dtr = 0;
+    // Other UARTs can't tell, so the host is assumed to be there until a transmit times out
+    if (uart_line_ctrl_get(uart_dev, UART_LINE_CTRL_DTR, &dtr) != 0)
+        return true;
+    return dtr != 0;
+}
+
+// Only called from the BLE task.  The next valid frame connects the host again.
+static void serial_disconnect(const char *reason)
+{
+    if (!connected)
+        return;
+    I3_LOG(LOG_MASK_BLE, "Serial host disconnected (%s)", reason);
+    connected = false;
+    // Anything still queued was for the host which has gone
+    if (irq_driven)
+        uart_irq_tx_disable(uart_dev);
+    ring_buf_reset(&tx_ring);
+    rnrfc_transport_session_closed(&rnrfc_serial_transport, 0);
+}
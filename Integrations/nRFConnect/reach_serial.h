@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2023-2024 i3 Product Development
+ * 
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file      reach_serial.h
+ * @brief     Framed serial transport for the nRF Connect Reach integration
+ * 
+ * @copyright (c) Copyright 2024 i3 Product Development. All Rights Reserved.
+ */
+
+#ifndef _REACH_SERIAL_H_
+#define _REACH_SERIAL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Each Reach message is sent as one frame: the message followed by its CRC-32 (IEEE 802.3, as used by zlib) in
+ * little-endian order, COBS encoded so that it contains no zero bytes, and then a single 0x00 delimiter.
+ * A sender may also start each frame with a delimiter, so that any noise before it is discarded.
+ * Frames which are too long, or whose CRC doesn't match, are dropped and counted.
+ */
+
+#ifdef _DOXYGEN_
+    /** @brief The number of received bytes which can be waiting to be decoded.  Also limits the file transfer acknowledgement rate. */
+    #define SERIAL_RX_BUFFER_SIZE 4096
+
+    /** @brief The number of encoded bytes which can be waiting to be transmitted. */
+    #define SERIAL_TX_BUFFER_SIZE 2048
+
+    /** @brief How long sending a frame will wait for space in the transmit buffer before it is dropped. */
+    #define SERIAL_TX_TIMEOUT_MS 500
+
+    /** @brief How often the UART is polled for received bytes if its driver doesn't support interrupts, such as the native_sim pty UART. */
+    #define SERIAL_POLL_INTERVAL_MS 5
+#endif
+
+// To change any of the defines described above, define them here
+
+/** @brief The number of bytes added to each message by the CRC */
+#define RNRFC_SERIAL_CRC_SIZE 4
+
+/**
+* @brief Counters describing the serial transport
+*/
+typedef struct {
+    /** @brief The number of valid frames received */
+    uint32_t frames_received;
+    /** @brief The number of frames sent */
+    uint32_t frames_sent;
+    /** @brief The number of received frames dropped because of a bad CRC, bad encoding, or being too long */
+    uint32_t frame_errors;
+    /** @brief The number of received bytes dropped because the receive buffer was full */
+    uint32_t rx_overruns;
+    /** @brief The number of frames which couldn't be sent because the transmit buffer stayed full */
+    uint32_t tx_drops;
+} rnrfc_serial_stats_t;
+
+/*
+ * The transport itself is rnrfc_serial_transport in reach_transport.h, which the Reach task starts and runs.
+ * Sending blocks the Reach task for up to SERIAL_TX_TIMEOUT_MS while the transmit buffer is full.
+ */
+
+/**
+* @brief Checks whether a host has talked to the device over the serial port
+* @return True once a valid frame has been received
+*/
+bool rnrfc_serial_is_connected(void);
+
+/**
+* @brief Gets the serial transport counters
+* @return The counters, which are updated without locking and should only be used for display
+*/
+const rnrfc_serial_stats_t *rnrfc_serial_get_stats(void);
+
+#endif // _REACH_SERIAL_H_
@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2023-2024 i3 Product Development
+ * 
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file      reach_socket.c
+ * @brief     Host TCP socket transport for running the Reach integration on native_sim
+ * 
+ * @copyright (c) Copyright 2024 i3 Product Development. All Rights Reserved.
+ */
+
+#include "reach_socket.h"
+#include "reach_socket_bottom.h"
+#include "reach_transport.h"
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "reach_nrf_connect.h"
+#include "reach-server.h"
+#include "cr_stack.h"
+#include "i3_log.h"
+
+/*******************************************************************************
+ *******************************   DEFINES   ***********************************
+ ******************************************************************************/
+
+// Default define values, which can be overridden in the .h file as needed
+#ifndef SOCKET_POLL_INTERVAL_MS
+#define SOCKET_POLL_INTERVAL_MS 1
+#endif // SOCKET_POLL_INTERVAL_MS
+
+#ifndef SOCKET_TX_TIMEOUT_MS
+#define SOCKET_TX_TIMEOUT_MS 1000
+#endif // SOCKET_TX_TIMEOUT_MS
+
+// Defines only needed internally
+#define MESSAGE_MAX_SIZE (RNRFC_SOCKET_HEADER_SIZE + CR_CODED_BUFFER_SIZE)
+// Room for the message being handled and the next one, so that reads can always make progress
+#define RX_BUFFER_SIZE (2 * MESSAGE_MAX_SIZE)
+
+/*******************************************************************************
+ *********************   LOCAL FUNCTION PROTOTYPES   ***************************
+ ******************************************************************************/
+
+// Transport functions for the Reach task
+static int socket_init(void);
+static void socket_poll(void);
+static bool socket_is_active(void);
+static bool socket_is_connected(int session);
+static bool socket_receive(int session, rnrfc_prompt_t *prompt);
+static void socket_release(int session);
+static int socket_send(int session, const uint8_t *buf, size_t len, bool reply);
+static size_t socket_get_max_response_size(int session);
+static uint32_t socket_get_ack_rate(int session, uint32_t requested_rate, bool is_write);
+
+static void poll_work_handler(struct k_work *item);
+static void close_client(bool error);
+
+/*******************************************************************************
+ ***************************  LOCAL VARIABLES   ********************************
+ ******************************************************************************/
+
+// Host file descriptors, only used by the Reach task apart from the poll work item's readability check
+static int listen_fd = -1;
+static volatile int client_fd = -1;
+static rnrfc_socket_stats_t stats;
+
+// Received bytes, only used by the Reach task
+static uint8_t rx_buf[RX_BUFFER_SIZE];
+static size_t rx_length = 0;
+// The length of the message handed out by socket_receive(), including its header, or 0
+static size_t rx_consumed = 0;
+
+static uint8_t tx_buf[MESSAGE_MAX_SIZE];
+
+// Wakes the Reach task when the socket has something to read, as the host can't interrupt the simulation
+static K_WORK_DELAYABLE_DEFINE(poll_work, poll_work_handler);
+
+const rnrfc_transport_t rnrfc_socket_transport = {
+    .name = "socket",
+    .session_count = 1,
+    .init = socket_init,
+    .poll = socket_poll,
+    .is_active = socket_is_active,
+    .is_connected = socket_is_connected,
+    .receive = socket_receive,
+    .release = socket_release,
+    .send = socket_send,
+    .get_max_response_size = socket_get_max_response_size,
+    .get_ack_rate = socket_get_ack_rate,
+};
+
+/*******************************************************************************
+ **************************   GLOBAL FUNCTIONS   *******************************
+ ******************************************************************************/
+
+bool rnrfc_socket_is_connected(void)
+{
+    return client_fd >= 0;
+}
+
+const rnrfc_socket_stats_t *rnrfc_socket_get_stats(void)
+{
+    return &stats;
+}
+
+/*******************************************************************************
+ ***************************   LOCAL FUNCTIONS    ******************************
+ ******************************************************************************/
+
+static int socket_init(void)
+{
+    listen_fd = reach_socket_bottom_listen(CONFIG_REACH_SOCKET_PORT);
+    if (listen_fd < 0)
+        return -EIO;
+    k_work_reschedule(&poll_work, K_MSEC(SOCKET_POLL_INTERVAL_MS));
+    return 0;
+}
+
+static void socket_poll(void)
+{
+    if (listen_fd < 0 || client_fd >= 0)
+        return;
+    int fd = reach_socket_bottom_accept(listen_fd);
+    if (fd < 0)
+        return;
+    client_fd = fd;
+    rx_length = 0;
+    rx_consumed = 0;
+    stats.connections++;
+    I3_LOG(LOG_MASK_BLE, "Socket client connected");
+    cr_set_comm_link_connected(true);
+}
+
+static bool socket_is_active(void)
+{
+    return client_fd >= 0;
+}
+
+static bool socket_is_connected(int session)
+{
+    ARG_UNUSED(session);
+    return client_fd >= 0;
+}
+
+static bool socket_receive(int session, rnrfc_prompt_t *prompt)
+{
+    ARG_UNUSED(session);
+    if (client_fd < 0)
+        return false;
+    socket_release(session);
+
+    // Top up the buffer, but only look at one message at a time so that each session gets its turn
+    if (rx_length < sizeof(rx_buf))
+    {
+        int count = reach_socket_bottom_read(client_fd, &rx_buf[rx_length], sizeof(rx_buf) - rx_length);
+        if (count == REACH_SOCKET_CLOSED || count == REACH_SOCKET_ERROR)
+        {
+            close_client(count == REACH_SOCKET_ERROR);
+            return false;
+        }
+        if (count > 0)
+            rx_length += (size_t) count;
+    }
+    if (rx_length < RNRFC_SOCKET_HEADER_SIZE)
+        return false;
+    size_t length = sys_get_le16(rx_buf);
+    if (length == 0 || length > CR_CODED_BUFFER_SIZE)
+    {
+        LOG_ERROR("Socket message of %u bytes is invalid, disconnecting", length);
+        close_client(true);
+        return false;
+    }
+    if (rx_length < RNRFC_SOCKET_HEADER_SIZE + length)
+        return false;
+    prompt->buf = &rx_buf[RNRFC_SOCKET_HEADER_SIZE];
+    prompt->length = length;
+    prompt->timestamp = k_cycle_get_32();
+    rx_consumed = RNRFC_SOCKET_HEADER_SIZE + length;
+    stats.messages_received++;
+    return true;
+}
+
+static void socket_release(int session)
+{
+    ARG_UNUSED(session);
+    if (rx_consumed == 0)
+        return;
+    rx_length -= rx_consumed;
+    memmove(rx_buf, &rx_buf[rx_consumed], rx_length);
+    rx_consumed = 0;
+}
+
+static int socket_send(int session, const uint8_t *buf, size_t len, bool reply)
+{
+    ARG_UNUSED(session);
+    ARG_UNUSED(reply);
+    if (client_fd < 0)
+        return RNRFC_TRANSPORT_NOT_SENT;
+    if (len > CR_CODED_BUFFER_SIZE)
+        return cr_ErrorCodes_WRITE_FAILED;
+    sys_put_le16((uint16_t) len, tx_buf);
+    memcpy(&tx_buf[RNRFC_SOCKET_HEADER_SIZE], buf, len);
+    int rval = reach_socket_bottom_write(client_fd, tx_buf, RNRFC_SOCKET_HEADER_SIZE + len, SOCKET_TX_TIMEOUT_MS);
+    if (rval)
+    {
+        close_client(rval == REACH_SOCKET_ERROR);
+        return cr_ErrorCodes_WRITE_FAILED;
+    }
+    stats.messages_sent++;
+    return 0;
+}
+
+static size_t socket_get_max_response_size(int session)
+{
+    ARG_UNUSED(session);
+    return (client_fd >= 0) ? CR_CODED_BUFFER_SIZE:0;
+}
+
+static uint32_t socket_get_ack_rate(int session, uint32_t requested_rate, bool is_write)
+{
+    // TCP flow control already paces the client
+    ARG_UNUSED(session);
+    ARG_UNUSED(is_write);
+    return requested_rate;
+}
+
+static void poll_work_handler(struct k_work *item)
+{
+    ARG_UNUSED(item);
+    if (reach_socket_bottom_readable(listen_fd, client_fd))
+        rnrfc_request_processing();
+    k_work_reschedule(&poll_work, K_MSEC(SOCKET_POLL_INTERVAL_MS));
+}
+
+static void close_client(bool error)
+{
+    reach_socket_bottom_close(client_fd);
+    client_fd = -1;
+    rx_length = 0;
+    rx_consumed = 0;
+    if (error)
+        stats.errors++;
+    I3_LOG(LOG_MASK_BLE, "Socket client disconnected");
+    rnrfc_transport_session_closed(&rnrfc_socket_transport, 0);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2023-2024 i3 Product Development
+ * 
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file      reach_socket.h
+ * @brief     Host TCP socket transport for running the Reach integration on native_sim
+ * 
+ * @copyright (c) Copyright 2024 i3 Product Development. All Rights Reserved.
+ */
+
+#ifndef _REACH_SOCKET_H_
+#define _REACH_SOCKET_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * On native_sim, the device listens on 127.0.0.1 port CONFIG_REACH_SOCKET_PORT for a single client.  Each Reach message
+ * in either direction is a 2 byte little-endian length followed by the coded message.  TCP already provides ordering
+ * and integrity, so there is no other framing.  A message longer than CR_CODED_BUFFER_SIZE, or of length 0, closes the
+ * connection.  The client gets its own session, and the device listens for a new one as soon as it disconnects.
+ */
+
+#ifdef _DOXYGEN_
+    /** @brief How often the socket is checked for new connections and data while the Reach task is idle */
+    #define SOCKET_POLL_INTERVAL_MS 1
+
+    /** @brief How long sending a message can block before the client is considered stuck and is disconnected */
+    #define SOCKET_TX_TIMEOUT_MS 1000
+#endif
+
+// To change any of the defines described above, define them here
+
+/** @brief The number of bytes before each message, holding its length */
+#define RNRFC_SOCKET_HEADER_SIZE 2
+
+/**
+* @brief Counters describing the socket transport
+*/
+typedef struct {
+    /** @brief The number of clients which have connected */
+    uint32_t connections;
+    /** @brief The number of messages received */
+    uint32_t messages_received;
+    /** @brief The number of messages sent */
+    uint32_t messages_sent;
+    /** @brief The number of connections closed because of a bad length or a failed send */
+    uint32_t errors;
+} rnrfc_socket_stats_t;
+
+/**
+* @brief Checks whether a client is connected to the socket
+* @return True while a client is connected
+*/
+bool rnrfc_socket_is_connected(void);
+
+/**
+* @brief Gets the socket transport counters
+* @return The counters, which are updated without locking and should only be used for display
+*/
+const rnrfc_socket_stats_t *rnrfc_socket_get_stats(void);
+
+#endif // _REACH_SOCKET_H_
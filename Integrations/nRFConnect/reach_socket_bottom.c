@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2023-2024 i3 Product Development
+ * 
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file      reach_socket_bottom.c
+ * @brief     Host side of the native_sim socket transport, built against the host C library
+ * 
+ * @copyright (c) Copyright 2024 i3 Product Development. All Rights Reserved.
+ */
+
+#include "reach_socket_bottom.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/*******************************************************************************
+ *********************   LOCAL FUNCTION PROTOTYPES   ***************************
+ ******************************************************************************/
+
+static int set_non_blocking(int fd);
+
+/*******************************************************************************
+ **************************   GLOBAL FUNCTIONS   *******************************
+ ******************************************************************************/
+
+int reach_socket_bottom_listen(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("Reach socket");
+        return REACH_SOCKET_ERROR;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short) port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0 || set_non_blocking(fd) < 0)
+    {
+        perror("Reach socket");
+        close(fd);
+        return REACH_SOCKET_ERROR;
+    }
+    printf("Reach socket listening on 127.0.0.1:%d\n", port);
+    return fd;
+}
+
+int reach_socket_bottom_accept(int listen_fd)
+{
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return REACH_SOCKET_WOULD_BLOCK;
+        perror("Reach socket accept");
+        return REACH_SOCKET_ERROR;
+    }
+    // Small messages are the norm, so don't let Nagle hold them back waiting for more
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (set_non_blocking(fd) < 0)
+    {
+        perror("Reach socket accept");
+        close(fd);
+        return REACH_SOCKET_ERROR;
+    }
+    return fd;
+}
+
+int reach_socket_bottom_readable(int listen_fd, int client_fd)
+{
+    // Another client waiting to be accepted is no reason to wake up while there is already one, as it won't be accepted
+    struct pollfd fd = { .fd = (client_fd >= 0) ? client_fd:listen_fd, .events = POLLIN };
+    return (poll(&fd, 1, 0) > 0) ? 1:0;
+}
+
+int reach_socket_bottom_read(int fd, void *buf, size_t len)
+{
+    ssize_t count = recv(fd, buf, len, 0);
+    if (count > 0)
+        return (int) count;
+    if (count == 0)
+        return REACH_SOCKET_CLOSED;
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return REACH_SOCKET_WOULD_BLOCK;
+    if (errno == ECONNRESET)
+        return REACH_SOCKET_CLOSED;
+    perror("Reach socket read");
+    return REACH_SOCKET_ERROR;
+}
+
+int reach_socket_bottom_write(int fd, const void *buf, size_t len, int timeout_ms)
+{
+    const char *data = (const char *) buf;
+    while (len > 0)
+    {
+        ssize_t count = send(fd, data, len, MSG_NOSIGNAL);
+        if (count > 0)
+        {
+            data += count;
+            len -= (size_t) count;
+            continue;
+        }
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            // This blocks the whole simulation, which is what a slow client would do to the real device's BLE task anyway
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            if (poll(&pfd, 1, timeout_ms) <= 0)
+                return REACH_SOCKET_ERROR;
+            continue;
+        }
+        if (count < 0 && (errno == EPIPE || errno == ECONNRESET))
+            return REACH_SOCKET_CLOSED;
+        perror("Reach socket write");
+        return REACH_SOCKET_ERROR;
+    }
+    return 0;
+}
+
+void reach_socket_bottom_close(int fd)
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+/*******************************************************************************
+ ***************************   LOCAL FUNCTIONS    ******************************
+ ******************************************************************************/
+
+static int set_non_blocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
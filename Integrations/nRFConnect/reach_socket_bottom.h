@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2023-2024 i3 Product Development
+ * 
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file      reach_socket_bottom.h
+ * @brief     Host side of the native_sim socket transport
+ * 
+ * @copyright (c) Copyright 2024 i3 Product Development. All Rights Reserved.
+ */
+
+#ifndef _REACH_SOCKET_BOTTOM_H_
+#define _REACH_SOCKET_BOTTOM_H_
+
+#include <stddef.h>
+
+/*
+ * These functions are built against the host C library rather than Zephyr's, as native_sim requires for anything
+ * which makes host system calls, so this header can't use any Zephyr or host types.  File descriptors are host ones.
+ */
+
+/** @brief Nothing is available without blocking */
+#define REACH_SOCKET_WOULD_BLOCK -1
+/** @brief The peer has closed the connection */
+#define REACH_SOCKET_CLOSED -2
+/** @brief Any other host error, which has already been printed */
+#define REACH_SOCKET_ERROR -3
+
+/**
+* @brief Opens a non-blocking TCP socket listening on the loopback interface
+* @param port The port to listen on
+* @return The listening file descriptor, or REACH_SOCKET_ERROR
+*/
+int reach_socket_bottom_listen(int port);
+
+/**
+* @brief Accepts a waiting client without blocking
+* @param listen_fd The file descriptor from reach_socket_bottom_listen()
+* @return The client's file descriptor, REACH_SOCKET_WOULD_BLOCK, or REACH_SOCKET_ERROR
+*/
+int reach_socket_bottom_accept(int listen_fd);
+
+/**
+* @brief Checks without blocking whether the client has something to read or, if there is no client, whether one is waiting to be accepted
+* @param listen_fd The listening file descriptor, only checked if there is no client
+* @param client_fd The client's file descriptor, or -1 if there isn't one
+* @return 1 if there is something to read, otherwise 0
+*/
+int reach_socket_bottom_readable(int listen_fd, int client_fd);
+
+/**
+* @brief Reads whatever is available without blocking
+* @return The number of bytes read, REACH_SOCKET_WOULD_BLOCK, REACH_SOCKET_CLOSED, or REACH_SOCKET_ERROR
+*/
+int reach_socket_bottom_read(int fd, void *buf, size_t len);
+
+/**
+* @brief Writes all of a buffer, waiting for the peer to make room if needed
+* @param timeout_ms How long to wait for room before giving up
+* @return 0 on success, REACH_SOCKET_CLOSED, or REACH_SOCKET_ERROR
+*/
+int reach_socket_bottom_write(int fd, const void *buf, size_t len, int timeout_ms);
+
+/**
+* @brief Closes a file descriptor
+*/
+void reach_socket_bottom_close(int fd);
+
+#endif // _REACH_SOCKET_BOTTOM_H_
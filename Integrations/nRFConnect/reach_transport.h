@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2023-2024 i3 Product Development
+ * 
+ * MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file      reach_transport.h
+ * @brief     Interface between the Reach task and the links which carry Reach messages
+ * 
+ * @copyright (c) Copyright 2024 i3 Product Development. All Rights Reserved.
+ */
+
+#ifndef _REACH_TRANSPORT_H_
+#define _REACH_TRANSPORT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "reach_nrf_connect.h"
+
+// Needed by the transports as well as the Reach task, as it changes what get_ack_rate() should return
+#ifndef ACK_RATE_ADAPTIVE
+#define ACK_RATE_ADAPTIVE 1
+#endif // ACK_RATE_ADAPTIVE
+
+/*
+ * Each transport owns a fixed number of sessions, numbered from 0 within the transport.  The Reach task gives every
+ * transport's sessions a range of the global session numbers returned by rnrfc_get_active_session(), in the order
+ * BLE, serial, socket, and calls the functions below with the transport's own session number.
+ * Apart from init(), is_active() and is_connected(), they are only called from the Reach task.
+ */
+
+/**
+* @brief A coded Reach prompt which has been received by a transport
+*/
+typedef struct {
+    /** @brief The coded prompt, which must stay valid until the transport's release() is called */
+    const uint8_t *buf;
+    /** @brief The length of the prompt in bytes */
+    size_t length;
+    /** @brief Cycle count when the prompt was received, used for the latency statistics */
+    uint32_t timestamp;
+} rnrfc_prompt_t;
+
+/**
+* @brief A session's own flow control counters, which the adaptive acknowledgement rate compares between transfers
+*/
+typedef struct {
+    /** @brief File data lost: incoming prompts dropped, or outgoing messages which failed */
+    atomic_val_t drops;
+    /** @brief File data held up: waits for space in the write buffer or the outgoing queue */
+    atomic_val_t waits;
+} rnrfc_flow_counters_t;
+
+/** @brief Returned by send() when the session has no one to receive the message, which isn't an error */
+#define RNRFC_TRANSPORT_NOT_SENT (-1)
+
+/**
+* @brief The functions a transport provides to the Reach task
+*/
+typedef struct {
+    /** @brief A short name for logging */
+    const char *name;
+    /** @brief The number of sessions the transport can have */
+    int session_count;
+    /** @brief Starts the transport, returning 0 on success */
+    int (*init)(void);
+    /** @brief Optional, called on every wakeup of the Reach task to handle connection changes */
+    void (*poll)(void);
+    /** @brief Checks whether any session is connected or has data waiting, which keeps the Reach task running */
+    bool (*is_active)(void);
+    /** @brief Checks whether a session is connected */
+    bool (*is_connected)(int session);
+    /** @brief Gets the next prompt for a session, if there is one */
+    bool (*receive)(int session, rnrfc_prompt_t *prompt);
+    /** @brief Optional, hands the last prompt from receive() back once the stack is done with it */
+    void (*release)(int session);
+    /** @brief Sends a coded message, either as the reply to the session's last prompt or unsolicited.
+     * Returns 0 once it is sent or queued, RNRFC_TRANSPORT_NOT_SENT, or a Reach error code. */
+    int (*send)(int session, const uint8_t *buf, size_t len, bool reply);
+    /** @brief Optional, called at the end of each processing pass to push out anything queued */
+    void (*flush)(void);
+    /** @brief Gets the largest message which can be sent to a session in one go, or 0 if it is not connected */
+    size_t (*get_max_response_size)(int session);
+    /** @brief Gets the highest file transfer acknowledgement rate a session can use.
+     * With ACK_RATE_ADAPTIVE, the Reach task offers a rate at or below this depending on how earlier transfers went. */
+    uint32_t (*get_ack_rate)(int session, uint32_t requested_rate, bool is_write);
+    /** @brief Optional, gets the session's flow control counters for incoming (is_write) or outgoing file data.
+     * Without it, the adaptive acknowledgement rate only backs off for storage stalls. */
+    void (*get_flow_counters)(int session, bool is_write, rnrfc_flow_counters_t *counters);
+} rnrfc_transport_t;
+
+#ifdef CONFIG_BT
+/** @brief GATT and L2CAP, one session per connection */
+extern const rnrfc_transport_t rnrfc_ble_transport;
+#endif // CONFIG_BT
+#ifdef CONFIG_REACH_SERIAL_TRANSPORT
+/** @brief COBS framed messages on a UART, see reach_serial.h */
+extern const rnrfc_transport_t rnrfc_serial_transport;
+#endif // CONFIG_REACH_SERIAL_TRANSPORT
+#ifdef CONFIG_REACH_SOCKET_TRANSPORT
+/** @brief Length prefixed messages on a host TCP socket, see reach_socket.h */
+extern const rnrfc_transport_t rnrfc_socket_transport;
+#endif // CONFIG_REACH_SOCKET_TRANSPORT
+
+/** @brief The counters returned by rnrfc_get_stats(), which transports update directly */
+extern rnrfc_stats_t rnrfc_stats;
+
+/**
+* @brief Tells the Reach task that a session has gone away
+* @note This must be called from the Reach task, such as from a transport's poll() or receive()
+* @param transport The transport which owns the session
+* @param session The transport's own session number
+*/
+void rnrfc_transport_session_closed(const rnrfc_transport_t *transport, int session);
+
+/**
+* @brief Counts the sessions which have a client connected, on every transport
+* @note This must be called from the Reach task
+* @return The number of connected sessions
+*/
+int rnrfc_transport_count_connected(void);
+
+#endif // _REACH_TRANSPORT_H_
@@ -44,7 +44,7 @@
 /* User code end [commands.h: User Includes] */
 
 // Defines
-#define NUM_COMMANDS 6
+#define NUM_COMMANDS 9
 
 /* User code start [commands.h: User Defines] */
 /* User code end [commands.h: User Defines] */
@@ -57,6 +57,9 @@ typedef enum {
     COMMAND_RESET_DEFAULTS,
     COMMAND_INVALIDATE_OTA_IMAGE,
     COMMAND_CLICK_FOR_WISDOM,
+    COMMAND_BENCHMARK_STREAM,
+    COMMAND_BENCHMARK_ECHO,
+    COMMAND_BENCHMARK_SINK,
 } command_t;
 
 /* User code start [commands.h: User Data Types] */
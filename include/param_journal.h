@@ -0,0 +1,90 @@
+/********************************************************************************************
+ *
+ * \date   2024
+ *
+ * \author i3 Product Development (JNP)
+ *
+ * \brief  Append-only journal which stores the NVM parameters in the PR file
+ *
+ ********************************************************************************************/
+
+#ifndef _PARAM_JOURNAL_H_
+#define _PARAM_JOURNAL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "parameters.h"
+
+// The journal file, and the file a compacted copy is written to before replacing it
+#ifndef PARAM_JOURNAL_FILE
+#define PARAM_JOURNAL_FILE "/lfs/pr"
+#endif // PARAM_JOURNAL_FILE
+#ifndef PARAM_JOURNAL_COMPACT_FILE
+#define PARAM_JOURNAL_COMPACT_FILE "/lfs/pr.new"
+#endif // PARAM_JOURNAL_COMPACT_FILE
+
+// How many bytes of superseded records the journal can hold before it is compacted
+#ifndef PARAM_JOURNAL_COMPACT_THRESHOLD
+#define PARAM_JOURNAL_COMPACT_THRESHOLD 4096
+#endif // PARAM_JOURNAL_COMPACT_THRESHOLD
+
+// The largest record payload, and how many different IDs, that the journal accepts
+#ifndef PARAM_JOURNAL_MAX_PAYLOAD
+#define PARAM_JOURNAL_MAX_PAYLOAD 40
+#endif // PARAM_JOURNAL_MAX_PAYLOAD
+#ifndef PARAM_JOURNAL_MAX_RECORDS
+#define PARAM_JOURNAL_MAX_RECORDS NUM_NVM_PARAMS
+#endif // PARAM_JOURNAL_MAX_RECORDS
+
+/**
+ * Maps a record ID to its place in the journal's index
+ * @param id The ID of a record
+ * @return The index, below PARAM_JOURNAL_MAX_RECORDS, or a negative value if the ID isn't stored
+ */
+typedef int (*param_journal_index_fn_t)(uint16_t id);
+
+typedef struct {
+    uint32_t file_size;     // Bytes in the journal file
+    uint32_t live_size;     // Bytes in the journal file which hold the latest record for a parameter
+    uint32_t appends;       // Records appended since boot
+    uint32_t compactions;   // Compactions since boot
+} param_journal_stats_t;
+
+/**
+ * Opens the journal and builds the index of the latest record for each ID.  A journal for a different hash is
+ * discarded, and any incomplete record at the end of the journal is removed.  Records for IDs without an index are
+ * dropped when the journal is next compacted.
+ * @param hash A hash of the stored parameters' descriptions, which the journal must match to be used
+ * @param index_from_id Maps each ID to its place in the index, and must be ready before this is called
+ * @return 0 on success, or a negative error code on file system error
+ */
+int param_journal_init(uint32_t hash, param_journal_index_fn_t index_from_id);
+
+/**
+ * Gets the payload of the latest record for an ID
+ * @param id The ID to look for
+ * @param payload A pointer to the buffer to fill with the payload
+ * @param size A pointer to the size of the provided buffer, which will be updated to the size of the payload
+ * @return 0 on success, -ENOENT if there is no record for this ID, or another negative error code on failure
+ */
+int param_journal_read(uint16_t id, void *payload, size_t *size);
+
+/**
+ * Appends a record to the journal, replacing any earlier record for the same ID.  Compaction is scheduled on the
+ * system work queue once enough of the journal has been replaced.
+ * @param id The ID of the record
+ * @param payload A pointer to the payload of the record
+ * @param size The size of the payload, up to PARAM_JOURNAL_MAX_PAYLOAD
+ * @return 0 once the record is committed to the file system, -EINVAL if the ID isn't stored or the payload is too
+ *         large, or another negative error code on failure
+ */
+int param_journal_append(uint16_t id, const void *payload, size_t size);
+
+/**
+ * Gets the size of the journal and counts of its activity since boot
+ * @param stats A pointer to the structure to fill
+ */
+void param_journal_get_stats(param_journal_stats_t *stats);
+
+#endif // _PARAM_JOURNAL_H_
@@ -44,14 +44,17 @@
 #include <stdint.h>
 
 /* User code start [parameters.h: User Includes] */
+#include <stddef.h>
 /* User code end [parameters.h: User Includes] */
 
 // Defines
-#define NUM_PARAMS 11
-#define NUM_DEFAULT_PARAMETER_NOTIFICATIONS 8
-#define NUM_EX_PARAMS 3
+#define NUM_PARAMS 34
+#define NUM_DEFAULT_PARAMETER_NOTIFICATIONS 16
+#define NUM_EX_PARAMS 4
 
 /* User code start [parameters.h: User Defines] */
+// The number of parameters with an NVM storage location in the definitions, which sizes the NVM cache and the PR journal
+#define NUM_NVM_PARAMS 4
 /* User code end [parameters.h: User Defines] */
 
 // Data Types
@@ -67,12 +70,36 @@ typedef enum {
     PARAM_RGB_LED_COLOR,
     PARAM_IDENTIFY,
     PARAM_IDENTIFY_INTERVAL,
+    PARAM_CONNECTION_INTERVAL,
+    PARAM_PERIPHERAL_LATENCY,
+    PARAM_SUPERVISION_TIMEOUT,
+    PARAM_CONNECTION_PARAMETER_SWITCHES,
+    PARAM_BLE_PHY,
+    PARAM_TX_DATA_LENGTH,
+    PARAM_TX_DATA_TIME,
+    PARAM_RX_DATA_LENGTH,
+    PARAM_RX_DATA_TIME,
+    PARAM_BENCH_COUNT,
+    PARAM_BENCH_SIZE,
+    PARAM_BENCH_THROUGHPUT,
+    PARAM_BENCH_RTT_P50,
+    PARAM_BENCH_RTT_P99,
+    PARAM_BENCH_NOTIFY_FAILURES,
+    PARAM_RSSI = 40,
+    PARAM_ATT_MTU,
+    PARAM_NOTIFICATIONS_SENT,
+    PARAM_NOTIFICATIONS_FAILED,
+    PARAM_WRITE_BUFFER_HIGH_WATER,
+    PARAM_WRITE_BUFFER_DROPS,
+    PARAM_BYTES_IN_RATE,
+    PARAM_BYTES_OUT_RATE,
 } param_t;
 
 typedef enum {
     PARAM_EI_IDENTIFY_LED,
     PARAM_EI_RGB_LED_STATE,
     PARAM_EI_RGB_LED_COLOR,
+    PARAM_EI_BLE_PHY,
 } param_ei_t;
 
 typedef enum {
@@ -98,6 +125,12 @@ typedef enum {
     RGB_LED_COLOR_WHITE,
 } rgb_led_color_t;
 
+typedef enum {
+    BLE_PHY_1M,
+    BLE_PHY_2M,
+    BLE_PHY_CODED,
+} ble_phy_t;
+
 /* User code start [parameters.h: User Data Types] */
 /* User code end [parameters.h: User Data Types] */
 
@@ -112,6 +145,9 @@ const char *parameters_get_ei_label(int32_t pei_id, uint32_t enum_bit_position);
 
 /* User code start [parameters.h: User Global Functions] */
 int parameters_reset_nvm(void);
+void parameters_flush_nvm(void);
+void parameters_request_nvm_flush(void);
+void parameters_get_nvm_cache_stats(uint32_t *writes, uint32_t *saved);
 /* User code end [parameters.h: User Global Functions] */
 
 
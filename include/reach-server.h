@@ -42,15 +42,16 @@
 // A range of parameters are driven by the 244 byte packet size imposed by BLE.
 
 
-// As the app is using BLE, the largest encoded buffer cannot be larger than 
-// 244 bytes.  The Reach stack will statically allocate two buffers of this size, 
-// for encoding and decoding
-#define CR_CODED_BUFFER_SIZE    244
+// The largest encoded message, set by CONFIG_REACH_MAX_MESSAGE_SIZE.  Messages which
+// don't fit in a single BLE notification (244 bytes at most) are split into segments
+// by the BLE integration.  The Reach stack will statically allocate two buffers of
+// this size, for encoding and decoding
+#define CR_CODED_BUFFER_SIZE    CONFIG_REACH_MAX_MESSAGE_SIZE
 
 // The raw data that encodes to BLE might be slightly larger.
 // The Reach stack will allocate one buffer of this size, for decoding the prompt.
 // The app is to provide the raw memory to be encoded.
-#define CR_DECODED_BUFFER_SIZE   256
+#define CR_DECODED_BUFFER_SIZE   (CR_CODED_BUFFER_SIZE + 12)
 
 #define APP_ADVERTISED_NAME_LENGTH 30
 
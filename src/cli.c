@@ -46,13 +46,25 @@
 
 /* User code start [cli.c: User Includes] */
 #include <zephyr/kernel.h>
+#ifdef CONFIG_BT
 #include <zephyr/bluetooth/bluetooth.h>
+#endif // CONFIG_BT
 #include <zephyr/drivers/uart.h>
 #include <zephyr/fs/fs.h>
 #include <ncs_version.h>
 
 #include "app_version.h"
 #include "main.h"
+#include "param_journal.h"
+#include "parameters.h"
+#include "reach_nrf_connect.h"
+#include "reach_conn_policy.h"
+#ifdef CONFIG_REACH_SERIAL_TRANSPORT
+#include "reach_serial.h"
+#endif // CONFIG_REACH_SERIAL_TRANSPORT
+#ifdef CONFIG_REACH_SOCKET_TRANSPORT
+#include "reach_socket.h"
+#endif // CONFIG_REACH_SOCKET_TRANSPORT
 /* User code end [cli.c: User Includes] */
 
 /********************************************************************************************
@@ -109,7 +121,12 @@ static uint8_t sInputLength = 0;
 static K_THREAD_STACK_DEFINE(sCliTaskStackArea, CLI_TASK_STACK_SIZE);
 static struct k_thread sCliTaskData;
 k_tid_t sCliTaskId;
+#if DT_HAS_COMPAT_STATUS_OKAY(zephyr_cdc_acm_uart)
 static const struct device *sUartDevice = DEVICE_DT_GET_ONE(zephyr_cdc_acm_uart);
+#else
+// Such as native_sim, where the console is the first pty UART
+static const struct device *sUartDevice = DEVICE_DT_GET(DT_CHOSEN(zephyr_console));
+#endif
 /* User code end [cli.c: User Local/Extern Variables] */
 
 /********************************************************************************************
@@ -202,6 +219,10 @@ int crcb_cli_enter(const char *ins)
         i3_log(LOG_MASK_ALWAYS, "  /: Display status");
         i3_log(LOG_MASK_ALWAYS, "  lm (<new log mask>): Print current log mask, or set a new log mask");
         /* User code start [CLI: Custom help handling] */
+        i3_log(LOG_MASK_ALWAYS, "  link: Print BLE connection parameters, PHY and data length");
+#ifdef CONFIG_REACH_BONDING
+        i3_log(LOG_MASK_ALWAYS, "  unpair: Delete all bonds");
+#endif // CONFIG_REACH_BONDING
         /* User code end [CLI: Custom help handling] */
         return 0;
     }
@@ -227,6 +248,20 @@ int crcb_cli_enter(const char *ins)
         /* User code end [CLI: 'lm' handler] */
     }
     /* User code start [CLI: Custom command handling] */
+    else if (!strncmp("link", ins, 4))
+    {
+        rnrfc_conn_policy_print();
+    }
+#ifdef CONFIG_REACH_BONDING
+    else if (!strncmp("unpair", ins, 6))
+    {
+        int rval = bt_unpair(BT_ID_DEFAULT, BT_ADDR_LE_ANY);
+        if (rval)
+            i3_log(LOG_MASK_ERROR, "Failed to delete bonds, error %d", rval);
+        else
+            i3_log(LOG_MASK_ALWAYS, "All bonds deleted");
+    }
+#endif // CONFIG_REACH_BONDING
     /* User code end [CLI: Custom command handling] */
     else
         i3_log(LOG_MASK_WARN, "CLI command '%s' not recognized.", ins, *ins);
@@ -314,15 +349,90 @@ static void slash(void)
     }
 
     // System information
+#ifdef CONFIG_BT
     bt_addr_le_t ble_id;
     size_t id_count = 1;
     bt_id_get(&ble_id, &id_count);
     i3_log(LOG_MASK_ALWAYS, "BLE Device Address: %02X:%02X:%02X:%02X:%02X:%02X",
         ble_id.a.val[5], ble_id.a.val[4], ble_id.a.val[3], ble_id.a.val[2], ble_id.a.val[1], ble_id.a.val[0]);
+#endif // CONFIG_BT
     i3_log(LOG_MASK_ALWAYS, "Uptime: %.3f seconds", ((float) k_uptime_get()) / 1000);
 
     // Reach information
     i3_log(LOG_MASK_ALWAYS, "Current log mask: 0x%x", i3_log_get_mask());
+    param_journal_stats_t journal;
+    param_journal_get_stats(&journal);
+    i3_log(LOG_MASK_ALWAYS, "PR journal: %u bytes (%u live), %u appends, %u compactions",
+        journal.file_size, journal.live_size, journal.appends, journal.compactions);
+    uint32_t nvm_writes, nvm_saved;
+    parameters_get_nvm_cache_stats(&nvm_writes, &nvm_saved);
+    i3_log(LOG_MASK_ALWAYS, "NVM parameter writes: %u cached, %u saved", nvm_writes, nvm_saved);
+
+    // BLE task statistics
+    const rnrfc_stats_t *stats = rnrfc_get_stats();
+    uint32_t prompts = (uint32_t) atomic_get(&stats->prompts_processed);
+    i3_log(LOG_MASK_ALWAYS, "BLE task: %u wakeups (%u timer), %u process passes",
+        (uint32_t) atomic_get(&stats->task_wakeups), (uint32_t) atomic_get(&stats->task_timer_wakeups), (uint32_t) atomic_get(&stats->process_passes));
+    i3_log(LOG_MASK_ALWAYS, "Prompts: %u processed, latency %u us average, %u us max", prompts,
+        prompts ? ((uint32_t) atomic_get(&stats->prompt_latency_total_us) / prompts):0, (uint32_t) atomic_get(&stats->prompt_latency_max_us));
+    i3_log(LOG_MASK_ALWAYS, "Write buffer: %u high water, %u waits for space, %u dropped",
+        (uint32_t) atomic_get(&stats->ingress_high_water), (uint32_t) atomic_get(&stats->ingress_full_waits), (uint32_t) atomic_get(&stats->ingress_drops));
+    uint32_t notifications = (uint32_t) atomic_get(&stats->notify_completed);
+    i3_log(LOG_MASK_ALWAYS, "Notifications: %u sent, %u completed, %u failed, %u queued (%u high water, %u waits)",
+        (uint32_t) atomic_get(&stats->notify_sent), notifications, (uint32_t) atomic_get(&stats->notify_failed),
+        (uint32_t) atomic_get(&stats->notify_queue_depth), (uint32_t) atomic_get(&stats->notify_queue_high_water), (uint32_t) atomic_get(&stats->notify_queue_waits));
+    uint32_t received_per_second, sent_per_second;
+    rnrfc_get_throughput(&received_per_second, &sent_per_second);
+    i3_log(LOG_MASK_ALWAYS, "Throughput: %u bytes/s in (%u total), %u bytes/s out (%u total)",
+        received_per_second, (uint32_t) atomic_get(&stats->bytes_received), sent_per_second, (uint32_t) atomic_get(&stats->bytes_sent));
+#ifdef CONFIG_BT
+    for (int i = 0; i < RNRFC_MAX_BLE_SESSIONS; i++)
+    {
+        rnrfc_conn_params_t params;
+        if (rnrfc_conn_policy_get_params(i, &params) || params.interval == 0)
+            continue;
+        int8_t rssi = 0;
+        rnrfc_conn_policy_read_rssi(i, &rssi);
+        i3_log(LOG_MASK_ALWAYS, "BLE session %d: RSSI %d dBm, interval %u.%02u ms, %s PHY, ATT MTU %u", i, rssi,
+            (params.interval * 125) / 100, (params.interval * 125) % 100,
+            (params.tx_phy == BT_GAP_LE_PHY_2M) ? "2M":((params.tx_phy == BT_GAP_LE_PHY_CODED) ? "Coded":"1M"), params.mtu);
+    }
+#endif // CONFIG_BT
+    i3_log(LOG_MASK_ALWAYS, "Notification latency: %u us average, %u us max",
+        notifications ? ((uint32_t) atomic_get(&stats->notify_latency_total_us) / notifications):0, (uint32_t) atomic_get(&stats->notify_latency_max_us));
+    i3_log(LOG_MASK_ALWAYS, "Segments: %u received, %u sent, %u errors",
+        (uint32_t) atomic_get(&stats->sar_segments_received), (uint32_t) atomic_get(&stats->sar_segments_sent), (uint32_t) atomic_get(&stats->sar_errors));
+    i3_log(LOG_MASK_ALWAYS, "Batches: %u messages in %u notifications",
+        (uint32_t) atomic_get(&stats->batch_messages), (uint32_t) atomic_get(&stats->batch_notifications));
+#ifdef CONFIG_BT
+    uint32_t new_clients = (uint32_t) atomic_get(&stats->first_prompt_new_count);
+    uint32_t returning_clients = (uint32_t) atomic_get(&stats->first_prompt_returning_count);
+    i3_log(LOG_MASK_ALWAYS, "Connection to first prompt: %u ms average for %u new clients, %u ms for %u returning",
+        new_clients ? ((uint32_t) atomic_get(&stats->first_prompt_new_total_ms) / new_clients):0, new_clients,
+        returning_clients ? ((uint32_t) atomic_get(&stats->first_prompt_returning_total_ms) / returning_clients):0, returning_clients);
+#endif // CONFIG_BT
+    i3_log(LOG_MASK_ALWAYS, "Resumed sessions: %u, refused: %u",
+        (uint32_t) atomic_get(&stats->resume_hits), (uint32_t) atomic_get(&stats->resume_misses));
+#ifdef CONFIG_REACH_CONN_EVENT_SYNC
+    i3_log(LOG_MASK_ALWAYS, "Radio event wakeups: %u", (uint32_t) atomic_get(&stats->conn_event_wakeups));
+#endif // CONFIG_REACH_CONN_EVENT_SYNC
+    i3_log(LOG_MASK_ALWAYS, "File ack rate: %u write, %u read, %u backoffs, %u storage stalls",
+        (uint32_t) atomic_get(&stats->ack_rate_write), (uint32_t) atomic_get(&stats->ack_rate_read),
+        (uint32_t) atomic_get(&stats->ack_rate_backoffs), (uint32_t) atomic_get(&stats->storage_stalls));
+    i3_log(LOG_MASK_ALWAYS, "L2CAP SDUs: %u received, %u sent",
+        (uint32_t) atomic_get(&stats->l2cap_sdus_received), (uint32_t) atomic_get(&stats->l2cap_sdus_sent));
+#ifdef CONFIG_REACH_SERIAL_TRANSPORT
+    const rnrfc_serial_stats_t *serial = rnrfc_serial_get_stats();
+    i3_log(LOG_MASK_ALWAYS, "Serial frames: %u received, %u sent, %u errors, %u bytes overrun, %u dropped (%s)",
+        serial->frames_received, serial->frames_sent, serial->frame_errors, serial->rx_overruns, serial->tx_drops,
+        rnrfc_serial_is_connected() ? "connected":"waiting");
+#endif // CONFIG_REACH_SERIAL_TRANSPORT
+#ifdef CONFIG_REACH_SOCKET_TRANSPORT
+    const rnrfc_socket_stats_t *sock = rnrfc_socket_get_stats();
+    i3_log(LOG_MASK_ALWAYS, "Socket messages: %u received, %u sent, %u connections, %u errors (%s)",
+        sock->messages_received, sock->messages_sent, sock->connections, sock->errors,
+        rnrfc_socket_is_connected() ? "connected":"waiting");
+#endif // CONFIG_REACH_SOCKET_TRANSPORT
 }
 
 static void lm(const char *input)
@@ -47,7 +47,14 @@
 
 /* User code start [commands.c: User Includes] */
 #include <zephyr/kernel.h>
+#ifdef CONFIG_ARCH_POSIX
+#include <zephyr/sys/reboot.h>
+#endif // CONFIG_ARCH_POSIX
 #include "parameters.h"
+#include "reach_nrf_connect.h"
+#ifdef CONFIG_REACH_BENCHMARK
+#include "reach_benchmark.h"
+#endif // CONFIG_REACH_BENCHMARK
 /* User code end [commands.c: User Includes] */
 
 /********************************************************************************************
@@ -83,13 +90,15 @@ typedef enum
  *******************************************************************************************/
 
 /* User code start [commands.c: User Local Function Declarations] */
+static int start_benchmark(const uint8_t cid);
 /* User code end [commands.c: User Local Function Declarations] */
 
 /********************************************************************************************
  ******************************     Local/Extern Variables     ******************************
  *******************************************************************************************/
 
-static int sCommandIndex = 0;
+// Discovery progress is kept separately for each connected client
+static int sCommandIndex[RNRFC_MAX_SESSIONS];
 static const cr_CommandInfo sCommandDescriptions[] = {
     {
         .id = COMMAND_PRESET_NOTIFICATIONS_ON,
@@ -128,6 +137,24 @@ static const cr_CommandInfo sCommandDescriptions[] = {
         .name = "Click for Wisdom",
         .has_description = true,
         .description = "Press it and find out"
+    },
+    {
+        .id = COMMAND_BENCHMARK_STREAM,
+        .name = "Benchmark Stream",
+        .has_description = true,
+        .description = "Notify Bench Count messages"
+    },
+    {
+        .id = COMMAND_BENCHMARK_ECHO,
+        .name = "Benchmark Echo",
+        .has_description = true,
+        .description = "Time Bench Count round trips"
+    },
+    {
+        .id = COMMAND_BENCHMARK_SINK,
+        .name = "Benchmark Sink",
+        .has_description = true,
+        .description = "Accept Bench Count writes"
     }
 };
 
@@ -162,48 +189,50 @@ int crcb_get_command_count()
 
 int crcb_command_discover_next(cr_CommandInfo *cmd_desc)
 {
-    if (sCommandIndex >= NUM_COMMANDS)
+    int session = rnrfc_get_active_session();
+    if (sCommandIndex[session] >= NUM_COMMANDS)
     {
-        I3_LOG(LOG_MASK_REACH, "%s: Command index %d indicates discovery complete.", __FUNCTION__, sCommandIndex);
+        I3_LOG(LOG_MASK_REACH, "%s: Command index %d indicates discovery complete.", __FUNCTION__, sCommandIndex[session]);
         return cr_ErrorCodes_NO_DATA;
     }
 
-    while (!crcb_access_granted(cr_ServiceIds_COMMANDS, sCommandDescriptions[sCommandIndex].id))
+    while (!crcb_access_granted(cr_ServiceIds_COMMANDS, sCommandDescriptions[sCommandIndex[session]].id))
     {
-        I3_LOG(LOG_MASK_FILES, "%s: sCommandIndex (%d) skip, access not granted", __FUNCTION__, sCommandIndex);
-        sCommandIndex++;
-        if (sCommandIndex >= NUM_COMMANDS)
+        I3_LOG(LOG_MASK_FILES, "%s: sCommandIndex (%d) skip, access not granted", __FUNCTION__, sCommandIndex[session]);
+        sCommandIndex[session]++;
+        if (sCommandIndex[session] >= NUM_COMMANDS)
         {
-            I3_LOG(LOG_MASK_PARAMS, "%s: skipped to sCommandIndex (%d) >= NUM_COMMANDS (%d)", __FUNCTION__, sCommandIndex, NUM_COMMANDS);
+            I3_LOG(LOG_MASK_PARAMS, "%s: skipped to sCommandIndex (%d) >= NUM_COMMANDS (%d)", __FUNCTION__, sCommandIndex[session], NUM_COMMANDS);
             return cr_ErrorCodes_NO_DATA;
         }
     }
-    *cmd_desc = sCommandDescriptions[sCommandIndex++];
+    *cmd_desc = sCommandDescriptions[sCommandIndex[session]++];
     return 0;
 }
 
 int crcb_command_discover_reset(const uint32_t cid)
 {
+    int session = rnrfc_get_active_session();
     if (cid >= NUM_COMMANDS)
     {
         i3_log(LOG_MASK_ERROR, "%s: Command ID %d does not exist.", __FUNCTION__, cid);
         return cr_ErrorCodes_INVALID_ID;
     }
 
-    for (sCommandIndex = 0; sCommandIndex < NUM_COMMANDS; sCommandIndex++)
+    for (sCommandIndex[session] = 0; sCommandIndex[session] < NUM_COMMANDS; sCommandIndex[session]++)
     {
-        if (sCommandDescriptions[sCommandIndex].id == cid) {
-            if (!crcb_access_granted(cr_ServiceIds_COMMANDS, sCommandDescriptions[sCommandIndex].id))
+        if (sCommandDescriptions[sCommandIndex[session]].id == cid) {
+            if (!crcb_access_granted(cr_ServiceIds_COMMANDS, sCommandDescriptions[sCommandIndex[session]].id))
             {
-                sCommandIndex = 0;
+                sCommandIndex[session] = 0;
                 break;
             }
-            I3_LOG(LOG_MASK_PARAMS, "discover command reset (%d) reset to %d", cid, sCommandIndex);
+            I3_LOG(LOG_MASK_PARAMS, "discover command reset (%d) reset to %d", cid, sCommandIndex[session]);
             return 0;
         }
     }
-    sCommandIndex = crcb_get_command_count();
-    I3_LOG(LOG_MASK_PARAMS, "discover command reset (%d) reset defaults to %d", cid, sCommandIndex);
+    sCommandIndex[session] = crcb_get_command_count();
+    I3_LOG(LOG_MASK_PARAMS, "discover command reset (%d) reset defaults to %d", cid, sCommandIndex[session]);
     return cr_ErrorCodes_INVALID_ID;
 }
 
@@ -215,14 +244,22 @@ int crcb_command_execute(const uint8_t cid)
         /* User code start [Commands: Command Handler] */
         case COMMAND_PRESET_NOTIFICATIONS_ON:
             cr_init_param_notifications();
+            rnrfc_session_set_notifications_off(rnrfc_get_active_session(), false);
             I3_LOG(LOG_MASK_ALWAYS, "Enabled default notifications.");
             break;
         case COMMAND_CLEAR_NOTIFICATIONS:
             cr_clear_param_notifications();
+            rnrfc_session_set_notifications_off(rnrfc_get_active_session(), true);
             I3_LOG(LOG_MASK_ALWAYS, "Cleared all notifications.");
             break;
         case COMMAND_REBOOT:
+            // Parameter writes from just before the reboot may not have been saved yet
+            parameters_flush_nvm();
+#ifdef CONFIG_ARCH_POSIX
+            sys_reboot(SYS_REBOOT_COLD);
+#else
             NVIC_SystemReset();
+#endif // CONFIG_ARCH_POSIX
             break;
         case COMMAND_RESET_DEFAULTS:
             rval = parameters_reset_nvm();
@@ -361,6 +398,11 @@ int crcb_command_execute(const uint8_t cid)
             sTimesClicked++;
             break;
         }
+        case COMMAND_BENCHMARK_STREAM:
+        case COMMAND_BENCHMARK_ECHO:
+        case COMMAND_BENCHMARK_SINK:
+            rval = start_benchmark(cid);
+            break;
         /* User code end [Commands: Command Handler] */
         default:
             rval = cr_ErrorCodes_INVALID_ID;
@@ -379,5 +421,28 @@ int crcb_command_execute(const uint8_t cid)
  *******************************************************************************************/
 
 /* User code start [commands.c: User Local Functions] */
+static int start_benchmark(const uint8_t cid)
+{
+#ifdef CONFIG_REACH_BENCHMARK
+    cr_ParameterValue count, size;
+    if (crcb_parameter_read(PARAM_BENCH_COUNT, &count) || crcb_parameter_read(PARAM_BENCH_SIZE, &size))
+        return cr_ErrorCodes_READ_FAILED;
+    rnrfc_benchmark_mode_t mode = RNRFC_BENCHMARK_STREAM;
+    if (cid == COMMAND_BENCHMARK_ECHO)
+        mode = RNRFC_BENCHMARK_ECHO;
+    else if (cid == COMMAND_BENCHMARK_SINK)
+        mode = RNRFC_BENCHMARK_SINK;
+    // The run starts once this command's response has been sent
+    if (rnrfc_benchmark_start(mode, count.value.uint32_value, size.value.uint32_value))
+    {
+        cr_report_error(cr_ErrorCodes_INVALID_PARAMETER, "A benchmark is already running, or Bench Size is too small or too large");
+        return cr_ErrorCodes_INVALID_PARAMETER;
+    }
+    return 0;
+#else
+    (void) cid;
+    return cr_ErrorCodes_NOT_IMPLEMENTED;
+#endif // CONFIG_REACH_BENCHMARK
+}
 /* User code end [commands.c: User Local Functions] */
 
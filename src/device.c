@@ -46,6 +46,8 @@
 #include "i3_log.h"
 
 /* User code start [device.c: User Includes] */
+#include "parameters.h"
+#include "commands.h"
 /* User code end [device.c: User Includes] */
 
 /********************************************************************************************
@@ -135,6 +137,19 @@ int crcb_device_get_info(const cr_DeviceInfoRequest *request, cr_DeviceInfoRespo
 }
 
 /* User code start [device.c: User Cygnus Reach Callback Functions] */
+bool crcb_access_granted(const cr_ServiceIds service_id, const int32_t id)
+{
+#ifndef CONFIG_REACH_BENCHMARK
+    // The benchmark parameters and commands are only offered when the benchmark is built in
+    if (service_id == cr_ServiceIds_PARAMETER_REPO && id >= PARAM_BENCH_COUNT && id <= PARAM_BENCH_NOTIFY_FAILURES)
+        return false;
+    if (service_id == cr_ServiceIds_COMMANDS && id >= COMMAND_BENCHMARK_STREAM && id <= COMMAND_BENCHMARK_SINK)
+        return false;
+#endif // CONFIG_REACH_BENCHMARK
+    (void) service_id;
+    (void) id;
+    return true;
+}
 /* User code end [device.c: User Cygnus Reach Callback Functions] */
 
 /********************************************************************************************
@@ -52,6 +52,8 @@
 
 #include "const_files.h"
 #include "fs_utils.h"
+#include "reach_nrf_connect.h"
+#include "reach_conn_policy.h"
 /* User code end [files.c: User Includes] */
 
 /********************************************************************************************
@@ -97,7 +99,8 @@ static int ota_write_helper(void);
  ******************************     Local/Extern Variables     ******************************
  *******************************************************************************************/
 
-static int sFidIndex = 0;
+// Discovery progress is kept separately for each connected client
+static int sFidIndex[RNRFC_MAX_SESSIONS];
 cr_FileInfo sFileDescriptions[] = {
     {
         .file_id = FILE_OTA_BIN,
@@ -261,41 +264,43 @@ int crcb_file_get_file_count()
 int crcb_file_discover_reset(const uint8_t fid)
 {
     int rval = 0;
+    int session = rnrfc_get_active_session();
     uint32_t idx;
     rval = sFindIndexFromFid(fid, &idx);
     if (0 != rval)
     {
         I3_LOG(LOG_MASK_ERROR, "%s(%d): invalid FID, using NUM_FILES.", __FUNCTION__, fid);
-        sFidIndex = NUM_FILES;
+        sFidIndex[session] = NUM_FILES;
         return cr_ErrorCodes_INVALID_ID;
     }
-    if (!crcb_access_granted(cr_ServiceIds_FILES, sFileDescriptions[sFidIndex].file_id))
+    if (!crcb_access_granted(cr_ServiceIds_FILES, sFileDescriptions[sFidIndex[session]].file_id))
     {
         I3_LOG(LOG_MASK_ERROR, "%s(%d): Access not granted, using NUM_FILES.", __FUNCTION__, fid);
-        sFidIndex = NUM_FILES;
+        sFidIndex[session] = NUM_FILES;
         return cr_ErrorCodes_BAD_FILE;
     }
-    sFidIndex = idx;
+    sFidIndex[session] = idx;
     return 0;
 }
 
 int crcb_file_discover_next(cr_FileInfo *file_desc)
 {
-    if (sFidIndex >= NUM_FILES) // end of search
+    int session = rnrfc_get_active_session();
+    if (sFidIndex[session] >= NUM_FILES) // end of search
         return cr_ErrorCodes_NO_DATA;
 
-    while (!crcb_access_granted(cr_ServiceIds_FILES, file_desc[sFidIndex].file_id))
+    while (!crcb_access_granted(cr_ServiceIds_FILES, file_desc[sFidIndex[session]].file_id))
     {
         I3_LOG(LOG_MASK_FILES, "%s: sFidIndex (%d) skip, access not granted",
-               __FUNCTION__, sFidIndex);
-        sFidIndex++;
-        if (sFidIndex >= NUM_FILES)
+               __FUNCTION__, sFidIndex[session]);
+        sFidIndex[session]++;
+        if (sFidIndex[session] >= NUM_FILES)
         {
-            I3_LOG(LOG_MASK_PARAMS, "%s: skipped to sFidIndex (%d) >= NUM_FILES (%d)", __FUNCTION__, sFidIndex, NUM_FILES);
+            I3_LOG(LOG_MASK_PARAMS, "%s: skipped to sFidIndex (%d) >= NUM_FILES (%d)", __FUNCTION__, sFidIndex[session], NUM_FILES);
             return cr_ErrorCodes_NO_DATA;
         }
     }
-    *file_desc = sFileDescriptions[sFidIndex++];
+    *file_desc = sFileDescriptions[sFidIndex[session]++];
     return 0;
 }
 
@@ -323,11 +328,21 @@ int crcb_read_file(const uint32_t fid, const int offset, const size_t bytes_requ
     /* User code start [Files: Read]
      * The code generator does nothing to handle storing files, so this is where pData and bytes_read should be updated */
 
+    // The stack only follows one transfer at a time, so a second client has to wait for the first to finish
+    if (rnrfc_file_transfer_claim() != 0)
+        return cr_ErrorCodes_PERMISSION_DENIED;
+
+    // Keep the link fast for the rest of the transfer
+    rnrfc_conn_policy_request_throughput(rnrfc_get_active_session());
+
     switch (fid)
     {
         case FILE_IO_TXT:
             if (offset < 0 || offset >= sIoTxtSize)
+            {
+                rnrfc_file_transfer_release();
                 return cr_ErrorCodes_NO_DATA;
+            }
             if (offset == 0)
             {
                 // Update the local buffer of the file in case a write failed before this read
@@ -337,12 +352,20 @@ int crcb_read_file(const uint32_t fid, const int offset, const size_t bytes_requ
             }
             *bytes_read = ((offset + bytes_requested) > sIoTxtSize) ? (sIoTxtSize - offset):bytes_requested;
             memcpy(pData, &sIoTxtContents[offset], (size_t) *bytes_read);
+            // Reads have no completion callback, so the claim is dropped once the end of the file has been sent
+            if (offset + *bytes_read >= sIoTxtSize)
+                rnrfc_file_transfer_release();
             break;
         case FILE_CYGNUS_REACH_LOGO_PNG:
             if (offset < 0 || offset >= sizeof(cygnus_reach_logo))
+            {
+                rnrfc_file_transfer_release();
                 return cr_ErrorCodes_NO_DATA;
+            }
             *bytes_read = ((offset + bytes_requested) > sizeof(cygnus_reach_logo)) ? (sizeof(cygnus_reach_logo) - offset):bytes_requested;
             memcpy(pData, &cygnus_reach_logo[offset], (size_t) *bytes_read);
+            if (offset + *bytes_read >= sizeof(cygnus_reach_logo))
+                rnrfc_file_transfer_release();
             break;
     }
 
@@ -364,6 +387,13 @@ int crcb_file_prepare_to_write(const uint32_t fid, const size_t offset, const si
     /* User code start [Files: Pre-Write]
      * This is the opportunity to prepare for a file write, or to reject it. */
 
+    // The stack only follows one transfer at a time, so a second client has to wait for the first to finish
+    if (rnrfc_file_transfer_claim() != 0)
+        return cr_ErrorCodes_PERMISSION_DENIED;
+
+    // Switch to a short connection interval for the transfer
+    rnrfc_conn_policy_request_throughput(rnrfc_get_active_session());
+
     switch (fid)
     {
         case FILE_OTA_BIN:
@@ -416,6 +446,9 @@ int crcb_write_file(const uint32_t fid, const int offset, const size_t bytes, co
     /* User code start [Files: Write]
      * Here is where the received data should be copied to wherever the application is storing it */
 
+    if (rnrfc_file_transfer_claim() != 0)
+        return cr_ErrorCodes_PERMISSION_DENIED;
+
     switch (fid)
     {
         case FILE_OTA_BIN:
@@ -452,6 +485,8 @@ int crcb_file_transfer_complete(const uint32_t fid)
     /* User code start [Files: Write Complete]
      * This allows the application to handle any actions which need to occur after a file has successfully been written */
 
+    rnrfc_file_transfer_release();
+
     switch (fid)
     {
         case FILE_OTA_BIN:
@@ -496,6 +531,11 @@ int crcb_erase_file(const uint32_t fid)
     /* User code start [Files: Erase]
      * The exact meaning of "erasing" is user-defined, depending on how files are stored by the application */
 
+    // Not while someone else is transferring a file
+    if (rnrfc_file_transfer_claim() != 0)
+        return cr_ErrorCodes_PERMISSION_DENIED;
+    rnrfc_file_transfer_release();
+
     switch (fid)
     {
         case FILE_IO_TXT:
@@ -605,7 +645,10 @@ static int ota_write_helper(void)
         // Align to 4 bytes
         sOtaRamSize += (4 - (sOtaRamSize % 4));
     }
+    int64_t start = k_uptime_get();
     int rval = flash_write(FLASH_AREA_DEVICE(image_1), FLASH_AREA_OFFSET(image_1) + sOtaRamStartOffset, sOtaRam, sOtaRamSize);
+    // Prompts pile up while the flash is busy, which the acknowledgement rate has to allow for
+    rnrfc_report_storage_busy((uint32_t) (k_uptime_get() - start));
     // Reset buffer
     sOtaRamSize = 0;
     sOtaRamStartOffset = 0;
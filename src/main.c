@@ -12,7 +12,9 @@
 
 #include <zephyr/kernel.h>
 #include <zephyr/device.h>
+#ifdef CONFIG_BOOTLOADER_MCUBOOT
 #include <zephyr/dfu/mcuboot.h>
+#endif
 #include <zephyr/fs/fs.h>
 #include <zephyr/fs/littlefs.h>
 #include <zephyr/posix/time.h>
@@ -73,7 +75,9 @@ static bool button_pressed = false;
 
 int main(void)
 {
+#ifdef CONFIG_BOOTLOADER_MCUBOOT
 	boot_write_img_confirmed();
+#endif
 
 	littlefs_mount(mountpoint);
 
@@ -209,7 +213,17 @@ void rnrfc_app_handle_ble_connection(void)
 
 void rnrfc_app_handle_ble_disconnection(void)
 {
-	main_set_rgb_led_state(RGB_LED_COLOR_GREEN);
+	// The count no longer includes this connection, so stay blue while any other client is still connected
+	if (rnrfc_get_connection_count() == 0)
+		main_set_rgb_led_state(RGB_LED_COLOR_GREEN);
+    return;
+}
+
+void rnrfc_app_handle_session_closed(int session)
+{
+	(void) session;
+	// Save any parameters the client just wrote, rather than waiting for the flush delay
+	parameters_request_nvm_flush();
     return;
 }
 
@@ -242,5 +256,11 @@ static void button_handler_cb(uint32_t button_state, uint32_t has_changed)
 	ARG_UNUSED(has_changed);
 	button_pressed = button_state & DK_BTN1_MSK;
 	if (button_pressed)
+	{
 		main_enable_identify(!identify_enabled);
+		// Someone is physically with the device, so they probably want to connect to it
+		rnrfc_advertise_fast();
+	}
+	// The broadcast includes the button state
+	rnrfc_broadcast_refresh();
 }
\ No newline at end of file
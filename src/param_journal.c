@@ -0,0 +1,432 @@
+/********************************************************************************************
+ *
+ * \date   2024
+ *
+ * \author i3 Product Development (JNP)
+ *
+ * \brief  Append-only journal which stores the NVM parameters in the PR file
+ *
+ * Rewriting a record in place makes LittleFS copy the block it's in and every block after
+ * it, so parameter writes are instead appended as records which supersede any earlier
+ * record with the same ID.  The file starts with a header:
+ *
+ *      magic (4 bytes), hash of the stored parameter descriptions (4 bytes)
+ *
+ * followed by records:
+ *
+ *      ID (2 bytes), payload size (2 bytes), sequence number (4 bytes), payload, CRC-32 (4 bytes)
+ *
+ * All values are little-endian, and the CRC covers everything before it in the record.  The
+ * payload encoding belongs to the caller (see encode_nvm_record() in parameters.c).  The
+ * index of the latest record for each ID is rebuilt at boot by scanning the file.  Scanning
+ * stops at the first record which is incomplete or fails its CRC, which can only be a write
+ * interrupted by a reset, so this and anything after it is discarded.  The index only has
+ * an entry for each stored ID, which the caller maps to its place in the index.  Once enough
+ * records have been superseded, the latest ones are copied to a new file which then replaces
+ * the journal.
+ *
+ ********************************************************************************************/
+
+#include "param_journal.h"
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/fs/fs.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+
+#include "i3_log.h"
+#include "fs_utils.h"
+
+/*******************************************************************************
+ *******************************   DEFINES   ***********************************
+ ******************************************************************************/
+
+// "PRJ2", changed whenever the format of the records or their payloads changes
+#define PARAM_JOURNAL_MAGIC 0x324A5250
+#define PARAM_JOURNAL_HEADER_SIZE 8
+#define PARAM_JOURNAL_RECORD_HEADER_SIZE 8
+#define PARAM_JOURNAL_RECORD_CRC_SIZE 4
+#define PARAM_JOURNAL_RECORD_SIZE(payload_size) (PARAM_JOURNAL_RECORD_HEADER_SIZE + (payload_size) + PARAM_JOURNAL_RECORD_CRC_SIZE)
+
+/*******************************************************************************
+ ****************************   LOCAL  TYPES   *********************************
+ ******************************************************************************/
+
+typedef struct {
+    uint32_t offset;    // Of the latest record in the journal, or 0 if there isn't one
+    uint32_t sequence;
+    uint16_t size;      // Of the record's payload
+} journal_entry_t;
+
+/*******************************************************************************
+ *********************   LOCAL FUNCTION PROTOTYPES   ***************************
+ ******************************************************************************/
+
+static int read_record(struct fs_file_t *file, uint32_t offset, uint16_t *id, uint16_t *size, uint32_t *sequence);
+static int write_header(struct fs_file_t *file, uint32_t hash);
+static int index_from_id(uint16_t id);
+static int reopen_journal(void);
+static void update_index(journal_entry_t *index, int i, uint32_t offset, uint32_t sequence, uint16_t size);
+static void compact_work_handler(struct k_work *work);
+
+/*******************************************************************************
+ ***************************  LOCAL VARIABLES   ********************************
+ ******************************************************************************/
+
+static struct fs_file_t journal_file;
+static bool journal_open = false;
+// Set if the journal couldn't be reopened after compaction, so that appends try again
+static bool journal_reopen_pending = false;
+static uint32_t journal_hash;
+static param_journal_index_fn_t journal_index_from_id;
+// Where the next record will be appended
+static uint32_t journal_size;
+static uint32_t live_size;
+static uint32_t next_sequence;
+static journal_entry_t journal_index[PARAM_JOURNAL_MAX_RECORDS];
+// Only used by compaction, and kept off the system work queue's stack
+static journal_entry_t compacted_index[PARAM_JOURNAL_MAX_RECORDS];
+// Holds one complete record, and is shared by everything which holds the mutex
+static uint8_t record_buffer[PARAM_JOURNAL_RECORD_SIZE(PARAM_JOURNAL_MAX_PAYLOAD)];
+static uint32_t append_count;
+static uint32_t compaction_count;
+
+K_MUTEX_DEFINE(journal_mutex);
+K_WORK_DEFINE(compact_work, compact_work_handler);
+
+/*******************************************************************************
+ **************************   GLOBAL FUNCTIONS   *******************************
+ ******************************************************************************/
+
+int param_journal_init(uint32_t hash, param_journal_index_fn_t index_from_id)
+{
+    int rval;
+    uint8_t header[PARAM_JOURNAL_HEADER_SIZE];
+
+    k_mutex_lock(&journal_mutex, K_FOREVER);
+    memset(journal_index, 0, sizeof(journal_index));
+    journal_hash = hash;
+    journal_index_from_id = index_from_id;
+    journal_size = PARAM_JOURNAL_HEADER_SIZE;
+    live_size = 0;
+    next_sequence = 0;
+    fs_file_t_init(&journal_file);
+
+    // A compacted journal only replaces the real one once it's complete, so one left behind was interrupted
+    if (fs_utils_file_exists(PARAM_JOURNAL_COMPACT_FILE) == 1)
+    {
+        I3_LOG(LOG_MASK_WARN, "Removing incomplete PR journal compaction");
+        fs_unlink(PARAM_JOURNAL_COMPACT_FILE);
+    }
+
+    rval = fs_open(&journal_file, PARAM_JOURNAL_FILE, FS_O_RDWR | FS_O_CREATE);
+    if (rval < 0)
+    {
+        I3_LOG(LOG_MASK_ERROR, "Failed to open PR journal, error %d", rval);
+        k_mutex_unlock(&journal_mutex);
+        return rval;
+    }
+    journal_open = true;
+
+    rval = (int) fs_read(&journal_file, header, sizeof(header));
+    if (rval != sizeof(header) || sys_get_le32(&header[0]) != PARAM_JOURNAL_MAGIC || sys_get_le32(&header[4]) != hash)
+    {
+        if (rval > 0)
+            I3_LOG(LOG_MASK_WARN, "PR journal is for a different format or parameter set, starting a new one");
+        else
+            I3_LOG(LOG_MASK_WARN, "No PR journal found, starting a new one");
+        rval = fs_truncate(&journal_file, 0);
+        if (rval == 0)
+            rval = write_header(&journal_file, hash);
+        if (rval == 0)
+            rval = fs_sync(&journal_file);
+    }
+    else
+    {
+        uint32_t offset = PARAM_JOURNAL_HEADER_SIZE;
+        uint32_t records = 0;
+        uint16_t id, size;
+        uint32_t sequence;
+        while (read_record(&journal_file, offset, &id, &size, &sequence) == 0)
+        {
+            // In file order the sequence only increases, but compaction may reorder records
+            int i = index_from_id(id);
+            if (i >= 0 && (journal_index[i].offset == 0 || sequence > journal_index[i].sequence))
+                update_index(journal_index, i, offset, sequence, size);
+            if (sequence >= next_sequence)
+                next_sequence = sequence + 1;
+            offset += PARAM_JOURNAL_RECORD_SIZE(size);
+            records++;
+        }
+        journal_size = offset;
+        rval = 0;
+
+        // Anything after the last valid record is from an interrupted write
+        if (fs_seek(&journal_file, 0, FS_SEEK_END) == 0 && fs_tell(&journal_file) > (off_t) journal_size)
+        {
+            I3_LOG(LOG_MASK_WARN, "Discarding %d bytes after the last valid PR journal record",
+                   (int) (fs_tell(&journal_file) - journal_size));
+            rval = fs_truncate(&journal_file, journal_size);
+        }
+        I3_LOG(LOG_MASK_PARAMS, "PR journal has %u records in %u bytes, %u live", records, journal_size, live_size);
+    }
+
+    if (rval < 0)
+    {
+        I3_LOG(LOG_MASK_ERROR, "Failed to prepare PR journal, error %d", rval);
+        fs_close(&journal_file);
+        journal_open = false;
+    }
+    k_mutex_unlock(&journal_mutex);
+    return rval;
+}
+
+int param_journal_read(uint16_t id, void *payload, size_t *size)
+{
+    int rval;
+    uint16_t record_id, record_size;
+    uint32_t sequence;
+
+    k_mutex_lock(&journal_mutex, K_FOREVER);
+    int i = journal_open ? index_from_id(id):-1;
+    if (i < 0 || journal_index[i].offset == 0)
+    {
+        rval = -ENOENT;
+    }
+    else
+    {
+        rval = read_record(&journal_file, journal_index[i].offset, &record_id, &record_size, &sequence);
+        if (rval == 0 && record_size > *size)
+            rval = -ENOMEM;
+        if (rval == 0)
+        {
+            memcpy(payload, &record_buffer[PARAM_JOURNAL_RECORD_HEADER_SIZE], record_size);
+            *size = record_size;
+        }
+    }
+    k_mutex_unlock(&journal_mutex);
+    return rval;
+}
+
+int param_journal_append(uint16_t id, const void *payload, size_t size)
+{
+    int rval;
+    size_t record_size = PARAM_JOURNAL_RECORD_SIZE(size);
+
+    if (size > PARAM_JOURNAL_MAX_PAYLOAD)
+        return -EINVAL;
+
+    k_mutex_lock(&journal_mutex, K_FOREVER);
+    if (!journal_open && (!journal_reopen_pending || reopen_journal() < 0))
+    {
+        k_mutex_unlock(&journal_mutex);
+        return -EBADF;
+    }
+    int i = index_from_id(id);
+    if (i < 0)
+    {
+        k_mutex_unlock(&journal_mutex);
+        return -EINVAL;
+    }
+
+    sys_put_le16(id, &record_buffer[0]);
+    sys_put_le16((uint16_t) size, &record_buffer[2]);
+    sys_put_le32(next_sequence, &record_buffer[4]);
+    memcpy(&record_buffer[PARAM_JOURNAL_RECORD_HEADER_SIZE], payload, size);
+    sys_put_le32(crc32_ieee(record_buffer, PARAM_JOURNAL_RECORD_HEADER_SIZE + size), &record_buffer[PARAM_JOURNAL_RECORD_HEADER_SIZE + size]);
+
+    rval = fs_seek(&journal_file, journal_size, FS_SEEK_SET);
+    if (rval == 0)
+    {
+        ssize_t written = fs_write(&journal_file, record_buffer, record_size);
+        if (written != (ssize_t) record_size)
+            rval = (written < 0) ? (int) written : -ENOSPC;
+    }
+    // The index only moves on to the new record once it has been committed
+    if (rval == 0)
+        rval = fs_sync(&journal_file);
+
+    if (rval == 0)
+    {
+        update_index(journal_index, i, journal_size, next_sequence++, (uint16_t) size);
+        journal_size += record_size;
+        append_count++;
+        if (journal_size - PARAM_JOURNAL_HEADER_SIZE - live_size >= PARAM_JOURNAL_COMPACT_THRESHOLD)
+            k_work_submit(&compact_work);
+    }
+    else
+    {
+        I3_LOG(LOG_MASK_ERROR, "Failed to append ID %u to PR journal, error %d", id, rval);
+        // A partial record would be discarded at boot anyway, and the next append overwrites it
+        fs_truncate(&journal_file, journal_size);
+    }
+    k_mutex_unlock(&journal_mutex);
+    return rval;
+}
+
+void param_journal_get_stats(param_journal_stats_t *stats)
+{
+    k_mutex_lock(&journal_mutex, K_FOREVER);
+    stats->file_size = journal_open ? journal_size:0;
+    stats->live_size = live_size;
+    stats->appends = append_count;
+    stats->compactions = compaction_count;
+    k_mutex_unlock(&journal_mutex);
+}
+
+/*******************************************************************************
+ ***************************   LOCAL FUNCTIONS   *******************************
+ ******************************************************************************/
+
+// Reads the record at the offset into record_buffer.  Returns -ENODATA at the end of the file or for an incomplete
+// record, and -EBADMSG for a corrupt one.
+static int read_record(struct fs_file_t *file, uint32_t offset, uint16_t *id, uint16_t *size, uint32_t *sequence)
+{
+    int rval = fs_seek(file, offset, FS_SEEK_SET);
+    if (rval < 0)
+        return rval;
+    if (fs_read(file, record_buffer, PARAM_JOURNAL_RECORD_HEADER_SIZE) != PARAM_JOURNAL_RECORD_HEADER_SIZE)
+        return -ENODATA;
+    *id = sys_get_le16(&record_buffer[0]);
+    *size = sys_get_le16(&record_buffer[2]);
+    *sequence = sys_get_le32(&record_buffer[4]);
+    if (*size > PARAM_JOURNAL_MAX_PAYLOAD)
+        return -EBADMSG;
+
+    size_t remaining = *size + PARAM_JOURNAL_RECORD_CRC_SIZE;
+    if (fs_read(file, &record_buffer[PARAM_JOURNAL_RECORD_HEADER_SIZE], remaining) != (ssize_t) remaining)
+        return -ENODATA;
+    if (crc32_ieee(record_buffer, PARAM_JOURNAL_RECORD_HEADER_SIZE + *size) != sys_get_le32(&record_buffer[PARAM_JOURNAL_RECORD_HEADER_SIZE + *size]))
+        return -EBADMSG;
+    return 0;
+}
+
+static int write_header(struct fs_file_t *file, uint32_t hash)
+{
+    uint8_t header[PARAM_JOURNAL_HEADER_SIZE];
+    sys_put_le32(PARAM_JOURNAL_MAGIC, &header[0]);
+    sys_put_le32(hash, &header[4]);
+    int rval = fs_seek(file, 0, FS_SEEK_SET);
+    if (rval == 0 && fs_write(file, header, sizeof(header)) != sizeof(header))
+        rval = -EIO;
+    return rval;
+}
+
+static int reopen_journal(void)
+{
+    fs_file_t_init(&journal_file);
+    int rval = fs_open(&journal_file, PARAM_JOURNAL_FILE, FS_O_RDWR);
+    journal_open = (rval == 0);
+    journal_reopen_pending = !journal_open;
+    return rval;
+}
+
+static int index_from_id(uint16_t id)
+{
+    int i = journal_index_from_id(id);
+    return (i < PARAM_JOURNAL_MAX_RECORDS) ? i:-1;
+}
+
+static void update_index(journal_entry_t *index, int i, uint32_t offset, uint32_t sequence, uint16_t size)
+{
+    if (index == journal_index)
+    {
+        if (journal_index[i].offset != 0)
+            live_size -= PARAM_JOURNAL_RECORD_SIZE(journal_index[i].size);
+        live_size += PARAM_JOURNAL_RECORD_SIZE(size);
+    }
+    index[i].offset = offset;
+    index[i].sequence = sequence;
+    index[i].size = size;
+}
+
+static void compact_work_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+    struct fs_file_t compact_file;
+    uint32_t offset = PARAM_JOURNAL_HEADER_SIZE;
+    uint16_t id, size;
+    uint32_t sequence;
+    int rval;
+
+    // Parameter writes wait until compaction has finished
+    k_mutex_lock(&journal_mutex, K_FOREVER);
+    if (!journal_open)
+    {
+        k_mutex_unlock(&journal_mutex);
+        return;
+    }
+
+    memset(compacted_index, 0, sizeof(compacted_index));
+    fs_file_t_init(&compact_file);
+    rval = fs_open(&compact_file, PARAM_JOURNAL_COMPACT_FILE, FS_O_RDWR | FS_O_CREATE);
+    if (rval < 0)
+    {
+        I3_LOG(LOG_MASK_ERROR, "Failed to create compacted PR journal, error %d", rval);
+        k_mutex_unlock(&journal_mutex);
+        return;
+    }
+    rval = fs_truncate(&compact_file, 0);
+    if (rval == 0)
+        rval = write_header(&compact_file, journal_hash);
+    for (int i = 0; rval == 0 && i < PARAM_JOURNAL_MAX_RECORDS; i++)
+    {
+        if (journal_index[i].offset == 0)
+            continue;
+        // Records keep their sequence numbers, so the CRC is still valid
+        rval = read_record(&journal_file, journal_index[i].offset, &id, &size, &sequence);
+        if (rval == 0)
+        {
+            size_t record_size = PARAM_JOURNAL_RECORD_SIZE(size);
+            if (fs_write(&compact_file, record_buffer, record_size) != (ssize_t) record_size)
+                rval = -EIO;
+            update_index(compacted_index, i, offset, sequence, size);
+            offset += record_size;
+        }
+    }
+    if (rval == 0)
+        rval = fs_sync(&compact_file);
+    fs_close(&compact_file);
+
+    if (rval < 0)
+    {
+        I3_LOG(LOG_MASK_ERROR, "Failed to compact PR journal, error %d", rval);
+        fs_unlink(PARAM_JOURNAL_COMPACT_FILE);
+        k_mutex_unlock(&journal_mutex);
+        return;
+    }
+
+    // LittleFS replaces the old journal atomically, so a reset at any point leaves one complete journal
+    fs_close(&journal_file);
+    journal_open = false;
+    rval = fs_rename(PARAM_JOURNAL_COMPACT_FILE, PARAM_JOURNAL_FILE);
+    uint32_t old_size = journal_size;
+    if (rval < 0)
+    {
+        I3_LOG(LOG_MASK_ERROR, "Failed to replace PR journal with its compacted copy, error %d", rval);
+        fs_unlink(PARAM_JOURNAL_COMPACT_FILE);
+    }
+    else
+    {
+        // The index has to describe what's at the journal's path, even if it can't be reopened yet
+        memcpy(journal_index, compacted_index, sizeof(journal_index));
+        journal_size = offset;
+    }
+
+    // Whether or not the rename worked, the journal is now whatever is at the journal's path
+    int open_rval = reopen_journal();
+    if (open_rval < 0)
+        open_rval = reopen_journal();
+    if (open_rval < 0)
+    {
+        // Appends keep trying to reopen it, and fail with -EBADF until one succeeds
+        I3_LOG(LOG_MASK_ERROR, "Failed to reopen PR journal after compaction, error %d", open_rval);
+    }
+    else if (rval == 0)
+    {
+        I3_LOG(LOG_MASK_PARAMS, "Compacted PR journal from %u to %u bytes", old_size, offset);
+        compaction_count++;
+    }
+    k_mutex_unlock(&journal_mutex);
+}
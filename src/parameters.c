@@ -50,13 +50,21 @@
 #include <string.h>
 
 #include <zephyr/kernel.h>
+#ifdef CONFIG_BT
 #include <zephyr/bluetooth/bluetooth.h>
-#include <zephyr/fs/fs.h>
+#endif // CONFIG_BT
 
 #include "reach_nrf_connect.h"
+#include "reach_conn_policy.h"
+#ifdef CONFIG_REACH_BENCHMARK
+#include "reach_benchmark.h"
+#endif // CONFIG_REACH_BENCHMARK
+
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
 
 #include "main.h"
-#include "fs_utils.h"
+#include "param_journal.h"
 /* User code end [parameters.c: User Includes] */
 
 /********************************************************************************************
@@ -66,7 +74,19 @@
 #define PARAM_EI_TO_NUM_PEI_RESPONSES(param_ex) ((param_ex.num_labels / 8) + ((param_ex.num_labels % 8) ? 1:0))
 
 /* User code start [parameters.c: User Defines] */
-#define PARAM_REPO_FILE "/lfs/pr"
+// Incremented whenever the layout of the BLE broadcast payload changes
+#define PARAM_BROADCAST_FORMAT_VERSION 1
+// Each broadcast entry starts with the parameter ID (2 bytes), data type (1 byte) and value length (1 byte)
+#define PARAM_BROADCAST_ENTRY_HEADER_SIZE 4
+// Written NVM parameters are saved once none have been written for this long, or this long after the first unsaved write
+#define PARAM_NVM_FLUSH_DELAY_MS 500
+#define PARAM_NVM_FLUSH_MAX_DELAY_MS 2000
+// After a failed save, the flush is tried again after PARAM_NVM_FLUSH_DELAY_MS, doubling each time up to this
+#define PARAM_NVM_FLUSH_MAX_RETRY_MS 60000
+// The largest NVM record: the data type (1 byte), then a string without its terminator or a byte array
+#define PARAM_NVM_RECORD_MAX_SIZE (1 + MAX(REACH_PVAL_STRING_LEN - 1, REACH_PVAL_BYTES_LEN))
+// Parameter IDs below this are found through sParameterIndexFromPid, and any others by the generated search
+#define PARAM_ID_LOOKUP_SIZE 64
 /* User code end [parameters.c: User Defines] */
 
 /********************************************************************************************
@@ -99,8 +119,12 @@ static int sFindIndexFromPeiId(uint32_t pei_id, uint32_t *index);
 
 /* User code start [parameters.c: User Local Function Declarations] */
 
-// A custom hash function to only look at NVM parameters, to avoid invalidating the PR file when only non-NVM parameters change
+// A custom hash function to only look at what NVM records depend on, to avoid invalidating the PR file when anything else changes
 static uint32_t calculate_nvm_hash(void);
+static void nvm_flush_work_handler(struct k_work *work);
+static size_t encode_nvm_record(const cr_ParameterValue *data, uint8_t *record);
+static int decode_nvm_record(const uint8_t *record, size_t size, const cr_ParameterInfo *desc, cr_ParameterValue *data);
+static int nvm_index_from_id(uint16_t id);
 
 // strnlen is technically a Linux function and is often not found by the compiler.
 size_t strnlen( const char * s,size_t maxlen );
@@ -111,14 +135,22 @@ static int handle_post_init(void);
 static int handle_read(cr_ParameterValue *data);
 static int handle_write(const cr_ParameterValue *data);
 
+// The generated code finds a parameter by searching the descriptions for its ID.  Its calls go to param_index_from_pid()
+// instead, up to the generated sFindIndexFromPid() itself, where the name is released again.
+static int param_index_from_pid(uint32_t pid, uint32_t *index);
+#define sFindIndexFromPid param_index_from_pid
+
 /* User code end [parameters.c: User Local Function Declarations] */
 
 /********************************************************************************************
  ******************************     Local/Extern Variables     ******************************
  *******************************************************************************************/
 
-static int sCurrentParameter = 0;
+// Discovery progress is kept separately for each connected client
+static int sCurrentParameter[RNRFC_MAX_SESSIONS];
+
 static cr_ParameterValue sParameterValues[NUM_PARAMS];
+
 static const cr_ParameterInfo sParameterDescriptions[] = {
     {
         .id = PARAM_USER_DEVICE_NAME,
@@ -237,10 +269,267 @@ static const cr_ParameterInfo sParameterDescriptions[] = {
         .desc.float32_desc.default_value = 1,
         .desc.float32_desc.has_range_max = true,
         .desc.float32_desc.range_max = 60
+    },
+    {
+        .id = PARAM_CONNECTION_INTERVAL,
+        .name = "Connection Interval",
+        .has_description = true,
+        .description = "Reading client's, else session 0",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_FLOAT32 + cr_ParameterInfo_uint32_desc_tag,
+        .desc.float32_desc.has_units = true,
+        .desc.float32_desc.units = "milliseconds"
+    },
+    {
+        .id = PARAM_PERIPHERAL_LATENCY,
+        .name = "Peripheral Latency",
+        .has_description = true,
+        .description = "For the reading client",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_UINT32 + cr_ParameterInfo_uint32_desc_tag,
+        .desc.uint32_desc.has_units = true,
+        .desc.uint32_desc.units = "events"
+    },
+    {
+        .id = PARAM_SUPERVISION_TIMEOUT,
+        .name = "Supervision Timeout",
+        .has_description = true,
+        .description = "For the reading client",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_UINT32 + cr_ParameterInfo_uint32_desc_tag,
+        .desc.uint32_desc.has_units = true,
+        .desc.uint32_desc.units = "milliseconds"
+    },
+    {
+        .id = PARAM_CONNECTION_PARAMETER_SWITCHES,
+        .name = "Conn Param Switches",
+        .has_description = true,
+        .description = "Fast/idle changes since boot",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_UINT32 + cr_ParameterInfo_uint32_desc_tag
+    },
+    {
+        .id = PARAM_BLE_PHY,
+        .name = "BLE PHY",
+        .has_description = true,
+        .description = "TX PHY, reader's or session 0's",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_ENUMERATION + cr_ParameterInfo_uint32_desc_tag,
+        .desc.enum_desc.has_range_min = true,
+        .desc.enum_desc.range_min = 0,
+        .desc.enum_desc.has_range_max = true,
+        .desc.enum_desc.range_max = 2,
+        .desc.enum_desc.has_pei_id = true,
+        .desc.enum_desc.pei_id = PARAM_EI_BLE_PHY
+    },
+    {
+        .id = PARAM_TX_DATA_LENGTH,
+        .name = "TX Data Length",
+        .has_description = true,
+        .description = "Max link layer payload sent",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_UINT32 + cr_ParameterInfo_uint32_desc_tag,
+        .desc.uint32_desc.has_units = true,
+        .desc.uint32_desc.units = "bytes"
+    },
+    {
+        .id = PARAM_TX_DATA_TIME,
+        .name = "TX Data Time",
+        .has_description = true,
+        .description = "Max link layer PDU send time",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_UINT32 + cr_ParameterInfo_uint32_desc_tag,
+        .desc.uint32_desc.has_units = true,
+        .desc.uint32_desc.units = "microseconds"
+    },
+    {
+        .id = PARAM_RX_DATA_LENGTH,
+        .name = "RX Data Length",
+        .has_description = true,
+        .description = "Max link layer payload received",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_UINT32 + cr_ParameterInfo_uint32_desc_tag,
+        .desc.uint32_desc.has_units = true,
+        .desc.uint32_desc.units = "bytes"
+    },
+    {
+        .id = PARAM_RX_DATA_TIME,
+        .name = "RX Data Time",
+        .has_description = true,
+        .description = "Max link layer PDU receive time",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_UINT32 + cr_ParameterInfo_uint32_desc_tag,
+        .desc.uint32_desc.has_units = true,
+        .desc.uint32_desc.units = "microseconds"
+    },
+    {
+        .id = PARAM_BENCH_COUNT,
+        .name = "Bench Count",
+        .has_description = true,
+        .description = "Messages per benchmark run",
+        .access = cr_AccessLevel_READ_WRITE,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_UINT32 + cr_ParameterInfo_uint32_desc_tag,
+        .desc.uint32_desc.has_range_min = true,
+        .desc.uint32_desc.range_min = 1,
+        .desc.uint32_desc.has_default_value = true,
+        .desc.uint32_desc.default_value = 1000,
+        .desc.uint32_desc.has_range_max = true,
+        .desc.uint32_desc.range_max = 100000
+    },
+    {
+        .id = PARAM_BENCH_SIZE,
+        .name = "Bench Size",
+        .has_description = true,
+        .description = "Stream message size, 0 for max",
+        .access = cr_AccessLevel_READ_WRITE,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_UINT32 + cr_ParameterInfo_uint32_desc_tag,
+        .desc.uint32_desc.has_units = true,
+        .desc.uint32_desc.units = "bytes",
+        .desc.uint32_desc.has_range_min = true,
+        .desc.uint32_desc.range_min = 0,
+        .desc.uint32_desc.has_default_value = true,
+        .desc.uint32_desc.default_value = 0,
+        .desc.uint32_desc.has_range_max = true,
+        .desc.uint32_desc.range_max = 4096
+    },
+    {
+        .id = PARAM_BENCH_THROUGHPUT,
+        .name = "Bench Throughput",
+        .has_description = true,
+        .description = "Last stream or sink run",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_UINT32 + cr_ParameterInfo_uint32_desc_tag,
+        .desc.uint32_desc.has_units = true,
+        .desc.uint32_desc.units = "bytes/s"
+    },
+    {
+        .id = PARAM_BENCH_RTT_P50,
+        .name = "Bench RTT p50",
+        .has_description = true,
+        .description = "Median echo round trip",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_FLOAT32 + cr_ParameterInfo_uint32_desc_tag,
+        .desc.float32_desc.has_units = true,
+        .desc.float32_desc.units = "milliseconds"
+    },
+    {
+        .id = PARAM_BENCH_RTT_P99,
+        .name = "Bench RTT p99",
+        .has_description = true,
+        .description = "99th percentile echo round trip",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_FLOAT32 + cr_ParameterInfo_uint32_desc_tag,
+        .desc.float32_desc.has_units = true,
+        .desc.float32_desc.units = "milliseconds"
+    },
+    {
+        .id = PARAM_BENCH_NOTIFY_FAILURES,
+        .name = "Bench Notify Failures",
+        .has_description = true,
+        .description = "Lost messages in the last run",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_UINT32 + cr_ParameterInfo_uint32_desc_tag
+    },
+    {
+        .id = PARAM_RSSI,
+        .name = "RSSI",
+        .has_description = true,
+        .description = "Reading client's, else session 0",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_INT32 + cr_ParameterInfo_uint32_desc_tag,
+        .desc.int32_desc.has_units = true,
+        .desc.int32_desc.units = "dBm"
+    },
+    {
+        .id = PARAM_ATT_MTU,
+        .name = "ATT MTU",
+        .has_description = true,
+        .description = "Reading client's, else session 0",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_UINT32 + cr_ParameterInfo_uint32_desc_tag,
+        .desc.uint32_desc.has_units = true,
+        .desc.uint32_desc.units = "bytes"
+    },
+    {
+        .id = PARAM_NOTIFICATIONS_SENT,
+        .name = "Notifications Sent",
+        .has_description = true,
+        .description = "To all clients since boot",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_UINT32 + cr_ParameterInfo_uint32_desc_tag
+    },
+    {
+        .id = PARAM_NOTIFICATIONS_FAILED,
+        .name = "Notifications Failed",
+        .has_description = true,
+        .description = "To all clients since boot",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_UINT32 + cr_ParameterInfo_uint32_desc_tag
+    },
+    {
+        .id = PARAM_WRITE_BUFFER_HIGH_WATER,
+        .name = "Write Buffer High Water",
+        .has_description = true,
+        .description = "Most prompts waiting at once",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_UINT32 + cr_ParameterInfo_uint32_desc_tag,
+        .desc.uint32_desc.has_units = true,
+        .desc.uint32_desc.units = "prompts"
+    },
+    {
+        .id = PARAM_WRITE_BUFFER_DROPS,
+        .name = "Write Buffer Drops",
+        .has_description = true,
+        .description = "Prompts lost to a full buffer",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_UINT32 + cr_ParameterInfo_uint32_desc_tag
+    },
+    {
+        .id = PARAM_BYTES_IN_RATE,
+        .name = "Bytes In Rate",
+        .has_description = true,
+        .description = "Reach prompts, all clients",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_UINT32 + cr_ParameterInfo_uint32_desc_tag,
+        .desc.uint32_desc.has_units = true,
+        .desc.uint32_desc.units = "bytes/s"
+    },
+    {
+        .id = PARAM_BYTES_OUT_RATE,
+        .name = "Bytes Out Rate",
+        .has_description = true,
+        .description = "Reach messages, all clients",
+        .access = cr_AccessLevel_READ,
+        .storage_location = cr_StorageLocation_RAM,
+        .which_desc = cr_ParameterDataType_UINT32 + cr_ParameterInfo_uint32_desc_tag,
+        .desc.uint32_desc.has_units = true,
+        .desc.uint32_desc.units = "bytes/s"
     }
 };
 
-static cr_ParameterNotifyConfig sParameterDefaultNotifications[] = {
+static const cr_ParameterNotifyConfig sParameterDefaultNotifications[] = {
     {
         .parameter_id = PARAM_TIMEZONE_ENABLED,
         .minimum_notification_period = 1000,
@@ -280,12 +569,52 @@ static cr_ParameterNotifyConfig sParameterDefaultNotifications[] = {
         .parameter_id = PARAM_IDENTIFY,
         .minimum_notification_period = 1000,
         .minimum_delta = 1
+    },
+    {
+        .parameter_id = PARAM_CONNECTION_INTERVAL,
+        .minimum_notification_period = 1000,
+        .minimum_delta = 1
+    },
+    {
+        .parameter_id = PARAM_BLE_PHY,
+        .minimum_notification_period = 1000,
+        .minimum_delta = 1
+    },
+    {
+        .parameter_id = PARAM_RSSI,
+        .minimum_notification_period = 1000,
+        .minimum_delta = 3
+    },
+    {
+        .parameter_id = PARAM_ATT_MTU,
+        .minimum_notification_period = 1000,
+        .minimum_delta = 1
+    },
+    {
+        .parameter_id = PARAM_NOTIFICATIONS_FAILED,
+        .minimum_notification_period = 1000,
+        .minimum_delta = 1
+    },
+    {
+        .parameter_id = PARAM_WRITE_BUFFER_HIGH_WATER,
+        .minimum_notification_period = 1000,
+        .minimum_delta = 1
+    },
+    {
+        .parameter_id = PARAM_WRITE_BUFFER_DROPS,
+        .minimum_notification_period = 1000,
+        .minimum_delta = 1
+    },
+    {
+        .parameter_id = PARAM_BYTES_IN_RATE,
+        .minimum_notification_period = 1000,
+        .minimum_delta = 1
     }
 };
 
-static int sRequestedPeiId = -1;
-static int sCurrentPeiIndex = 0;
-static int sCurrentPeiKeyIndex = 0;
+static int sRequestedPeiId[RNRFC_MAX_SESSIONS];
+static int sCurrentPeiIndex[RNRFC_MAX_SESSIONS];
+static int sCurrentPeiKeyIndex[RNRFC_MAX_SESSIONS];
 static const cr_ParamExKey __cr_gen_pei_identify_led_labels[] = {
     {
         .id = 0,
@@ -347,6 +676,21 @@ static const cr_ParamExKey __cr_gen_pei_rgb_led_color_labels[] = {
     }
 };
 
+static const cr_ParamExKey __cr_gen_pei_ble_phy_labels[] = {
+    {
+        .id = BLE_PHY_1M,
+        .name = "1M"
+    },
+    {
+        .id = BLE_PHY_2M,
+        .name = "2M"
+    },
+    {
+        .id = BLE_PHY_CODED,
+        .name = "Coded"
+    }
+};
+
 static const cr_gen_param_ex_t sParameterLabelDescriptions[] = {
     {
         .pei_id = PARAM_EI_IDENTIFY_LED,
@@ -365,16 +709,41 @@ static const cr_gen_param_ex_t sParameterLabelDescriptions[] = {
         .data_type = cr_ParameterDataType_ENUMERATION,
         .num_labels = 8,
         .labels = __cr_gen_pei_rgb_led_color_labels
+    },
+    {
+        .pei_id = PARAM_EI_BLE_PHY,
+        .data_type = cr_ParameterDataType_ENUMERATION,
+        .num_labels = 3,
+        .labels = __cr_gen_pei_ble_phy_labels
     }
 };
 
 /* User code start [parameters.c: User Local/Extern Variables] */
 static bool sPrFileAccessFailed = false;
-static bool sPrFileExists = false;
-static struct fs_file_t sPrFile;
 
-static uint32_t sNvmParameterIds[NUM_PARAMS];
-static uint16_t sNvmParameterCount = 0;
+// Written NVM parameters wait here until they are saved to the PR journal, so that writes don't wait for the flash
+// and a burst of writes to a parameter is saved once.  The cache index of each parameter is -1 if it isn't stored.
+// Entries are kept as the encoded record, which is all that the flush needs and is smaller than a cr_ParameterValue.
+static int16_t sNvmCacheFromSlot[NUM_PARAMS];
+static uint16_t sNvmCacheCount = 0;
+static uint16_t sNvmCacheId[NUM_NVM_PARAMS];
+static uint8_t sNvmCache[NUM_NVM_PARAMS][PARAM_NVM_RECORD_MAX_SIZE];
+static uint8_t sNvmCacheSize[NUM_NVM_PARAMS];
+ATOMIC_DEFINE(sNvmDirty, NUM_NVM_PARAMS);
+static struct k_spinlock sNvmCacheLock;
+// The index into sParameterDescriptions of each parameter ID plus one, or 0 if the ID isn't used.  Filled by handle_pre_init().
+static uint8_t sParameterIndexFromPid[PARAM_ID_LOOKUP_SIZE];
+BUILD_ASSERT(NUM_PARAMS < UINT8_MAX, "Too many parameters for sParameterIndexFromPid");
+static bool sNvmFlushWaiting = false;
+static uint32_t sNvmFirstWriteMs;
+static uint32_t sNvmRetryDelayMs = 0;
+static uint32_t sNvmCacheWrites = 0;
+static uint32_t sNvmCacheSaved = 0;
+// Held for a whole flush, so that an older value can't be saved after a newer one
+K_MUTEX_DEFINE(sNvmFlushMutex);
+K_WORK_DELAYABLE_DEFINE(sNvmFlushWork, nvm_flush_work_handler);
+
+BUILD_ASSERT(PARAM_NVM_RECORD_MAX_SIZE <= PARAM_JOURNAL_MAX_PAYLOAD, "PR journal records are too small for a parameter value");
 /* User code end [parameters.c: User Local/Extern Variables] */
 
 /********************************************************************************************
@@ -520,8 +889,8 @@ int parameters_reset_nvm(void)
     {
         if (sParameterDescriptions[i].storage_location != cr_StorageLocation_NONVOLATILE)
             continue;
-        I3_LOG(LOG_MASK_PARAMS, "Resetting ID %u", sParameterValues[i].parameter_id);
-        rval = parameters_reset_param(sParameterValues[i].parameter_id, true, k_uptime_get_32());
+        I3_LOG(LOG_MASK_PARAMS, "Resetting ID %u", sParameterDescriptions[i].id);
+        rval = parameters_reset_param(sParameterDescriptions[i].id, true, k_uptime_get_32());
         if (rval)
         {
             I3_LOG(LOG_MASK_ERROR, "Failed to reset parameter '%s', error %d", sParameterDescriptions[i].name, rval);
@@ -530,6 +899,129 @@ int parameters_reset_nvm(void)
     return rval;
 }
 
+/**
+ * The broadcast carries the parameters with default notifications, so that the values a client would be sent on connection
+ * can also be seen without connecting.  After a format version byte, each parameter is an entry with its ID (2 bytes),
+ * cr_ParameterDataType (1 byte), value length (1 byte), and then the value.  Numbers are little-endian, strings are not terminated.
+ * Parameters which don't fit are left out.
+ */
+size_t rnrfc_app_get_broadcast_data(uint8_t *buf, size_t max_size)
+{
+    size_t length = 0;
+    if (max_size < 1)
+        return 0;
+    buf[length++] = PARAM_BROADCAST_FORMAT_VERSION;
+
+    for (size_t i = 0; i < NUM_DEFAULT_PARAMETER_NOTIFICATIONS; i++)
+    {
+        cr_ParameterValue param;
+        if (crcb_parameter_read(sParameterDefaultNotifications[i].parameter_id, &param))
+            continue;
+
+        uint32_t type = param.which_value - cr_ParameterValue_uint32_value_tag;
+        const void *value = &param.value;
+        size_t value_size;
+        // The nRF52840 is little-endian, so the numbers can be copied as they are
+        switch (type)
+        {
+        case cr_ParameterDataType_UINT32:
+        case cr_ParameterDataType_INT32:
+        case cr_ParameterDataType_FLOAT32:
+        case cr_ParameterDataType_BIT_FIELD:
+        case cr_ParameterDataType_ENUMERATION:
+            value_size = sizeof(uint32_t);
+            break;
+        case cr_ParameterDataType_UINT64:
+        case cr_ParameterDataType_INT64:
+        case cr_ParameterDataType_FLOAT64:
+            value_size = sizeof(uint64_t);
+            break;
+        case cr_ParameterDataType_BOOL:
+            value_size = 1;
+            break;
+        case cr_ParameterDataType_STRING:
+            value_size = strnlen(param.value.string_value, REACH_PVAL_STRING_LEN);
+            break;
+        case cr_ParameterDataType_BYTE_ARRAY:
+            value = param.value.bytes_value.bytes;
+            value_size = param.value.bytes_value.size;
+            break;
+        default:
+            continue;
+        }
+        if (length + PARAM_BROADCAST_ENTRY_HEADER_SIZE + value_size > max_size)
+            break;
+
+        buf[length++] = (uint8_t) (param.parameter_id & 0xFF);
+        buf[length++] = (uint8_t) (param.parameter_id >> 8);
+        buf[length++] = (uint8_t) type;
+        buf[length++] = (uint8_t) value_size;
+        memcpy(&buf[length], value, value_size);
+        length += value_size;
+    }
+    return length;
+}
+
+// Saves any cached NVM parameter writes to the PR journal before returning
+void parameters_flush_nvm(void)
+{
+    k_mutex_lock(&sNvmFlushMutex, K_FOREVER);
+    k_spinlock_key_t key = k_spin_lock(&sNvmCacheLock);
+    sNvmFlushWaiting = false;
+    k_spin_unlock(&sNvmCacheLock, key);
+    bool failed = false;
+    for (int i = 0; i < sNvmCacheCount; i++)
+    {
+        // A write after the bit is cleared sets it again, so at worst the same value is saved twice
+        if (!atomic_test_and_clear_bit(sNvmDirty, i))
+            continue;
+        uint8_t record[PARAM_NVM_RECORD_MAX_SIZE];
+        key = k_spin_lock(&sNvmCacheLock);
+        size_t size = sNvmCacheSize[i];
+        memcpy(record, sNvmCache[i], size);
+        k_spin_unlock(&sNvmCacheLock, key);
+        int rval = param_journal_append(sNvmCacheId[i], record, size);
+        if (rval)
+        {
+            I3_LOG(LOG_MASK_ERROR, "Failed to save parameter ID %u, error %d", sNvmCacheId[i], rval);
+            // Try again on the next flush
+            atomic_set_bit(sNvmDirty, i);
+            failed = true;
+        }
+        else
+        {
+            sNvmCacheSaved++;
+        }
+    }
+    if (failed)
+    {
+        // Nothing else may write these parameters again, so schedule the retry here, backing off while saves keep failing
+        sNvmRetryDelayMs = (sNvmRetryDelayMs == 0) ? PARAM_NVM_FLUSH_DELAY_MS:MIN(sNvmRetryDelayMs * 2, PARAM_NVM_FLUSH_MAX_RETRY_MS);
+        key = k_spin_lock(&sNvmCacheLock);
+        sNvmFlushWaiting = true;
+        sNvmFirstWriteMs = k_uptime_get_32();
+        k_spin_unlock(&sNvmCacheLock, key);
+        k_work_reschedule(&sNvmFlushWork, K_MSEC(sNvmRetryDelayMs));
+    }
+    else
+    {
+        sNvmRetryDelayMs = 0;
+    }
+    k_mutex_unlock(&sNvmFlushMutex);
+}
+
+// Saves any cached NVM parameter writes on the system work queue, without waiting for the flush delay
+void parameters_request_nvm_flush(void)
+{
+    k_work_reschedule(&sNvmFlushWork, K_NO_WAIT);
+}
+
+void parameters_get_nvm_cache_stats(uint32_t *writes, uint32_t *saved)
+{
+    *writes = sNvmCacheWrites;
+    *saved = sNvmCacheSaved;
+}
+
 /* User code end [parameters.c: User Global Functions] */
 
 /********************************************************************************************
@@ -542,15 +1034,16 @@ int parameters_reset_nvm(void)
 int crcb_parameter_discover_reset(const uint32_t pid)
 {
     int rval = 0;
+    int session = rnrfc_get_active_session();
     uint32_t idx;
     rval = sFindIndexFromPid(pid, &idx);
     if (0 != rval)
     {
-        sCurrentParameter = 0;
-        I3_LOG(LOG_MASK_PARAMS, "dp reset(%d) reset > defaults to %d", pid, sCurrentParameter);
+        sCurrentParameter[session] = 0;
+        I3_LOG(LOG_MASK_PARAMS, "dp reset(%d) reset > defaults to %d", pid, sCurrentParameter[session]);
         return rval;
     }
-    sCurrentParameter = idx;
+    sCurrentParameter[session] = idx;
     return 0;
 }
 
@@ -560,23 +1053,24 @@ int crcb_parameter_discover_reset(const uint32_t pid)
 // The app owns the string pointers which must not be on the stack.
 int crcb_parameter_discover_next(cr_ParameterInfo *ppDesc)
 {
-    if (sCurrentParameter >= NUM_PARAMS)
+    int session = rnrfc_get_active_session();
+    if (sCurrentParameter[session] >= NUM_PARAMS)
     {
-        I3_LOG(LOG_MASK_PARAMS, "%s: sCurrentParameter (%d) >= NUM_PARAMS (%d)", __FUNCTION__, sCurrentParameter, NUM_PARAMS);
+        I3_LOG(LOG_MASK_PARAMS, "%s: sCurrentParameter (%d) >= NUM_PARAMS (%d)", __FUNCTION__, sCurrentParameter[session], NUM_PARAMS);
         return cr_ErrorCodes_NO_DATA;
     }
-    while (!crcb_access_granted(cr_ServiceIds_PARAMETER_REPO, sParameterDescriptions[sCurrentParameter].id))
+    while (!crcb_access_granted(cr_ServiceIds_PARAMETER_REPO, sParameterDescriptions[sCurrentParameter[session]].id))
     {
-        I3_LOG(LOG_MASK_PARAMS, "%s: sCurrentParameter (%d) skip, access not granted", __FUNCTION__, sCurrentParameter);
-        sCurrentParameter++;
-        if (sCurrentParameter >= NUM_PARAMS)
+        I3_LOG(LOG_MASK_PARAMS, "%s: sCurrentParameter (%d) skip, access not granted", __FUNCTION__, sCurrentParameter[session]);
+        sCurrentParameter[session]++;
+        if (sCurrentParameter[session] >= NUM_PARAMS)
         {
-            I3_LOG(LOG_MASK_PARAMS, "%s: skipped to sCurrentParameter (%d) >= NUM_PARAMS (%d)", __FUNCTION__, sCurrentParameter, NUM_PARAMS);
+            I3_LOG(LOG_MASK_PARAMS, "%s: skipped to sCurrentParameter (%d) >= NUM_PARAMS (%d)", __FUNCTION__, sCurrentParameter[session], NUM_PARAMS);
             return cr_ErrorCodes_NO_DATA;
         }
     }
-    *ppDesc = sParameterDescriptions[sCurrentParameter];
-    sCurrentParameter++;
+    *ppDesc = sParameterDescriptions[sCurrentParameter[session]];
+    sCurrentParameter[session]++;
     return 0;
 }
 
@@ -613,6 +1107,8 @@ int crcb_parameter_write(const uint32_t pid, const cr_ParameterValue *data)
     /* User code start [Parameter Repository: Parameter Write]
      * Here is the place to apply this change externally, and return an error if necessary */
     handle_write(data);
+    // The broadcast is only rebuilt after this processing pass, by which time the new value is stored
+    rnrfc_broadcast_refresh();
     /* User code end [Parameter Repository: Parameter Write] */
 
     sParameterValues[idx].timestamp = data->timestamp;
@@ -754,64 +1250,68 @@ int crcb_parameter_ex_get_count(const int32_t pid)
 
 int crcb_parameter_ex_discover_reset(const int32_t pid)
 {
-    sRequestedPeiId = pid;
+    int session = rnrfc_get_active_session();
+    sRequestedPeiId[session] = pid;
     if (pid < 0)
-        sCurrentPeiIndex = 0;
+        sCurrentPeiIndex[session] = 0;
     else
     {
-        sCurrentPeiIndex = -1;
+        sCurrentPeiIndex[session] = -1;
         for (int i=0; i<NUM_EX_PARAMS; i++)
         {
             if (sParameterLabelDescriptions[i].pei_id == (param_ei_t) pid)
             {
-                sCurrentPeiIndex = i;
+                sCurrentPeiIndex[session] = i;
                 break;
             }
         }
     }
-    sCurrentPeiKeyIndex = 0;
+    sCurrentPeiKeyIndex[session] = 0;
     return 0;
 }
 
 int crcb_parameter_ex_discover_next(cr_ParamExInfoResponse *pDesc)
 {
+    int session = rnrfc_get_active_session();
     affirm(pDesc);
 
-    if (sCurrentPeiIndex < 0)
+    if (sCurrentPeiIndex[session] < 0)
     {
         I3_LOG(LOG_MASK_PARAMS, "%s: No more ex params.", __FUNCTION__);
         return cr_ErrorCodes_INVALID_ID;
     }
     else
     {
-        pDesc->pei_id = sParameterLabelDescriptions[sCurrentPeiIndex].pei_id;
-        pDesc->data_type = sParameterLabelDescriptions[sCurrentPeiIndex].data_type;
-        pDesc->keys_count = sParameterLabelDescriptions[sCurrentPeiIndex].num_labels - sCurrentPeiKeyIndex;
+        pDesc->pei_id = sParameterLabelDescriptions[sCurrentPeiIndex[session]].pei_id;
+        pDesc->data_type = sParameterLabelDescriptions[sCurrentPeiIndex[session]].data_type;
+        pDesc->keys_count = sParameterLabelDescriptions[sCurrentPeiIndex[session]].num_labels - sCurrentPeiKeyIndex[session];
         if (pDesc->keys_count > 8)
             pDesc->keys_count = 8;
-        memcpy(&pDesc->keys, &sParameterLabelDescriptions[sCurrentPeiIndex].labels[sCurrentPeiKeyIndex], pDesc->keys_count * sizeof(cr_ParamExKey));
-        sCurrentPeiKeyIndex += pDesc->keys_count;
-        if (sCurrentPeiKeyIndex >= sParameterLabelDescriptions[sCurrentPeiIndex].num_labels)
+        memcpy(&pDesc->keys, &sParameterLabelDescriptions[sCurrentPeiIndex[session]].labels[sCurrentPeiKeyIndex[session]], pDesc->keys_count * sizeof(cr_ParamExKey));
+        sCurrentPeiKeyIndex[session] += pDesc->keys_count;
+        if (sCurrentPeiKeyIndex[session] >= sParameterLabelDescriptions[sCurrentPeiIndex[session]].num_labels)
         {
-            if (sRequestedPeiId == -1)
+            if (sRequestedPeiId[session] == -1)
             {
                 // Advance to the next pei_id index
-                sCurrentPeiIndex++;
-                if (sCurrentPeiIndex >= NUM_EX_PARAMS)
-                    sCurrentPeiIndex = -1;
+                sCurrentPeiIndex[session]++;
+                if (sCurrentPeiIndex[session] >= NUM_EX_PARAMS)
+                    sCurrentPeiIndex[session] = -1;
             }
             else
             {
                 // Out of data for the selected pei_id
-                sCurrentPeiIndex = -1;
+                sCurrentPeiIndex[session] = -1;
             }
-            sCurrentPeiKeyIndex = 0;
+            sCurrentPeiKeyIndex[session] = 0;
         }
     }
     return 0;
 }
 
 /* User code start [parameters.c: User Cygnus Reach Callback Functions] */
+// From here sFindIndexFromPid() is the generated search, which param_index_from_pid() uses for IDs beyond its table
+#undef sFindIndexFromPid
 /* User code end [parameters.c: User Cygnus Reach Callback Functions] */
 
 /********************************************************************************************
@@ -848,115 +1348,46 @@ static int sFindIndexFromPeiId(uint32_t pei_id, uint32_t *index)
 
 static int handle_pre_init(void)
 {
-    int rval = 0;
-    fs_file_t_init(&sPrFile);
-    uint32_t hash = calculate_nvm_hash();
-    uint32_t stored_hash = 0;
-    if (fs_utils_file_exists(PARAM_REPO_FILE) == 1)
-    {
-        I3_LOG(LOG_MASK_PARAMS, "PR file found");
-        // Verify that the file is valid and isn't for an earlier version of parameter repo
-        // Theoretically should only cover parameters in the NVM, but this gets complicated with enum/bitfield descriptions tied to parameters
-        rval = fs_open(&sPrFile, PARAM_REPO_FILE, FS_O_RDWR);
-        if (rval < 0)
-        {
-            I3_LOG(LOG_MASK_ERROR, "Failed to open PR file, error %d", rval);
-            sPrFileAccessFailed = true;
-            return -1;
-        }
-        rval = (int) fs_read(&sPrFile, &stored_hash, sizeof(stored_hash));
-        if (rval < sizeof(stored_hash) || stored_hash != hash)
-        {
-            if (rval < sizeof(stored_hash))
-                I3_LOG(LOG_MASK_ERROR, "PR file read returned %d, expected %u", rval, sizeof(uint32_t));
-            else
-                I3_LOG(LOG_MASK_WARN, "Stored hash 0x%x does not match computed hash 0x%x", stored_hash, hash);
-            // Close and erase the file, and continue as if the file never existed
-            rval = fs_close(&sPrFile);
-            if (rval < 0)
-            {
-                I3_LOG(LOG_MASK_ERROR, "Failed to close invalid PR file, error %d", rval);
-                sPrFileAccessFailed = true;
-                return -2;
-            }
-            rval = fs_unlink(PARAM_REPO_FILE);
-            if (rval < 0)
-            {
-                I3_LOG(LOG_MASK_ERROR, "Failed to unlink invalid PR file, error %d", rval);
-                sPrFileAccessFailed = true;
-                return -3;
-            }
-        }
-        else
-        {
-            sPrFileExists = true;
-        }
+    for (int i = 0; i < NUM_PARAMS; i++)
+    {
+        if (sParameterDescriptions[i].id < PARAM_ID_LOOKUP_SIZE)
+            sParameterIndexFromPid[sParameterDescriptions[i].id] = (uint8_t) (i + 1);
     }
-    if (!sPrFileExists)
+    // The journal indexes its records by the same index as the cache, so this is set up first
+    for (int i = 0; i < NUM_PARAMS; i++)
     {
-        I3_LOG(LOG_MASK_WARN, "No valid PR file found, creating a new one");
-        rval = fs_open(&sPrFile, PARAM_REPO_FILE, FS_O_RDWR | FS_O_CREATE);
-        if (rval < 0)
-        {
-            I3_LOG(LOG_MASK_ERROR, "Failed to create PR file, error %d", rval);
-            sPrFileAccessFailed = true;
-            return -4;
-        }
-        stored_hash = ~hash;
-        rval = (int) fs_write(&sPrFile, &stored_hash, sizeof(stored_hash));
-        if (rval < 0)
+        sNvmCacheFromSlot[i] = -1;
+        if (sParameterDescriptions[i].storage_location == cr_StorageLocation_NONVOLATILE)
         {
-            I3_LOG(LOG_MASK_ERROR, "Failed to write anti-hash to PR file, error %d", rval);
-            sPrFileAccessFailed = true;
-            return -5;
+            affirm(sNvmCacheCount < NUM_NVM_PARAMS);
+            sNvmCacheId[sNvmCacheCount] = (uint16_t) sParameterDescriptions[i].id;
+            sNvmCacheFromSlot[i] = (int16_t) sNvmCacheCount++;
         }
     }
+    // The journal stays open, and each write of an NVM parameter is appended to it
+    int rval = param_journal_init(calculate_nvm_hash(), nvm_index_from_id);
+    if (rval < 0)
+    {
+        I3_LOG(LOG_MASK_ERROR, "Failed to open PR journal, error %d", rval);
+        sPrFileAccessFailed = true;
+        return -1;
+    }
     return 0;
 }
 
 static int handle_init(cr_ParameterValue *data, const cr_ParameterInfo *desc)
 {
     int rval = 0;
-    if (desc->storage_location == cr_StorageLocation_NONVOLATILE)
+    if (desc->storage_location == cr_StorageLocation_NONVOLATILE && !sPrFileAccessFailed)
     {
-        if (!sPrFileAccessFailed)
+        // Parameters which have never been written keep their default value
+        uint8_t record[PARAM_NVM_RECORD_MAX_SIZE];
+        size_t size = sizeof(record);
+        if (param_journal_read(desc->id, record, &size) == 0)
         {
-            if (sPrFileExists)
-            {
-                I3_LOG(LOG_MASK_PARAMS, "Getting data about parameter %u from existing PR file", data->parameter_id);
-                // Get the data from the file
-                cr_ParameterInfo temp;
-                rval = (int) fs_read(&sPrFile, &temp, sizeof(cr_ParameterValue));
-                if (rval != sizeof(cr_ParameterValue))
-                {
-                    I3_LOG(LOG_MASK_ERROR, "Failed to read parameter ID %u, error %d", data->parameter_id, rval);
-                    sPrFileAccessFailed = true;
-                }
-                else
-                {
-                    rval = 0;
-                }
-                // If we got the data successfully, copy it to the parameter
-                memcpy(data, &temp, sizeof(temp));
-                // Update parameter map
-                sNvmParameterIds[sNvmParameterCount++] = data->parameter_id;
-            }
-            else
-            {
-                I3_LOG(LOG_MASK_PARAMS, "Writing data about parameter %u to new PR file", data->parameter_id);
-                sNvmParameterIds[sNvmParameterCount++] = data->parameter_id;
-                // Write the data to the file
-                rval = (int) fs_write(&sPrFile, data, sizeof(cr_ParameterValue));
-                if (rval != sizeof(cr_ParameterValue))
-                {
-                    I3_LOG(LOG_MASK_ERROR, "Failed to write parameter ID %u, error %d", data->parameter_id, rval);
-                    sPrFileAccessFailed = true;
-                }
-                else
-                {
-                    rval = 0;
-                }
-            }
+            I3_LOG(LOG_MASK_PARAMS, "Restoring parameter %u from the PR journal", desc->id);
+            if (decode_nvm_record(record, size, desc, data))
+                I3_LOG(LOG_MASK_WARN, "Stored record for parameter %u is invalid, using the default", desc->id);
         }
     }
 
@@ -968,8 +1399,8 @@ static int handle_init(cr_ParameterValue *data, const cr_ParameterInfo *desc)
             break;
         case PARAM_USER_DEVICE_NAME:
             // Advertise the user device name if it's been set
-	        if (sParameterValues[PARAM_USER_DEVICE_NAME].value.string_value[0] != 0)
-		        rnrfc_set_advertised_name(sParameterValues[PARAM_USER_DEVICE_NAME].value.string_value);
+	        if (data->value.string_value[0] != 0)
+		        rnrfc_set_advertised_name(data->value.string_value);
             break;
         default:
             // Call the standard read function
@@ -981,26 +1412,8 @@ static int handle_init(cr_ParameterValue *data, const cr_ParameterInfo *desc)
 
 static int handle_post_init(void)
 {
-    if (!sPrFileAccessFailed)
-    {
-        if (!sPrFileExists)
-        {
-            I3_LOG(LOG_MASK_PARAMS, "Marking fresh PR file as valid");
-            // Mark as valid
-            fs_seek(&sPrFile, 0, FS_SEEK_SET);
-            uint32_t hash = calculate_nvm_hash();
-            fs_write(&sPrFile, &hash, sizeof(uint32_t));
-        }
-        fs_close(&sPrFile);
-    }
-    else
-    {
-        // Depending on the source of this failure, this might not work, but it's important to ensure there's no corrupted file in the NVM
-        fs_close(&sPrFile);
-        fs_unlink(PARAM_REPO_FILE);
-        return -1;
-    }
-    return 0;
+    // Records are checked as the journal is opened, so there is nothing left to validate
+    return sPrFileAccessFailed ? -1:0;
 }
 
 static int handle_read(cr_ParameterValue *data)
@@ -1010,6 +1423,7 @@ static int handle_read(cr_ParameterValue *data)
     {
         // Parameters which may change without the param repo's knowledge
         case PARAM_BT_DEVICE_ADDRESS:
+#ifdef CONFIG_BT
             bt_addr_le_t ble_id;
             size_t id_count = 1;
             bt_id_get(&ble_id, &id_count);
@@ -1017,6 +1431,9 @@ static int handle_read(cr_ParameterValue *data)
             for (int i = 0; i < sizeof(ble_id.a.val); i++)
                 data->value.bytes_value.bytes[i] = ble_id.a.val[sizeof(ble_id.a.val) - i - 1];
             data->value.bytes_value.size = sizeof(ble_id.a.val);
+#else
+            data->value.bytes_value.size = 0;
+#endif // CONFIG_BT
             break;
         case PARAM_UPTIME:
             data->value.int64_value = k_uptime_get();
@@ -1036,6 +1453,94 @@ static int handle_read(cr_ParameterValue *data)
         case PARAM_IDENTIFY:
             data->value.bool_value = main_identify_enabled();
             break;
+        case PARAM_CONNECTION_INTERVAL:
+        case PARAM_PERIPHERAL_LATENCY:
+        case PARAM_SUPERVISION_TIMEOUT:
+        case PARAM_BLE_PHY:
+        case PARAM_TX_DATA_LENGTH:
+        case PARAM_TX_DATA_TIME:
+        case PARAM_RX_DATA_LENGTH:
+        case PARAM_RX_DATA_TIME:
+        {
+            // Report the connection of whoever is asking.  Notifications and the broadcast aren't read by a client, so they get session 0.
+            rnrfc_conn_params_t params;
+            if (rnrfc_conn_policy_get_params(rnrfc_get_active_session(), &params) != 0)
+                memset(&params, 0, sizeof(params));
+            if (data->parameter_id == PARAM_CONNECTION_INTERVAL)
+                data->value.float32_value = params.interval * 1.25f;
+            else if (data->parameter_id == PARAM_PERIPHERAL_LATENCY)
+                data->value.uint32_value = params.latency;
+            else if (data->parameter_id == PARAM_SUPERVISION_TIMEOUT)
+                data->value.uint32_value = params.timeout * 10;
+            else if (data->parameter_id == PARAM_BLE_PHY)
+            {
+                if (params.tx_phy == BT_GAP_LE_PHY_2M)
+                    data->value.enum_value = BLE_PHY_2M;
+                else if (params.tx_phy == BT_GAP_LE_PHY_CODED)
+                    data->value.enum_value = BLE_PHY_CODED;
+                else
+                    data->value.enum_value = BLE_PHY_1M;
+            }
+            else if (data->parameter_id == PARAM_TX_DATA_LENGTH)
+                data->value.uint32_value = params.tx_max_len;
+            else if (data->parameter_id == PARAM_TX_DATA_TIME)
+                data->value.uint32_value = params.tx_max_time;
+            else if (data->parameter_id == PARAM_RX_DATA_LENGTH)
+                data->value.uint32_value = params.rx_max_len;
+            else
+                data->value.uint32_value = params.rx_max_time;
+            break;
+        }
+        case PARAM_CONNECTION_PARAMETER_SWITCHES:
+            data->value.uint32_value = rnrfc_conn_policy_get_switch_count();
+            break;
+        case PARAM_RSSI:
+        {
+            int8_t rssi;
+            data->value.int32_value = (rnrfc_conn_policy_read_rssi(rnrfc_get_active_session(), &rssi) == 0) ? rssi:0;
+            break;
+        }
+        case PARAM_ATT_MTU:
+        {
+            rnrfc_conn_params_t params;
+            data->value.uint32_value = (rnrfc_conn_policy_get_params(rnrfc_get_active_session(), &params) == 0) ? params.mtu:0;
+            break;
+        }
+        // The BLE task's counters, which are kept up to date with nothing more than atomic increments
+        case PARAM_NOTIFICATIONS_SENT:
+            data->value.uint32_value = (uint32_t) atomic_get(&rnrfc_get_stats()->notify_sent);
+            break;
+        case PARAM_NOTIFICATIONS_FAILED:
+            data->value.uint32_value = (uint32_t) atomic_get(&rnrfc_get_stats()->notify_failed);
+            break;
+        case PARAM_WRITE_BUFFER_HIGH_WATER:
+            data->value.uint32_value = (uint32_t) atomic_get(&rnrfc_get_stats()->ingress_high_water);
+            break;
+        case PARAM_WRITE_BUFFER_DROPS:
+            data->value.uint32_value = (uint32_t) atomic_get(&rnrfc_get_stats()->ingress_drops);
+            break;
+        case PARAM_BYTES_IN_RATE:
+        case PARAM_BYTES_OUT_RATE:
+        {
+            uint32_t received_per_second, sent_per_second;
+            rnrfc_get_throughput(&received_per_second, &sent_per_second);
+            data->value.uint32_value = (data->parameter_id == PARAM_BYTES_IN_RATE) ? received_per_second:sent_per_second;
+            break;
+        }
+#ifdef CONFIG_REACH_BENCHMARK
+        case PARAM_BENCH_THROUGHPUT:
+            data->value.uint32_value = rnrfc_benchmark_get_results()->bytes_per_second;
+            break;
+        case PARAM_BENCH_RTT_P50:
+            data->value.float32_value = rnrfc_benchmark_get_results()->rtt_p50_us / 1000.0f;
+            break;
+        case PARAM_BENCH_RTT_P99:
+            data->value.float32_value = rnrfc_benchmark_get_results()->rtt_p99_us / 1000.0f;
+            break;
+        case PARAM_BENCH_NOTIFY_FAILURES:
+            data->value.uint32_value = rnrfc_benchmark_get_results()->notify_failures;
+            break;
+#endif // CONFIG_REACH_BENCHMARK
         default:
             // Do nothing with the data, and assume that it is valid
             break;
@@ -1059,56 +1564,36 @@ static int handle_write(const cr_ParameterValue *data)
             break;
     }
 
-    // Only think about the NVM if file access hasn't failed
-    if (!sPrFileAccessFailed)
-    {
-        // Check if the parameter is in our list of NVM parameters, these need to be stored properly
-        for (int i = 0; i < sNvmParameterCount; i++)
+    // Only think about the NVM if file access hasn't failed, and only for parameters which are stored
+    uint32_t slot;
+    if (!sPrFileAccessFailed && param_index_from_pid(data->parameter_id, &slot) == 0 && sNvmCacheFromSlot[slot] >= 0)
+    {
+        int i = sNvmCacheFromSlot[slot];
+        uint32_t now = k_uptime_get_32();
+        uint8_t record[PARAM_NVM_RECORD_MAX_SIZE];
+        size_t size = encode_nvm_record(data, record);
+        I3_LOG(LOG_MASK_PARAMS, "Caching NVM write for parameter %u, cache index %d", data->parameter_id, i);
+        k_spinlock_key_t key = k_spin_lock(&sNvmCacheLock);
+        memcpy(sNvmCache[i], record, size);
+        sNvmCacheSize[i] = (uint8_t) size;
+        atomic_set_bit(sNvmDirty, i);
+        sNvmCacheWrites++;
+        bool overdue = sNvmFlushWaiting && ((now - sNvmFirstWriteMs) >= PARAM_NVM_FLUSH_MAX_DELAY_MS);
+        if (!sNvmFlushWaiting)
         {
-            if (data->parameter_id == sNvmParameterIds[i])
-            {
-                I3_LOG(LOG_MASK_PARAMS, "Handling NVM write for parameter %u, NVM index %d", data->parameter_id, i);
-                // Update entry
-                rval = fs_open(&sPrFile, PARAM_REPO_FILE, FS_O_RDWR);
-                if (rval < 0)
-                {
-                    I3_LOG(LOG_MASK_ERROR, "Failed to open file to write parameter ID %u, error %d", data->parameter_id, rval);
-                    sPrFileAccessFailed = true;
-                    // No need to close the file since it hasn't been opened
-                    break;
-                }
-                rval = fs_seek(&sPrFile, sizeof(uint32_t) + (i * sizeof(cr_ParameterValue)), FS_SEEK_SET);
-                if (rval < 0)
-                {
-                    I3_LOG(LOG_MASK_ERROR, "Failed to seek in file to write parameter ID %u, error %d", data->parameter_id, rval);
-                }
-                else
-                {
-                    rval = fs_write(&sPrFile, data, sizeof(cr_ParameterValue));
-                    if (rval < 0)
-                    {
-                        I3_LOG(LOG_MASK_ERROR, "Failed to write parameter ID %u, error %d", data->parameter_id, rval);
-                    }
-                    else
-                    {
-                        rval = 0;
-                    }
-                }
-                if (!sPrFileAccessFailed)
-                    fs_close(&sPrFile);
-                // Only one entry per parameter, no need to keep looking
-                if (rval)
-                    rval = cr_ErrorCodes_WRITE_FAILED;
-                break;
-            }
+            sNvmFlushWaiting = true;
+            sNvmFirstWriteMs = now;
         }
+        k_spin_unlock(&sNvmCacheLock, key);
+        // Each write pushes the flush back, until the oldest unsaved write has waited long enough
+        k_work_reschedule(&sNvmFlushWork, overdue ? K_NO_WAIT:K_MSEC(PARAM_NVM_FLUSH_DELAY_MS));
     }
 
     switch (data->parameter_id)
     {
         case PARAM_USER_DEVICE_NAME:
             if (data->value.string_value[0] == 0)
-                rnrfc_set_advertised_name(CONFIG_BT_DEVICE_NAME);
+                rnrfc_set_advertised_name(RNRFC_DEFAULT_DEVICE_NAME);
             else
                 rnrfc_set_advertised_name((char *) data->value.string_value);
             break;
@@ -1131,24 +1616,143 @@ static int handle_write(const cr_ParameterValue *data)
     return rval;
 }
 
+static void nvm_flush_work_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+    parameters_flush_nvm();
+}
+
+// NVM records hold the data type (1 byte) followed by the value: 4 or 8 bytes little-endian for numbers, 1 byte for
+// booleans, or the contents of a string (without its terminator) or byte array.  Returns the size of the record.
+static size_t encode_nvm_record(const cr_ParameterValue *data, uint8_t *record)
+{
+    uint8_t type = (uint8_t) (data->which_value - cr_ParameterValue_uint32_value_tag);
+    size_t size = 0;
+    record[0] = type;
+    // Every member of the value union starts at the same address, so the scalars can be encoded from their raw bits
+    switch (type)
+    {
+    case cr_ParameterDataType_UINT32:
+    case cr_ParameterDataType_INT32:
+    case cr_ParameterDataType_FLOAT32:
+    case cr_ParameterDataType_BIT_FIELD:
+    case cr_ParameterDataType_ENUMERATION:
+        sys_put_le32(data->value.uint32_value, &record[1]);
+        size = sizeof(uint32_t);
+        break;
+    case cr_ParameterDataType_UINT64:
+    case cr_ParameterDataType_INT64:
+    case cr_ParameterDataType_FLOAT64:
+        sys_put_le64(data->value.uint64_value, &record[1]);
+        size = sizeof(uint64_t);
+        break;
+    case cr_ParameterDataType_BOOL:
+        record[1] = data->value.bool_value ? 1:0;
+        size = 1;
+        break;
+    case cr_ParameterDataType_STRING:
+        size = strnlen(data->value.string_value, REACH_PVAL_STRING_LEN - 1);
+        memcpy(&record[1], data->value.string_value, size);
+        break;
+    case cr_ParameterDataType_BYTE_ARRAY:
+        size = MIN(data->value.bytes_value.size, REACH_PVAL_BYTES_LEN);
+        memcpy(&record[1], data->value.bytes_value.bytes, size);
+        break;
+    default:
+        affirm(0);  // should not happen.
+        break;
+    }  // end switch
+    return 1 + size;
+}
+
+// Fills in the value from an NVM record, if the record matches the parameter's description
+static int decode_nvm_record(const uint8_t *record, size_t size, const cr_ParameterInfo *desc, cr_ParameterValue *data)
+{
+    uint8_t type = (uint8_t) (desc->which_desc - cr_ParameterInfo_uint32_desc_tag);
+    if (size < 1 || record[0] != type)
+        return -EINVAL;
+    size--;
+    record++;
+    switch (type)
+    {
+    case cr_ParameterDataType_UINT32:
+    case cr_ParameterDataType_INT32:
+    case cr_ParameterDataType_FLOAT32:
+    case cr_ParameterDataType_BIT_FIELD:
+    case cr_ParameterDataType_ENUMERATION:
+        if (size != sizeof(uint32_t))
+            return -EINVAL;
+        data->value.uint32_value = sys_get_le32(record);
+        break;
+    case cr_ParameterDataType_UINT64:
+    case cr_ParameterDataType_INT64:
+    case cr_ParameterDataType_FLOAT64:
+        if (size != sizeof(uint64_t))
+            return -EINVAL;
+        data->value.uint64_value = sys_get_le64(record);
+        break;
+    case cr_ParameterDataType_BOOL:
+        if (size != 1)
+            return -EINVAL;
+        data->value.bool_value = (record[0] != 0);
+        break;
+    case cr_ParameterDataType_STRING:
+        if (size > MIN(desc->desc.string_desc.max_size, REACH_PVAL_STRING_LEN - 1))
+            return -EINVAL;
+        memcpy(data->value.string_value, record, size);
+        data->value.string_value[size] = 0;
+        break;
+    case cr_ParameterDataType_BYTE_ARRAY:
+        if (size > MIN(desc->desc.bytearray_desc.max_size, REACH_PVAL_BYTES_LEN))
+            return -EINVAL;
+        memcpy(data->value.bytes_value.bytes, record, size);
+        data->value.bytes_value.size = size;
+        break;
+    default:
+        return -EINVAL;
+    }  // end switch
+    data->which_value = type + cr_ParameterValue_uint32_value_tag;
+    return 0;
+}
+
+static int nvm_index_from_id(uint16_t id)
+{
+    uint32_t slot;
+    if (param_index_from_pid(id, &slot) != 0)
+        return -1;
+    return sNvmCacheFromSlot[slot];
+}
+
+static int param_index_from_pid(uint32_t pid, uint32_t *index)
+{
+    if (pid >= PARAM_ID_LOOKUP_SIZE)
+        return sFindIndexFromPid(pid, index);
+    if (sParameterIndexFromPid[pid] == 0)
+        return cr_ErrorCodes_INVALID_ID;
+    *index = sParameterIndexFromPid[pid] - 1;
+    return 0;
+}
+
 static uint32_t calculate_nvm_hash(void)
 {
+    // Only the ID, type and maximum size of each NVM parameter, so that the hash doesn't depend on how the compiler lays
+    // out the descriptions, or on changes to their names or ranges
     uint32_t hash = 0;
-    bool first_param_found = false;
     for (int i = 0; i < NUM_PARAMS; i++)
     {
-        if (sParameterDescriptions[i].storage_location != cr_StorageLocation_NONVOLATILE)
+        const cr_ParameterInfo *desc = &sParameterDescriptions[i];
+        if (desc->storage_location != cr_StorageLocation_NONVOLATILE)
             continue;
-        uint32_t *ptr = (uint32_t*) &sParameterDescriptions[i];
-        if (!first_param_found)
-        {
-            hash = ptr[0];
-            first_param_found = true;
-        }
-        else
-            hash ^= ptr[0];
-        for (size_t i = 1; i < (sizeof(cr_ParameterInfo) / sizeof(uint32_t)); i++)
-            hash ^= ptr[i];
+        uint8_t buf[9];
+        uint32_t max_size = 0;
+        if (desc->which_desc == cr_ParameterDataType_STRING + cr_ParameterInfo_uint32_desc_tag)
+            max_size = desc->desc.string_desc.max_size;
+        else if (desc->which_desc == cr_ParameterDataType_BYTE_ARRAY + cr_ParameterInfo_uint32_desc_tag)
+            max_size = desc->desc.bytearray_desc.max_size;
+        sys_put_le32(desc->id, &buf[0]);
+        buf[4] = (uint8_t) (desc->which_desc - cr_ParameterInfo_uint32_desc_tag);
+        sys_put_le32(max_size, &buf[5]);
+        hash = crc32_ieee_update(hash, buf, sizeof(buf));
     }
     return hash;
 }